@@ -16,6 +16,9 @@
 #include "tcg/tcg.h"
 #include "exec/cpu-common.h"
 #include "exec/exec-all.h"
+#include "exec/tb-profile.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
 
 void tb_flush(CPUState *cpu)
 {
@@ -24,3 +27,28 @@ void tb_flush(CPUState *cpu)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
 }
+
+void tb_profile_enable(const char *level, const char *file, Error **errp)
+{
+}
+
+void tb_speculate_enable(bool enable)
+{
+}
+
+bool tb_speculate(CPUState *cpu)
+{
+    return false;
+}
+
+void tb_speculate_cleanup(CPUState *cpu)
+{
+}
+
+TBProfileInfoList *qmp_x_query_tb_profile(bool has_max, int64_t max,
+                                          bool has_per_insn, bool per_insn,
+                                          Error **errp)
+{
+    error_setg(errp, "TB profiling requires TCG");
+    return NULL;
+}
@@ -32,6 +32,7 @@
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
+#include "sysemu/cpus.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -73,6 +74,331 @@ QEMU_BUILD_BUG_ON(sizeof(target_ulong) > sizeof(run_on_cpu_data));
 QEMU_BUILD_BUG_ON(NB_MMU_MODES > 16);
 #define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
 
+static inline bool tlb_hit_page_anyprot(CPUTLBEntry *tlb_entry,
+                                        target_ulong page)
+{
+    return tlb_hit_page(tlb_entry->addr_read, page) ||
+           tlb_hit_page(tlb_entry->addr_write, page) ||
+           tlb_hit_page(tlb_entry->addr_code, page);
+}
+
+/* Returns true if the entry was flushed */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong page)
+{
+    if (tlb_hit_page_anyprot(tlb_entry, page)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+static inline size_t tlb_n_entries(CPUArchState *env, uintptr_t mmu_idx)
+{
+    return (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+}
+
+static inline size_t sizeof_tlb(CPUArchState *env, uintptr_t mmu_idx)
+{
+    return env->tlb_mask[mmu_idx] + (1 << CPU_TLB_ENTRY_BITS);
+}
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+/*
+ * The TLB of an address space that is not current; see tlb_switch_tag().
+ * The fields are those of CPU_COMMON_TLB_TABLES.
+ */
+struct CPUTLBBank {
+    bool valid;
+    uint32_t tag;
+    CPUTLBDesc d[NB_MMU_MODES];
+    uintptr_t mask[NB_MMU_MODES];
+    CPUTLBEntry *table[NB_MMU_MODES];
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+};
+
+static void tlb_mmu_init(CPUArchState *env, int mmu_idx, size_t n_entries)
+{
+    tlb_window_reset(&env->tlb_d[mmu_idx], get_clock_realtime(), 0);
+    env->tlb_d[mmu_idx].n_used_entries = 0;
+    env->tlb_mask[mmu_idx] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = g_new(CPUTLBEntry, n_entries);
+    env->iotlb[mmu_idx] = g_new(CPUIOTLBEntry, n_entries);
+    memset(env->tlb_table[mmu_idx], -1, sizeof_tlb(env, mmu_idx));
+}
+
+static void tlb_dyn_init(CPUArchState *env)
+{
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        tlb_mmu_init(env, i, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+    }
+    env->tlb_tag = 0;
+    env->tlb_banks = g_new0(CPUTLBBank, CPU_TLB_NB_TAG_BANKS);
+}
+
+/**
+ * tlb_mmu_resize_locked() - perform TLB resize bookkeeping; resize if necessary
+ * @env: CPU that owns the TLB
+ * @mmu_idx: MMU index of the TLB
+ *
+ * Called with tlb_lock held.
+ *
+ * We have two main constraints when resizing a TLB: (1) we only resize it
+ * on a TLB flush (otherwise we'd have to take a perf hit by either rehashing
+ * the array or unnecessarily flushing it), which means we do not control how
+ * frequently the resizing can occur; (2) we don't have access to the guest's
+ * future scheduling decisions, and therefore have to decide the magnitude of
+ * the resize based on past observations.
+ *
+ * The use rate at a flush is the number of entries in use divided by the
+ * size of the TLB.  The TLB doubles when the use rate is above 70%, which
+ * means that the guest's working set does not fit.  It shrinks when the
+ * largest use rate seen in the last 100 ms is below 30%; looking at the
+ * whole window rather than at the current flush avoids shrinking a TLB
+ * that is about to be filled again, for example when the guest flushes
+ * the TLB before switching to a process with a large working set.  The
+ * new size is then the smallest that keeps the use rate of the window
+ * at or below 70%.
+ *
+ * Allocating a large TLB can fail; in that case we keep halving the size
+ * until the allocation succeeds, or we hit the minimum size.
+ */
+static void tlb_mmu_resize_locked(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t rate;
+    size_t new_size = old_size;
+    int64_t now = get_clock_realtime();
+    int64_t window_len_ms = 100;
+    int64_t window_len_ns = window_len_ms * 1000 * 1000;
+    bool window_expired = now > desc->window_begin_ns + window_len_ns;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+        size_t expected_rate = desc->window_max_entries * 100 / ceil;
+
+        /*
+         * Avoid undersizing when the max number of entries seen is just below
+         * a pow2.  For instance, if max_entries == 1025, the expected use rate
+         * would be 1025/2048==50%.  However, if max_entries == 1023, we'd get
+         * 1023/1024==99.9% use rate, so we'd likely end up doubling the size
+         * later.  Thus, make sure that the expected use rate remains below 70%.
+         * (and since we double the size, that means the lowest rate we'd
+         * expect to get is 35%, which is still in the 30-70% range where
+         * we consider that the size is appropriate.)
+         */
+        if (expected_rate > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(env->tlb_table[mmu_idx]);
+    g_free(env->iotlb[mmu_idx]);
+
+    tlb_window_reset(desc, now, 0);
+    /* desc->n_used_entries is cleared by the caller */
+    env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+    env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    /*
+     * If the allocations fail, try smaller sizes.  We just freed some
+     * memory, so going back to half of new_size has a good chance of working.
+     * Increased memory pressure elsewhere in the system might cause the
+     * allocations to fail though, so we progressively reduce the allocation
+     * size, aborting if we cannot even allocate the smallest TLB we support.
+     */
+    while (env->tlb_table[mmu_idx] == NULL || env->iotlb[mmu_idx] == NULL) {
+        if (new_size == (1 << CPU_TLB_DYN_MIN_BITS)) {
+            error_report("%s: %s", __func__, strerror(errno));
+            abort();
+        }
+        new_size = MAX(new_size >> 1, 1 << CPU_TLB_DYN_MIN_BITS);
+        env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+
+        g_free(env->tlb_table[mmu_idx]);
+        g_free(env->iotlb[mmu_idx]);
+        env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+        env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    }
+}
+
+static inline void tlb_table_flush_by_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    tlb_mmu_resize_locked(env, mmu_idx);
+    memset(env->tlb_table[mmu_idx], -1, sizeof_tlb(env, mmu_idx));
+    env->tlb_d[mmu_idx].n_used_entries = 0;
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, uintptr_t mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries++;
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, uintptr_t mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries--;
+}
+
+static void tlb_bank_free(CPUTLBBank *bank)
+{
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        g_free(bank->table[i]);
+        g_free(bank->iotlb[i]);
+    }
+    memset(bank, 0, sizeof(*bank));
+}
+
+/* Move the current TLB tables of @env to @bank */
+static void tlb_bank_save(CPUArchState *env, CPUTLBBank *bank)
+{
+    bank->valid = true;
+    bank->tag = env->tlb_tag;
+    memcpy(bank->d, env->tlb_d, sizeof(bank->d));
+    memcpy(bank->mask, env->tlb_mask, sizeof(bank->mask));
+    memcpy(bank->table, env->tlb_table, sizeof(bank->table));
+    memcpy(bank->iotlb, env->iotlb, sizeof(bank->iotlb));
+}
+
+/* Make the tables of @bank current; the previous ones must be saved or freed */
+static void tlb_bank_load(CPUArchState *env, CPUTLBBank *bank)
+{
+    memcpy(env->tlb_d, bank->d, sizeof(bank->d));
+    memcpy(env->tlb_mask, bank->mask, sizeof(bank->mask));
+    memcpy(env->tlb_table, bank->table, sizeof(bank->table));
+    memcpy(env->iotlb, bank->iotlb, sizeof(bank->iotlb));
+    memset(bank, 0, sizeof(*bank));
+}
+
+/* Called with tlb_lock held */
+static void tlb_banks_flush_locked(CPUArchState *env)
+{
+    int i;
+
+    for (i = 0; i < CPU_TLB_NB_TAG_BANKS; i++) {
+        if (env->tlb_banks[i].valid) {
+            tlb_bank_free(&env->tlb_banks[i]);
+        }
+    }
+}
+
+/*
+ * Flush @page from the TLBs of the other address spaces as well.  This
+ * is more than what a guest asks for when it flushes a page of the
+ * current address space, but pages that are mapped in every address
+ * space (such as x86 global pages) rely on it.
+ */
+static void tlb_banks_flush_page(CPUArchState *env, target_ulong page,
+                                 unsigned long mmu_idx_bitmap)
+{
+    int i, mmu_idx;
+
+    for (i = 0; i < CPU_TLB_NB_TAG_BANKS; i++) {
+        CPUTLBBank *bank = &env->tlb_banks[i];
+
+        if (!bank->valid) {
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            uintptr_t size_mask = bank->mask[mmu_idx] >> CPU_TLB_ENTRY_BITS;
+            uintptr_t index = (page >> TARGET_PAGE_BITS) & size_mask;
+
+            if (test_bit(mmu_idx, &mmu_idx_bitmap) &&
+                tlb_flush_entry(&bank->table[mmu_idx][index], page)) {
+                bank->d[mmu_idx].n_used_entries--;
+            }
+        }
+    }
+}
+#else /* !TCG_TARGET_IMPLEMENTS_DYN_TLB */
+static inline size_t tlb_n_entries(CPUArchState *env, uintptr_t mmu_idx)
+{
+    return CPU_TLB_SIZE;
+}
+
+static inline void tlb_dyn_init(CPUArchState *env)
+{
+}
+
+static inline void tlb_table_flush_by_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, uintptr_t mmu_idx)
+{
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, uintptr_t mmu_idx)
+{
+}
+
+static inline void tlb_banks_flush_locked(CPUArchState *env)
+{
+}
+
+static inline void tlb_banks_flush_page(CPUArchState *env, target_ulong page,
+                                        unsigned long mmu_idx_bitmap)
+{
+}
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+
+    qemu_spin_init(&env->tlb_lock);
+    tlb_dyn_init(env);
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        g_free(env->tlb_table[i]);
+        g_free(env->iotlb[i]);
+        env->tlb_table[i] = NULL;
+        env->iotlb[i] = NULL;
+    }
+    tlb_banks_flush_locked(env);
+    g_free(env->tlb_banks);
+    env->tlb_banks = NULL;
+#endif
+}
+
 /* flush_all_helper: run fn across all cpus
  *
  * If the wait flag is set then the src cpu's helper will be queued as
@@ -113,6 +439,7 @@ size_t tlb_flush_count(void)
 static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     /* The QOM tests will trigger tlb_flushes without setting up TCG
      * so we bug out here in that case.
@@ -125,8 +452,13 @@ static void tlb_flush_nocheck(CPUState *cpu)
     atomic_set(&env->tlb_flush_count, env->tlb_flush_count + 1);
     tlb_debug("(count: %zu)\n", tlb_flush_count());
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    qemu_spin_lock(&env->tlb_lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_table_flush_by_mmuidx(env, mmu_idx);
+    }
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    tlb_banks_flush_locked(env);
+    qemu_spin_unlock(&env->tlb_lock);
     cpu_tb_jmp_cache_clear(cpu);
 
     env->vtlb_index = 0;
@@ -168,6 +500,164 @@ void tlb_flush_all_cpus_synced(CPUState *src_cpu)
     async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_NULL);
 }
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Called with tlb_lock held */
+static bool tlb_is_empty_locked(CPUArchState *env)
+{
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (env->tlb_d[mmu_idx].n_used_entries) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tlb_switch_tag_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBBank *banks = env->tlb_banks;
+    CPUTLBBank next = { 0 }, spare = { 0 };
+    uint32_t tag = data.host_int;
+    int i, mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    if (tag == env->tlb_tag) {
+        return;
+    }
+    tlb_debug("tag: %" PRIu32 " -> %" PRIu32 "\n", env->tlb_tag, tag);
+
+    qemu_spin_lock(&env->tlb_lock);
+
+    /* Take out the TLB of the new address space, if we still have it */
+    for (i = 0; i < CPU_TLB_NB_TAG_BANKS; i++) {
+        if (banks[i].valid && banks[i].tag == tag) {
+            next = banks[i];
+            memmove(&banks[i], &banks[i + 1],
+                    (CPU_TLB_NB_TAG_BANKS - 1 - i) * sizeof(banks[0]));
+            memset(&banks[CPU_TLB_NB_TAG_BANKS - 1], 0, sizeof(banks[0]));
+            break;
+        }
+    }
+
+    if (tlb_is_empty_locked(env)) {
+        /* Nothing worth keeping; the tables can serve the new tag as is */
+        if (next.valid) {
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                g_free(env->tlb_table[mmu_idx]);
+                g_free(env->iotlb[mmu_idx]);
+            }
+            tlb_bank_load(env, &next);
+        }
+    } else {
+        /* Keep the current TLB as the most recently used bank */
+        spare = banks[CPU_TLB_NB_TAG_BANKS - 1];
+        memmove(&banks[1], &banks[0],
+                (CPU_TLB_NB_TAG_BANKS - 1) * sizeof(banks[0]));
+        tlb_bank_save(env, &banks[0]);
+
+        if (next.valid) {
+            tlb_bank_load(env, &next);
+            if (spare.valid) {
+                tlb_bank_free(&spare);
+            }
+        } else if (spare.valid) {
+            /* Recycle the tables of the least recently used address space */
+            tlb_bank_load(env, &spare);
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                tlb_table_flush_by_mmuidx(env, mmu_idx);
+            }
+        } else {
+            /* Start with the size that the previous address space needed */
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                uintptr_t mask = banks[0].mask[mmu_idx];
+
+                tlb_mmu_init(env, mmu_idx, (mask >> CPU_TLB_ENTRY_BITS) + 1);
+            }
+        }
+    }
+
+    env->tlb_tag = tag;
+    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    env->vtlb_index = 0;
+    qemu_spin_unlock(&env->tlb_lock);
+
+    cpu_tb_jmp_cache_clear(cpu);
+}
+
+static void tlb_flush_tag_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint32_t tag = data.host_int;
+    int i, mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("tag: %" PRIu32 "\n", tag);
+
+    qemu_spin_lock(&env->tlb_lock);
+    if (tag == env->tlb_tag) {
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            tlb_table_flush_by_mmuidx(env, mmu_idx);
+        }
+        memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+        env->vtlb_index = 0;
+        qemu_spin_unlock(&env->tlb_lock);
+        cpu_tb_jmp_cache_clear(cpu);
+        return;
+    }
+
+    for (i = 0; i < CPU_TLB_NB_TAG_BANKS; i++) {
+        if (env->tlb_banks[i].valid && env->tlb_banks[i].tag == tag) {
+            tlb_bank_free(&env->tlb_banks[i]);
+        }
+    }
+    qemu_spin_unlock(&env->tlb_lock);
+}
+#else
+static void tlb_switch_tag_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    /* The TLB tables are part of env and cannot be swapped */
+    tlb_flush_nocheck(cpu);
+}
+
+static void tlb_flush_tag_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_flush_nocheck(cpu);
+}
+#endif
+
+void tlb_switch_tag(CPUState *cpu, uint32_t tag)
+{
+    /* As in tlb_flush_nocheck(), there are no tables without TCG */
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    if (cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_switch_tag_async_work,
+                         RUN_ON_CPU_HOST_INT(tag));
+    } else {
+        tlb_switch_tag_async_work(cpu, RUN_ON_CPU_HOST_INT(tag));
+    }
+}
+
+void tlb_flush_tag(CPUState *cpu, uint32_t tag)
+{
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    if (cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_tag_async_work,
+                         RUN_ON_CPU_HOST_INT(tag));
+    } else {
+        tlb_flush_tag_async_work(cpu, RUN_ON_CPU_HOST_INT(tag));
+    }
+}
+
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -178,15 +668,19 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 
     tlb_debug("start: mmu_idx:0x%04lx\n", mmu_idx_bitmask);
 
+    qemu_spin_lock(&env->tlb_lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
 
         if (test_bit(mmu_idx, &mmu_idx_bitmask)) {
             tlb_debug("%d\n", mmu_idx);
 
-            memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+            tlb_table_flush_by_mmuidx(env, mmu_idx);
             memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
         }
     }
+    /* Not worth flushing the other address spaces one MMU mode at a time */
+    tlb_banks_flush_locked(env);
+    qemu_spin_unlock(&env->tlb_lock);
 
     cpu_tb_jmp_cache_clear(cpu);
 
@@ -235,21 +729,6 @@ void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
-static inline bool tlb_hit_page_anyprot(CPUTLBEntry *tlb_entry,
-                                        target_ulong page)
-{
-    return tlb_hit_page(tlb_entry->addr_read, page) ||
-           tlb_hit_page(tlb_entry->addr_write, page) ||
-           tlb_hit_page(tlb_entry->addr_code, page);
-}
-
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong page)
-{
-    if (tlb_hit_page_anyprot(tlb_entry, page)) {
-        memset(tlb_entry, -1, sizeof(*tlb_entry));
-    }
-}
-
 static inline void tlb_flush_vtlb_page(CPUArchState *env, int mmu_idx,
                                        target_ulong page)
 {
@@ -263,7 +742,6 @@ static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
     target_ulong addr = (target_ulong) data.target_ptr;
-    int i;
     int mmu_idx;
 
     assert_cpu_is_self(cpu);
@@ -281,11 +759,13 @@ static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+            tlb_n_used_entries_dec(env, mmu_idx);
+        }
         tlb_flush_vtlb_page(env, mmu_idx, addr);
     }
+    tlb_banks_flush_page(env, addr, ALL_MMUIDX_BITS);
 
     tb_flush_jmp_cache(cpu, addr);
 }
@@ -314,20 +794,22 @@ static void tlb_flush_page_by_mmuidx_async_work(CPUState *cpu,
     target_ulong addr_and_mmuidx = (target_ulong) data.target_ptr;
     target_ulong addr = addr_and_mmuidx & TARGET_PAGE_MASK;
     unsigned long mmu_idx_bitmap = addr_and_mmuidx & ALL_MMUIDX_BITS;
-    int page = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     int mmu_idx;
 
     assert_cpu_is_self(cpu);
 
-    tlb_debug("page:%d addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
-              page, addr, mmu_idx_bitmap);
+    tlb_debug("addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
+              addr, mmu_idx_bitmap);
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         if (test_bit(mmu_idx, &mmu_idx_bitmap)) {
-            tlb_flush_entry(&env->tlb_table[mmu_idx][page], addr);
+            if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+                tlb_n_used_entries_dec(env, mmu_idx);
+            }
             tlb_flush_vtlb_page(env, mmu_idx, addr);
         }
     }
+    tlb_banks_flush_page(env, addr, mmu_idx_bitmap);
 
     tb_flush_jmp_cache(cpu, addr);
 }
@@ -515,19 +997,25 @@ static inline void copy_tlb_helper(CPUTLBEntry *d, CPUTLBEntry *s,
 /* This is a cross vCPU call (i.e. another vCPU resetting the flags of
  * the target vCPU). As such care needs to be taken that we don't
  * dangerously race with another vCPU update. The only thing actually
- * updated is the target TLB entry ->addr_write flags.
+ * updated is the target TLB entry ->addr_write flags.  tlb_lock keeps
+ * the target vCPU from resizing its TLB under our feet.
  */
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
 
     int mmu_idx;
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int b;
+#endif
 
     env = cpu->env_ptr;
+    qemu_spin_lock(&env->tlb_lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
+        unsigned int n = tlb_n_entries(env, mmu_idx);
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        for (i = 0; i < n; i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
@@ -537,6 +1025,26 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    /* The other address spaces may come back without a flush */
+    for (b = 0; b < CPU_TLB_NB_TAG_BANKS; b++) {
+        CPUTLBBank *bank = &env->tlb_banks[b];
+
+        if (!bank->valid) {
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            size_t i, n = (bank->mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+
+            for (i = 0; i < n; i++) {
+                tlb_reset_dirty_range(&bank->table[mmu_idx][i],
+                                      start1, length);
+            }
+        }
+    }
+#endif
+    qemu_spin_unlock(&env->tlb_lock);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -551,15 +1059,13 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     assert_cpu_is_self(cpu);
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -606,7 +1112,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 {
     CPUArchState *env = cpu->env_ptr;
     MemoryRegionSection *section;
-    unsigned int index;
+    uintptr_t index;
     target_ulong address;
     target_ulong code_address;
     uintptr_t addend;
@@ -661,14 +1167,16 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr_page,
                                             paddr_page, xlat, prot, &address);
 
-    index = (vaddr_page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    te = &env->tlb_table[mmu_idx][index];
+    index = tlb_index(env, mmu_idx, vaddr_page);
+    te = tlb_entry(env, mmu_idx, vaddr_page);
 
     /*
      * Only evict the old entry to the victim tlb if it's for a
      * different page; otherwise just overwrite the stale data.
      */
-    if (!tlb_hit_page_anyprot(te, vaddr_page)) {
+    if (tlb_entry_is_empty(te)) {
+        tlb_n_used_entries_inc(env, mmu_idx);
+    } else if (!tlb_hit_page_anyprot(te, vaddr_page)) {
         unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
         CPUTLBEntry *tv = &env->tlb_v_table[mmu_idx][vidx];
 
@@ -786,6 +1294,65 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/*
+ * Writes to coalesced MMIO ranges are queued, as KVM does, until
+ * qemu_flush_coalesced_mmio_buffer() or an access to a region marked with
+ * memory_region_set_flush_coalesced().  The queue is shared by all vCPUs
+ * and protected by the iothread lock.
+ */
+#define TCG_COALESCED_MMIO_MAX 256
+
+typedef struct TCGCoalescedMMIO {
+    MemoryRegion *mr;
+    hwaddr addr;
+    uint64_t val;
+    unsigned size;
+    MemTxAttrs attrs;
+} TCGCoalescedMMIO;
+
+static TCGCoalescedMMIO coalesced_mmio[TCG_COALESCED_MMIO_MAX];
+static int coalesced_mmio_len;
+static bool coalesced_flush_in_progress;
+
+void tcg_flush_coalesced_mmio_buffer(void)
+{
+    int i;
+
+    if (coalesced_flush_in_progress) {
+        return;
+    }
+
+    coalesced_flush_in_progress = true;
+    for (i = 0; i < coalesced_mmio_len; i++) {
+        TCGCoalescedMMIO *ent = &coalesced_mmio[i];
+
+        memory_region_dispatch_write(ent->mr, ent->addr, ent->val,
+                                     ent->size, ent->attrs);
+        memory_region_unref(ent->mr);
+    }
+    coalesced_mmio_len = 0;
+    coalesced_flush_in_progress = false;
+}
+
+static void coalesced_mmio_write(MemoryRegion *mr, hwaddr addr,
+                                 uint64_t val, unsigned size,
+                                 MemTxAttrs attrs)
+{
+    TCGCoalescedMMIO *ent;
+
+    if (coalesced_mmio_len == TCG_COALESCED_MMIO_MAX) {
+        tcg_flush_coalesced_mmio_buffer();
+    }
+
+    ent = &coalesced_mmio[coalesced_mmio_len++];
+    memory_region_ref(mr);
+    ent->mr = mr;
+    ent->addr = addr;
+    ent->val = val;
+    ent->size = size;
+    ent->attrs = attrs;
+}
+
 static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
                          int mmu_idx,
                          target_ulong addr, uintptr_t retaddr,
@@ -806,16 +1373,16 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
          * repeat the MMU check here. This tlb_fill() call might
          * longjump out if this access should cause a guest exception.
          */
-        int index;
+        CPUTLBEntry *entry;
         target_ulong tlb_addr;
 
         tlb_fill(cpu, addr, size, MMU_DATA_LOAD, mmu_idx, retaddr);
 
-        index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-        tlb_addr = env->tlb_table[mmu_idx][index].addr_read;
+        entry = tlb_entry(env, mmu_idx, addr);
+        tlb_addr = entry->addr_read;
         if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK))) {
             /* RAM access */
-            uintptr_t haddr = addr + env->tlb_table[mmu_idx][index].addend;
+            uintptr_t haddr = addr + entry->addend;
 
             return ldn_p((void *)haddr, size);
         }
@@ -832,10 +1399,14 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
 
-    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+    if ((mr->global_locking || mr->flush_coalesced_mmio) &&
+        !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
+    if (mr->flush_coalesced_mmio) {
+        tcg_flush_coalesced_mmio_buffer();
+    }
     r = memory_region_dispatch_read(mr, mr_offset,
                                     &val, size, iotlbentry->attrs);
     if (r != MEMTX_OK) {
@@ -872,16 +1443,16 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
          * repeat the MMU check here. This tlb_fill() call might
          * longjump out if this access should cause a guest exception.
          */
-        int index;
+        CPUTLBEntry *entry;
         target_ulong tlb_addr;
 
         tlb_fill(cpu, addr, size, MMU_DATA_STORE, mmu_idx, retaddr);
 
-        index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+        entry = tlb_entry(env, mmu_idx, addr);
+        tlb_addr = entry->addr_write;
         if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK))) {
             /* RAM access */
-            uintptr_t haddr = addr + env->tlb_table[mmu_idx][index].addend;
+            uintptr_t haddr = addr + entry->addend;
 
             stn_p((void *)haddr, size, val);
             return;
@@ -898,10 +1469,19 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
 
-    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+    if ((mr->global_locking || mr->flush_coalesced_mmio) &&
+        !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
+    if (mr->flush_coalesced_mmio) {
+        /* With icount, the device must see the write at this instruction */
+        if (!use_icount && memory_region_is_coalesced(mr, mr_offset, size)) {
+            coalesced_mmio_write(mr, mr_offset, val, size, iotlbentry->attrs);
+            goto out;
+        }
+        tcg_flush_coalesced_mmio_buffer();
+    }
     r = memory_region_dispatch_write(mr, mr_offset,
                                      val, size, iotlbentry->attrs);
     if (r != MEMTX_OK) {
@@ -912,6 +1492,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_transaction_failed(cpu, physaddr, addr, size, MMU_DATA_STORE,
                                mmu_idx, iotlbentry->attrs, r, retaddr);
     }
+out:
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -931,6 +1512,9 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             /* Found entry in victim tlb, swap tlb and iotlb.  */
             CPUTLBEntry tmptlb, *tlb = &env->tlb_table[mmu_idx][index];
 
+            if (tlb_entry_is_empty(tlb)) {
+                tlb_n_used_entries_inc(env, mmu_idx);
+            }
             copy_tlb_helper(&tmptlb, tlb, false);
             copy_tlb_helper(tlb, vtlb, true);
             copy_tlb_helper(vtlb, &tmptlb, true);
@@ -956,7 +1540,9 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
  */
 tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
 {
-    int mmu_idx, index;
+    uintptr_t mmu_idx = cpu_mmu_index(env, true);
+    uintptr_t index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *entry = tlb_entry(env, mmu_idx, addr);
     void *p;
     MemoryRegion *mr;
     MemoryRegionSection *section;
@@ -964,15 +1550,15 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
     CPUIOTLBEntry *iotlbentry;
     hwaddr physaddr, mr_offset;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    mmu_idx = cpu_mmu_index(env, true);
-    if (unlikely(!tlb_hit(env->tlb_table[mmu_idx][index].addr_code, addr))) {
+    if (unlikely(!tlb_hit(entry->addr_code, addr))) {
         if (!VICTIM_TLB_HIT(addr_read, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, 0, MMU_INST_FETCH, mmu_idx, 0);
+            index = tlb_index(env, mmu_idx, addr);
+            entry = tlb_entry(env, mmu_idx, addr);
         }
     }
 
-    if (unlikely((env->tlb_table[mmu_idx][index].addr_code &
+    if (unlikely((entry->addr_code &
                   (TLB_RECHECK | TLB_INVALID_MASK)) == TLB_RECHECK)) {
         /*
          * This is a TLB_RECHECK access, where the MMU protection
@@ -980,13 +1566,13 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
          * repeat the MMU check here. This tlb_fill() call might
          * longjump out if this access should cause a guest exception.
          */
-        int index;
         target_ulong tlb_addr;
 
         tlb_fill(cpu, addr, 0, MMU_INST_FETCH, mmu_idx, 0);
 
-        index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-        tlb_addr = env->tlb_table[mmu_idx][index].addr_code;
+        index = tlb_index(env, mmu_idx, addr);
+        entry = tlb_entry(env, mmu_idx, addr);
+        tlb_addr = entry->addr_code;
         if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK))) {
             /* RAM access. We can't handle this, so for now just stop */
             cpu_abort(cpu, "Unable to handle guest executing from RAM within "
@@ -1036,10 +1622,21 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
         report_bad_exec(cpu, addr);
         exit(1);
     }
-    p = (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
+    p = (void *)((uintptr_t)addr + entry->addend);
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Like get_page_addr_code(), but never fills the TLB or raises an
+ * exception: returns true only if @addr is RAM with a valid code mapping.
+ */
+bool tlb_probe_code(CPUArchState *env, target_ulong addr)
+{
+    CPUTLBEntry *entry = tlb_entry(env, cpu_mmu_index(env, true), addr);
+
+    return tlb_hit(entry->addr_code, addr) &&
+           !(entry->addr_code & TLB_FLAGS_MASK);
+}
+
 /* Probe for whether the specified guest write access is permitted.
  * If it is not permitted then an exception will be taken in the same
  * way as if this were a real write access (and we will not return).
@@ -1049,10 +1646,10 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    uintptr_t index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *entry = tlb_entry(env, mmu_idx, addr);
 
-    if (!tlb_hit(tlb_addr, addr)) {
+    if (!tlb_hit(entry->addr_write, addr)) {
         /* TLB entry is for a different page */
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, size, MMU_DATA_STORE,
@@ -1068,8 +1665,8 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
                                NotDirtyInfo *ndi)
 {
     size_t mmu_idx = get_mmuidx(oi);
-    size_t index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
+    uintptr_t index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlbe = tlb_entry(env, mmu_idx, addr);
     target_ulong tlb_addr = tlbe->addr_write;
     TCGMemOp mop = get_memop(oi);
     int a_bits = get_alignment_bits(mop);
@@ -1100,6 +1697,8 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, 1 << s_bits, MMU_DATA_STORE,
                      mmu_idx, retaddr);
+            index = tlb_index(env, mmu_idx, addr);
+            tlbe = tlb_entry(env, mmu_idx, addr);
         }
         tlb_addr = tlbe->addr_write & ~TLB_INVALID_MASK;
     }
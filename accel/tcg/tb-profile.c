@@ -0,0 +1,215 @@
+/*
+ * Execution counters for translated guest code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+#include "qemu/thread.h"
+#include "exec/tb-profile.h"
+
+#define TB_PROFILE_DEFAULT_MAX 20
+
+TBProfileLevel tb_profile_level;
+
+/*
+ * Entries are never freed, since translated code may still point to their
+ * counters.  The lock only protects the hash tables; the counters are
+ * updated by the translated code without it.
+ */
+static QemuMutex tb_profile_lock;
+static GHashTable *tb_profile_tbs;
+static GHashTable *tb_profile_insns;
+static char *tb_profile_file;
+
+static TBProfileEntry *tb_profile_get(GHashTable *table, uint64_t pc)
+{
+    TBProfileEntry *e;
+
+    qemu_mutex_lock(&tb_profile_lock);
+    e = g_hash_table_lookup(table, &pc);
+    if (!e) {
+        e = g_new0(TBProfileEntry, 1);
+        e->pc = pc;
+        g_hash_table_insert(table, &e->pc, e);
+    }
+    qemu_mutex_unlock(&tb_profile_lock);
+    return e;
+}
+
+TBProfileEntry *tb_profile_get_tb(uint64_t pc)
+{
+    return tb_profile_get(tb_profile_tbs, pc);
+}
+
+TBProfileEntry *tb_profile_get_insn(uint64_t pc)
+{
+    return tb_profile_get(tb_profile_insns, pc);
+}
+
+static uint64_t tb_profile_insns_executed(const TBProfileEntry *e)
+{
+    return e->icount ? e->count * e->icount : e->count;
+}
+
+static gint tb_profile_compare(gconstpointer a, gconstpointer b)
+{
+    uint64_t na = tb_profile_insns_executed(*(TBProfileEntry **)a);
+    uint64_t nb = tb_profile_insns_executed(*(TBProfileEntry **)b);
+
+    return na > nb ? -1 : na < nb;
+}
+
+/* Returns the entries of @table, hottest first */
+static GPtrArray *tb_profile_sorted(GHashTable *table)
+{
+    GPtrArray *entries = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer value;
+
+    qemu_mutex_lock(&tb_profile_lock);
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(entries, value);
+    }
+    qemu_mutex_unlock(&tb_profile_lock);
+
+    g_ptr_array_sort(entries, tb_profile_compare);
+    return entries;
+}
+
+static void tb_profile_dump_table(FILE *f, fprintf_function cpu_fprintf,
+                                  GHashTable *table, int max, bool insns)
+{
+    GPtrArray *entries = tb_profile_sorted(table);
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < entries->len; i++) {
+        total += tb_profile_insns_executed(g_ptr_array_index(entries, i));
+    }
+
+    cpu_fprintf(f, "%-18s %14s %14s %7s", "pc", "count", "insns", "%");
+    if (insns && tb_profile_level >= TB_PROFILE_MEM) {
+        cpu_fprintf(f, " %14s", "mem accesses");
+    }
+    cpu_fprintf(f, "\n");
+
+    for (i = 0; i < entries->len && i < max; i++) {
+        TBProfileEntry *e = g_ptr_array_index(entries, i);
+        uint64_t n = tb_profile_insns_executed(e);
+
+        cpu_fprintf(f, "0x%016" PRIx64 " %14" PRIu64 " %14" PRIu64
+                    " %6.2f%%", e->pc, e->count, n,
+                    total ? n * 100.0 / total : 0.0);
+        if (insns && tb_profile_level >= TB_PROFILE_MEM) {
+            cpu_fprintf(f, " %14" PRIu64, e->mem_accesses);
+        }
+        cpu_fprintf(f, "\n");
+    }
+    g_ptr_array_free(entries, true);
+}
+
+void tb_profile_dump(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    if (tb_profile_level == TB_PROFILE_OFF) {
+        cpu_fprintf(f, "TB profiling is not enabled\n");
+        return;
+    }
+
+    cpu_fprintf(f, "Hottest translated blocks:\n");
+    tb_profile_dump_table(f, cpu_fprintf, tb_profile_tbs, max, false);
+    if (tb_profile_level >= TB_PROFILE_INSN) {
+        cpu_fprintf(f, "\nHottest instructions:\n");
+        tb_profile_dump_table(f, cpu_fprintf, tb_profile_insns, max, true);
+    }
+}
+
+static void tb_profile_dump_at_exit(void)
+{
+    FILE *f = fopen(tb_profile_file, "w");
+
+    if (!f) {
+        fprintf(stderr, "Could not write TB profile to %s: %s\n",
+                tb_profile_file, strerror(errno));
+        return;
+    }
+    tb_profile_dump(f, fprintf, INT_MAX);
+    fclose(f);
+}
+
+void tb_profile_enable(const char *level, const char *file, Error **errp)
+{
+    TBProfileLevel new_level;
+
+    if (!strcmp(level, "off")) {
+        new_level = TB_PROFILE_OFF;
+    } else if (!strcmp(level, "tb")) {
+        new_level = TB_PROFILE_TB;
+    } else if (!strcmp(level, "insn")) {
+        new_level = TB_PROFILE_INSN;
+    } else if (!strcmp(level, "mem")) {
+        new_level = TB_PROFILE_MEM;
+    } else {
+        error_setg(errp, "Invalid 'profile' setting %s", level);
+        return;
+    }
+
+    if (new_level == TB_PROFILE_OFF) {
+        return;
+    }
+    if (!tb_profile_tbs) {
+        qemu_mutex_init(&tb_profile_lock);
+        tb_profile_tbs = g_hash_table_new(g_int64_hash, g_int64_equal);
+        tb_profile_insns = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+    tb_profile_level = new_level;
+
+    if (file && !tb_profile_file) {
+        tb_profile_file = g_strdup(file);
+        atexit(tb_profile_dump_at_exit);
+    }
+}
+
+TBProfileInfoList *qmp_x_query_tb_profile(bool has_max, int64_t max,
+                                          bool has_per_insn, bool per_insn,
+                                          Error **errp)
+{
+    TBProfileInfoList *head = NULL, **tail = &head;
+    GPtrArray *entries;
+    int i;
+
+    if (tb_profile_level == TB_PROFILE_OFF) {
+        error_setg(errp, "TB profiling is not enabled");
+        return NULL;
+    }
+    if (per_insn && tb_profile_level < TB_PROFILE_INSN) {
+        error_setg(errp, "Instructions are not counted");
+        return NULL;
+    }
+    if (!has_max) {
+        max = TB_PROFILE_DEFAULT_MAX;
+    }
+
+    entries = tb_profile_sorted(per_insn ? tb_profile_insns : tb_profile_tbs);
+    for (i = 0; i < entries->len && i < max; i++) {
+        TBProfileEntry *e = g_ptr_array_index(entries, i);
+        TBProfileInfoList *elem = g_new0(TBProfileInfoList, 1);
+
+        elem->value = g_new0(TBProfileInfo, 1);
+        elem->value->pc = e->pc;
+        elem->value->count = e->count;
+        elem->value->insns = tb_profile_insns_executed(e);
+        if (per_insn && tb_profile_level >= TB_PROFILE_MEM) {
+            elem->value->has_mem_accesses = true;
+            elem->value->mem_accesses = e->mem_accesses;
+        }
+        *tail = elem;
+        tail = &elem->next;
+    }
+    g_ptr_array_free(entries, true);
+    return head;
+}
@@ -0,0 +1,142 @@
+/*
+ * Speculative translation of successor TBs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/tb-hash.h"
+#include "qemu/rcu.h"
+#include "tcg.h"
+
+/*
+ * The direct jump targets of newly translated TBs are queued per vCPU and
+ * translated when the vCPU is halted, so that they are ready when they are
+ * first executed.  Translation reads the vCPU's registers and TLB, so the
+ * queue is only accessed by the thread running the vCPU, and only entries
+ * that match the current cs_base and flags are translated.
+ *
+ * The successors of speculatively translated TBs are queued too, up to
+ * TB_SPECULATE_MAX_DEPTH jumps away from a TB that was actually executed.
+ */
+
+#define TB_SPECULATE_QUEUE_LEN 16
+#define TB_SPECULATE_MAX_DEPTH 2
+
+typedef struct TBSpeculateEntry {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    unsigned depth;
+} TBSpeculateEntry;
+
+typedef struct TBSpeculateQueue {
+    TBSpeculateEntry entries[TB_SPECULATE_QUEUE_LEN];
+    unsigned first;     /* oldest entry */
+    unsigned len;
+    unsigned depth;     /* of the successors of the TB being translated */
+} TBSpeculateQueue;
+
+static bool tb_speculate_enabled;
+
+void tb_speculate_enable(bool enable)
+{
+    tb_speculate_enabled = enable;
+}
+
+void tb_speculate_queue(CPUState *cpu, target_ulong pc,
+                        target_ulong cs_base, uint32_t flags)
+{
+    TBSpeculateQueue *q = cpu->tb_speculate_queue;
+    TBSpeculateEntry *e;
+
+    if (!tb_speculate_enabled) {
+        return;
+    }
+    if (!q) {
+        q = cpu->tb_speculate_queue = g_new0(TBSpeculateQueue, 1);
+    }
+    if (q->depth >= TB_SPECULATE_MAX_DEPTH) {
+        return;
+    }
+    /* Recent jumps are more likely to be taken, drop the oldest one */
+    if (q->len == TB_SPECULATE_QUEUE_LEN) {
+        q->first = (q->first + 1) % TB_SPECULATE_QUEUE_LEN;
+        q->len--;
+    }
+    e = &q->entries[(q->first + q->len) % TB_SPECULATE_QUEUE_LEN];
+    e->pc = pc;
+    e->cs_base = cs_base;
+    e->flags = flags;
+    e->depth = q->depth;
+    q->len++;
+}
+
+bool tb_speculate(CPUState *cpu)
+{
+    TBSpeculateQueue *q = cpu->tb_speculate_queue;
+    CPUArchState *env = cpu->env_ptr;
+    TBSpeculateEntry e;
+    target_ulong pc, cs_base;
+    uint32_t flags, cflags;
+    TranslationBlock *tb;
+
+    if (!q || !q->len) {
+        return false;
+    }
+    q->len--;
+    e = q->entries[(q->first + q->len) % TB_SPECULATE_QUEUE_LEN];
+
+    /* Leave the code buffer to the TBs that are actually executed */
+    if (tcg_code_size() > tcg_code_capacity() / 2) {
+        q->len = 0;
+        return false;
+    }
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    if (e.cs_base != cs_base || e.flags != flags ||
+        cpu->singlestep_enabled || singlestep) {
+        return true;
+    }
+    /*
+     * The translator must not fault or read from MMIO, so only translate
+     * code that the TLB maps to RAM, including the following page that
+     * the TB may extend to.
+     */
+    if (!tlb_probe_code(env, e.pc) ||
+        !tlb_probe_code(env, (e.pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE)) {
+        return true;
+    }
+
+    cflags = curr_cflags();
+    q->depth = e.depth + 1;
+    rcu_read_lock();
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        tb = tb_htable_lookup(cpu, e.pc, cs_base, flags, cflags);
+        if (tb == NULL) {
+            mmap_lock();
+            tb = tb_gen_code(cpu, e.pc, cs_base, flags, cflags);
+            mmap_unlock();
+            atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(e.pc)], tb);
+        }
+    } else {
+        /*
+         * tb_gen_code() ran out of space and queued a TB flush, which
+         * also makes the queued PCs useless.
+         */
+        cpu->exception_index = -1;
+        cpu->tb_speculate_queue->len = 0;
+    }
+    rcu_read_unlock();
+    cpu->tb_speculate_queue->depth = 0;
+    return true;
+}
+
+void tb_speculate_cleanup(CPUState *cpu)
+{
+    g_free(cpu->tb_speculate_queue);
+    cpu->tb_speculate_queue = NULL;
+}
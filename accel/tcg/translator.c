@@ -17,6 +17,7 @@
 #include "exec/gen-icount.h"
 #include "exec/log.h"
 #include "exec/translator.h"
+#include "exec/tb-profile.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -34,6 +35,8 @@ void translator_loop_temp_check(DisasContextBase *db)
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb)
 {
+    TBProfileEntry *tb_prof = NULL;
+
     /* Initialize DisasContext */
     db->tb = tb;
     db->pc_first = tb->pc;
@@ -41,6 +44,7 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     db->is_jmp = DISAS_NEXT;
     db->num_insns = 0;
     db->singlestep_enabled = cpu->singlestep_enabled;
+    db->goto_tb_mask = 0;
 
     /* Instruction counting */
     db->max_insns = tb_cflags(db->tb) & CF_COUNT_MASK;
@@ -60,11 +64,19 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     /* Reset the temp count so that we can identify leaks */
     tcg_clear_temp_count();
 
+    /* Translation of a previous TB may have been interrupted by a fault */
+    tcg_ctx->mem_access_counter = NULL;
+
     /* Start translating.  */
     gen_tb_start(db->tb);
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
+    if (tb_profile_level != TB_PROFILE_OFF) {
+        tb_prof = tb_profile_get_tb(db->pc_first);
+        tcg_gen_counter_inc(&tb_prof->count);
+    }
+
     while (true) {
         db->num_insns++;
         ops->insn_start(db, cpu);
@@ -89,6 +101,15 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
             }
         }
 
+        if (tb_profile_level >= TB_PROFILE_INSN) {
+            TBProfileEntry *insn_prof = tb_profile_get_insn(db->pc_next);
+
+            tcg_gen_counter_inc(&insn_prof->count);
+            if (tb_profile_level >= TB_PROFILE_MEM) {
+                tcg_ctx->mem_access_counter = &insn_prof->mem_accesses;
+            }
+        }
+
         /* Disassemble one instruction.  The translate_insn hook should
            update db->pc_next and db->is_jmp to indicate what should be
            done next -- either exiting this loop or locate the start of
@@ -119,10 +140,25 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     /* Emit code to exit the TB, as indicated by db->is_jmp.  */
     ops->tb_stop(db, cpu);
     gen_tb_end(db->tb, db->num_insns);
+    tcg_ctx->mem_access_counter = NULL;
 
     /* The disas_log hook may use these values rather than recompute.  */
     db->tb->size = db->pc_next - db->pc_first;
     db->tb->icount = db->num_insns;
+    if (tb_prof) {
+        tb_prof->icount = db->num_insns;
+    }
+
+#ifndef CONFIG_USER_ONLY
+    if (db->goto_tb_mask & 1) {
+        tb_speculate_queue(cpu, db->goto_tb_pc[0], tb->cs_base,
+                           db->goto_tb_flags[0]);
+    }
+    if (db->goto_tb_mask & 2) {
+        tb_speculate_queue(cpu, db->goto_tb_pc[1], tb->cs_base,
+                           db->goto_tb_flags[1]);
+    }
+#endif
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
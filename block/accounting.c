@@ -170,6 +170,53 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
     return 0;
 }
 
+/*
+ * Returns an estimate of the @percentile-th percentile of the latencies in
+ * the histogram for @type: the upper boundary of the bin that contains it,
+ * or the lower boundary if that is the last bin.  Returns 0 if the histogram
+ * is disabled or empty.
+ */
+uint64_t block_latency_histogram_percentile(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            double percentile)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64_t total = 0, sum = 0, target, ret = 0;
+    double exact;
+    int i;
+
+    qemu_mutex_lock(&stats->lock);
+
+    if (hist->bins == NULL || hist->nbins < 2) {
+        goto out;
+    }
+
+    for (i = 0; i < hist->nbins; i++) {
+        total += hist->bins[i];
+    }
+    if (total == 0) {
+        goto out;
+    }
+
+    exact = total * percentile / 100;
+    target = exact;
+    if (target < exact || target == 0) {
+        target++;
+    }
+
+    for (i = 0; i < hist->nbins - 1; i++) {
+        sum += hist->bins[i];
+        if (sum >= target) {
+            break;
+        }
+    }
+    ret = hist->boundaries[MIN(i, hist->nbins - 2)];
+
+out:
+    qemu_mutex_unlock(&stats->lock);
+    return ret;
+}
+
 void block_latency_histograms_clear(BlockAcctStats *stats)
 {
     int i;
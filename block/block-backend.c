@@ -38,6 +38,8 @@ typedef struct BlockBackendAioNotifier {
     QLIST_ENTRY(BlockBackendAioNotifier) list;
 } BlockBackendAioNotifier;
 
+typedef struct BlkMergeAIOCB BlkMergeAIOCB;
+
 struct BlockBackend {
     char *name;
     int refcnt;
@@ -89,6 +91,11 @@ struct BlockBackend {
      */
     unsigned int in_flight;
     AioWait wait;
+
+    /* Reads and writes waiting to be merged, see blk_set_request_merging() */
+    bool merge_requests;
+    QSIMPLEQ_HEAD(, BlkMergeAIOCB) merge_queue;
+    QEMUBH *merge_bh;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -255,6 +262,27 @@ static int blk_root_inactivate(BdrvChild *child)
     return 0;
 }
 
+static void blk_merge_bh(void *opaque);
+
+static void blk_merge_attach_aio_context(AioContext *new_context,
+                                         void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    blk->merge_bh = aio_bh_new(new_context, blk_merge_bh, blk);
+    if (!QSIMPLEQ_EMPTY(&blk->merge_queue)) {
+        qemu_bh_schedule(blk->merge_bh);
+    }
+}
+
+static void blk_merge_detach_aio_context(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    qemu_bh_delete(blk->merge_bh);
+    blk->merge_bh = NULL;
+}
+
 static void blk_root_attach(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
@@ -262,6 +290,10 @@ static void blk_root_attach(BdrvChild *child)
 
     trace_blk_root_attach(child, blk, child->bs);
 
+    blk_merge_attach_aio_context(bdrv_get_aio_context(child->bs), blk);
+    bdrv_add_aio_context_notifier(child->bs, blk_merge_attach_aio_context,
+                                  blk_merge_detach_aio_context, blk);
+
     QLIST_FOREACH(notifier, &blk->aio_notifiers, list) {
         bdrv_add_aio_context_notifier(child->bs,
                 notifier->attached_aio_context,
@@ -283,6 +315,10 @@ static void blk_root_detach(BdrvChild *child)
                 notifier->detach_aio_context,
                 notifier->opaque);
     }
+
+    bdrv_remove_aio_context_notifier(child->bs, blk_merge_attach_aio_context,
+                                     blk_merge_detach_aio_context, blk);
+    blk_merge_detach_aio_context(blk);
 }
 
 static const BdrvChildRole child_root = {
@@ -329,6 +365,7 @@ BlockBackend *blk_new(uint64_t perm, uint64_t shared_perm)
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
+    QSIMPLEQ_INIT(&blk->merge_queue);
 
     QTAILQ_INSERT_TAIL(&block_backends, blk, link);
     return blk;
@@ -407,6 +444,8 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->remove_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->insert_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->aio_notifiers));
+    assert(QSIMPLEQ_EMPTY(&blk->merge_queue));
+    assert(!blk->merge_bh);
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
@@ -881,6 +920,7 @@ void blk_detach_dev(BlockBackend *blk, void *dev)
     blk->dev_ops = NULL;
     blk->dev_opaque = NULL;
     blk->guest_block_size = 512;
+    blk_set_request_merging(blk, false);
     blk_set_perm(blk, 0, BLK_PERM_ALL, &error_abort);
     blk_unref(blk);
 }
@@ -1345,6 +1385,8 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void blk_merge_submit(BlockBackend *blk);
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1353,6 +1395,11 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
+    /* Requests that cannot be merged must not overtake queued ones */
+    if (!QSIMPLEQ_EMPTY(&blk->merge_queue)) {
+        blk_merge_submit(blk);
+    }
+
     blk_inc_in_flight(blk);
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
     acb->rwco = (BlkRwCo) {
@@ -1401,6 +1448,252 @@ static void blk_aio_write_entry(void *opaque)
     blk_aio_complete(acb);
 }
 
+/*
+ * Request merging
+ *
+ * Devices that submit each guest command as its own request, like AHCI with
+ * NCQ, can have their reads and writes queued instead of submitted right
+ * away.  The queue is processed from a bottom half, so requests issued in the
+ * same event loop iteration are sorted and contiguous ones are submitted as
+ * a single vectored request, the same way virtio-blk merges its requests.
+ * Every original request completes with the result of the merged one.
+ *
+ * Queued requests count as in flight, and the queue is submitted before
+ * anything else is, including a drain of the BlockBackend.
+ */
+
+struct BlkMergeAIOCB {
+    BlockAIOCB common;
+    BlockBackend *blk;
+    int64_t offset;
+    QEMUIOVector *qiov;
+    bool is_write;
+    QSIMPLEQ_ENTRY(BlkMergeAIOCB) next;
+};
+
+static void blk_merge_cancel_async(BlockAIOCB *acb);
+
+static const AIOCBInfo blk_merge_aiocb_info = {
+    .aiocb_size         = sizeof(BlkMergeAIOCB),
+    .cancel_async       = blk_merge_cancel_async,
+};
+
+typedef struct BlkMergeGroup {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    int nr_reqs;
+    BlkMergeAIOCB *reqs[];
+} BlkMergeGroup;
+
+static void blk_merge_complete(void *opaque, int ret)
+{
+    BlkMergeGroup *group = opaque;
+    int i;
+
+    for (i = 0; i < group->nr_reqs; i++) {
+        BlkMergeAIOCB *acb = group->reqs[i];
+
+        blk_dec_in_flight(group->blk);
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_unref(acb);
+    }
+
+    if (group->nr_reqs > 1) {
+        qemu_iovec_destroy(&group->qiov);
+    }
+    g_free(group);
+}
+
+static void blk_merge_cancel_bh(void *opaque)
+{
+    BlkMergeAIOCB *acb = opaque;
+
+    blk_dec_in_flight(acb->blk);
+    acb->common.cb(acb->common.opaque, -ECANCELED);
+    qemu_aio_unref(acb);
+}
+
+/*
+ * A request that is still queued is dropped and completes with -ECANCELED;
+ * once it has been submitted, it completes normally.
+ */
+static void blk_merge_cancel_async(BlockAIOCB *acb_)
+{
+    BlkMergeAIOCB *acb = container_of(acb_, BlkMergeAIOCB, common);
+    BlockBackend *blk = acb->blk;
+    BlkMergeAIOCB *req;
+
+    QSIMPLEQ_FOREACH(req, &blk->merge_queue, next) {
+        if (req == acb) {
+            QSIMPLEQ_REMOVE(&blk->merge_queue, acb, BlkMergeAIOCB, next);
+            aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+                                    blk_merge_cancel_bh, acb);
+            return;
+        }
+    }
+}
+
+static void blk_merge_submit_group(BlockBackend *blk, BlkMergeAIOCB **reqs,
+                                   int nr_reqs)
+{
+    BlkMergeGroup *group;
+    QEMUIOVector *qiov;
+    int i;
+
+    group = g_malloc(sizeof(*group) + nr_reqs * sizeof(reqs[0]));
+    group->blk = blk;
+    group->nr_reqs = nr_reqs;
+    memcpy(group->reqs, reqs, nr_reqs * sizeof(reqs[0]));
+
+    if (nr_reqs == 1) {
+        qiov = reqs[0]->qiov;
+    } else {
+        int niov = 0;
+
+        for (i = 0; i < nr_reqs; i++) {
+            niov += reqs[i]->qiov->niov;
+        }
+        qemu_iovec_init(&group->qiov, niov);
+        for (i = 0; i < nr_reqs; i++) {
+            qemu_iovec_concat(&group->qiov, reqs[i]->qiov, 0,
+                              reqs[i]->qiov->size);
+        }
+        qiov = &group->qiov;
+
+        block_acct_merge_done(blk_get_stats(blk),
+                              reqs[0]->is_write ? BLOCK_ACCT_WRITE
+                                                : BLOCK_ACCT_READ,
+                              nr_reqs - 1);
+    }
+
+    trace_blk_merge_submit(blk, reqs[0]->is_write, reqs[0]->offset,
+                           qiov->size, nr_reqs);
+    blk_aio_prwv(blk, reqs[0]->offset, qiov->size, qiov,
+                 reqs[0]->is_write ? blk_aio_write_entry : blk_aio_read_entry,
+                 0, blk_merge_complete, group);
+}
+
+static int blk_merge_compare(const void *a, const void *b)
+{
+    const BlkMergeAIOCB *req1 = *(BlkMergeAIOCB **)a;
+    const BlkMergeAIOCB *req2 = *(BlkMergeAIOCB **)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write - req2->is_write;
+    }
+    return req1->offset < req2->offset ? -1 : req1->offset > req2->offset;
+}
+
+/* Submits all queued requests, merging the contiguous ones */
+static void blk_merge_submit(BlockBackend *blk)
+{
+    BlkMergeAIOCB **reqs, *acb;
+    uint32_t max_transfer;
+    int max_iov, nr_reqs, start, niov, i;
+    int64_t end;
+
+    nr_reqs = 0;
+    QSIMPLEQ_FOREACH(acb, &blk->merge_queue, next) {
+        nr_reqs++;
+    }
+    if (!nr_reqs) {
+        return;
+    }
+
+    reqs = g_new(BlkMergeAIOCB *, nr_reqs);
+    for (i = 0; i < nr_reqs; i++) {
+        reqs[i] = QSIMPLEQ_FIRST(&blk->merge_queue);
+        QSIMPLEQ_REMOVE_HEAD(&blk->merge_queue, next);
+    }
+
+    /*
+     * Only contiguous requests are merged; overlapping ones may be submitted
+     * in any order, just like any other requests that are in flight together
+     */
+    qsort(reqs, nr_reqs, sizeof(reqs[0]), blk_merge_compare);
+
+    if (blk_bs(blk)) {
+        max_transfer = MIN(blk_get_max_transfer(blk), BDRV_REQUEST_MAX_BYTES);
+        max_iov = blk_get_max_iov(blk);
+    } else {
+        max_transfer = 0;
+        max_iov = 0;
+    }
+
+    start = 0;
+    niov = reqs[0]->qiov->niov;
+    end = reqs[0]->offset + reqs[0]->qiov->size;
+    for (i = 1; i <= nr_reqs; i++) {
+        if (i < nr_reqs &&
+            reqs[i]->is_write == reqs[start]->is_write &&
+            reqs[i]->offset == end &&
+            niov + reqs[i]->qiov->niov <= max_iov &&
+            end + reqs[i]->qiov->size - reqs[start]->offset <= max_transfer)
+        {
+            niov += reqs[i]->qiov->niov;
+            end += reqs[i]->qiov->size;
+            continue;
+        }
+
+        blk_merge_submit_group(blk, &reqs[start], i - start);
+        if (i < nr_reqs) {
+            start = i;
+            niov = reqs[i]->qiov->niov;
+            end = reqs[i]->offset + reqs[i]->qiov->size;
+        }
+    }
+
+    g_free(reqs);
+}
+
+static void blk_merge_bh(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    blk_merge_submit(blk);
+}
+
+static BlockAIOCB *blk_merge_queue_request(BlockBackend *blk, int64_t offset,
+                                           QEMUIOVector *qiov, bool is_write,
+                                           BlockCompletionFunc *cb,
+                                           void *opaque)
+{
+    BlkMergeAIOCB *acb;
+
+    blk_inc_in_flight(blk);
+    acb = blk_aio_get(&blk_merge_aiocb_info, blk, cb, opaque);
+    acb->blk = blk;
+    acb->offset = offset;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+
+    if (QSIMPLEQ_EMPTY(&blk->merge_queue)) {
+        qemu_bh_schedule(blk->merge_bh);
+    }
+    QSIMPLEQ_INSERT_TAIL(&blk->merge_queue, acb, next);
+
+    return &acb->common;
+}
+
+static bool blk_can_merge(BlockBackend *blk, BdrvRequestFlags flags)
+{
+    return blk->merge_requests && !flags && !blk->quiesce_counter &&
+           blk_bs(blk);
+}
+
+/*
+ * Enables or disables merging of the reads and writes submitted with
+ * blk_aio_preadv() and blk_aio_pwritev().  Requests with flags are never
+ * merged.
+ */
+void blk_set_request_merging(BlockBackend *blk, bool enable)
+{
+    blk->merge_requests = enable;
+    if (!enable) {
+        blk_merge_submit(blk);
+    }
+}
+
 BlockAIOCB *blk_aio_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                                   int count, BdrvRequestFlags flags,
                                   BlockCompletionFunc *cb, void *opaque)
@@ -1460,6 +1753,9 @@ BlockAIOCB *blk_aio_preadv(BlockBackend *blk, int64_t offset,
                            QEMUIOVector *qiov, BdrvRequestFlags flags,
                            BlockCompletionFunc *cb, void *opaque)
 {
+    if (blk_can_merge(blk, flags)) {
+        return blk_merge_queue_request(blk, offset, qiov, false, cb, opaque);
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_read_entry, flags, cb, opaque);
 }
@@ -1468,6 +1764,9 @@ BlockAIOCB *blk_aio_pwritev(BlockBackend *blk, int64_t offset,
                             QEMUIOVector *qiov, BdrvRequestFlags flags,
                             BlockCompletionFunc *cb, void *opaque)
 {
+    if (blk_can_merge(blk, flags)) {
+        return blk_merge_queue_request(blk, offset, qiov, true, cb, opaque);
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_write_entry, flags, cb, opaque);
 }
@@ -2182,6 +2481,8 @@ static void blk_root_drained_begin(BdrvChild *child)
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
+        /* Let the drain wait for the queued requests */
+        blk_merge_submit(blk);
     }
 
     /* Note that blk->root may not be accessible here yet if we are just
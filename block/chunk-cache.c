@@ -0,0 +1,362 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Formats like cloop and dmg store the image as a sequence of independently
+ * compressed chunks, and only a whole chunk can be decompressed.  This keeps
+ * the most recently used decompressed chunks, so that interleaved accesses
+ * do not inflate the same chunks over and over.
+ *
+ * When the guest reads the chunks in order, the next few chunks are loaded
+ * in the background; the decompression itself runs in the thread pool.
+ *
+ * Entries are allocated when they are first needed, up to the configured
+ * cache size; readahead only uses entries within that limit.  The buffer
+ * for the compressed data is only allocated while a chunk is loaded.
+ *
+ * All functions run in the AioContext of the BlockDriverState, so the cache
+ * does not need a lock.  A chunk that is being loaded is already in the
+ * cache; readers wait for it to be ready.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/option.h"
+#include "chunk-cache.h"
+#include "trace.h"
+
+#define CHUNK_NONE UINT32_MAX
+
+typedef struct ChunkCacheEntry {
+    ChunkCache *cache;
+    uint32_t chunk;
+    uint8_t *buf;
+
+    /* Readers and the loading coroutine; entries with ref > 0 stay put */
+    int ref;
+
+    bool loading;
+    int ret;
+    CoQueue wait;
+
+    /* Loaded by readahead and not read yet */
+    bool readahead;
+
+    QTAILQ_ENTRY(ChunkCacheEntry) lru;
+} ChunkCacheEntry;
+
+struct ChunkCache {
+    BlockDriverState *bs;
+    ChunkCacheLoadFunc *load;
+    uint32_t nr_chunks;
+    size_t chunk_size;
+    size_t scratch_size;
+
+    int nr_entries;
+    int max_entries;
+
+    /* All entries, least recently used first */
+    QTAILQ_HEAD(, ChunkCacheEntry) lru;
+
+    /* Readers waiting for an entry with ref == 0 */
+    CoQueue free_wait;
+
+    int readahead;
+    uint32_t last_chunk;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead_hits;
+};
+
+static ChunkCacheEntry *chunk_cache_lookup(ChunkCache *c, uint32_t chunk)
+{
+    ChunkCacheEntry *e;
+
+    QTAILQ_FOREACH(e, &c->lru, lru) {
+        if (e->chunk == chunk) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static ChunkCacheEntry *chunk_cache_new_entry(ChunkCache *c)
+{
+    ChunkCacheEntry *e;
+
+    e = g_new0(ChunkCacheEntry, 1);
+    e->buf = qemu_try_blockalign(c->bs->file->bs, c->chunk_size);
+    if (!e->buf) {
+        g_free(e);
+        return NULL;
+    }
+    e->cache = c;
+    e->chunk = CHUNK_NONE;
+    qemu_co_queue_init(&e->wait);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+    c->nr_entries++;
+    return e;
+}
+
+/*
+ * Returns an entry for a new chunk: a new one while the cache is below its
+ * size, otherwise the least recently used entry that is not in use.  For
+ * readahead, chunks that were read ahead and not read yet are kept.
+ */
+static ChunkCacheEntry *chunk_cache_find_free(ChunkCache *c, bool readahead)
+{
+    ChunkCacheEntry *e;
+
+    if (c->nr_entries < c->max_entries) {
+        e = chunk_cache_new_entry(c);
+        if (e) {
+            return e;
+        }
+    }
+
+    QTAILQ_FOREACH(e, &c->lru, lru) {
+        if (e->ref == 0 && !(readahead && e->readahead)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void chunk_cache_touch(ChunkCache *c, ChunkCacheEntry *e)
+{
+    QTAILQ_REMOVE(&c->lru, e, lru);
+    QTAILQ_INSERT_TAIL(&c->lru, e, lru);
+}
+
+static void coroutine_fn chunk_cache_load(ChunkCache *c, ChunkCacheEntry *e)
+{
+    uint8_t *scratch = NULL;
+
+    if (c->scratch_size) {
+        scratch = g_try_malloc(c->scratch_size);
+    }
+    if (c->scratch_size && !scratch) {
+        e->ret = -ENOMEM;
+    } else {
+        e->ret = c->load(c->bs, e->chunk, e->buf, scratch);
+    }
+    g_free(scratch);
+    trace_chunk_cache_load(c, e->chunk, e->readahead, e->ret);
+
+    e->loading = false;
+    if (e->ret < 0) {
+        /* Let the next reader try again */
+        e->chunk = CHUNK_NONE;
+    }
+    qemu_co_queue_restart_all(&e->wait);
+}
+
+static void coroutine_fn chunk_cache_unref(ChunkCache *c, ChunkCacheEntry *e)
+{
+    assert(e->ref > 0);
+    if (--e->ref == 0) {
+        qemu_co_queue_next(&c->free_wait);
+    }
+}
+
+static void coroutine_fn chunk_cache_readahead_entry(void *opaque)
+{
+    ChunkCacheEntry *e = opaque;
+    ChunkCache *c = e->cache;
+
+    chunk_cache_load(c, e);
+    chunk_cache_unref(c, e);
+    bdrv_dec_in_flight(c->bs);
+}
+
+/*
+ * Starts loading the chunks after @chunk that are not cached yet.  Only
+ * entries that are not in use are recycled; readahead stops rather than
+ * waiting for one.
+ */
+static void chunk_cache_start_readahead(ChunkCache *c, uint32_t chunk)
+{
+    ChunkCacheEntry *e;
+    Coroutine *co;
+    uint32_t i;
+
+    for (i = chunk + 1; i <= chunk + c->readahead && i < c->nr_chunks; i++) {
+        if (chunk_cache_lookup(c, i)) {
+            continue;
+        }
+        e = chunk_cache_find_free(c, true);
+        if (!e) {
+            break;
+        }
+
+        e->chunk = i;
+        e->ref = 1;
+        e->loading = true;
+        e->readahead = true;
+        chunk_cache_touch(c, e);
+
+        bdrv_inc_in_flight(c->bs);
+        co = qemu_coroutine_create(chunk_cache_readahead_entry, e);
+        bdrv_coroutine_enter(c->bs, co);
+    }
+}
+
+/*
+ * Returns the decompressed data of @chunk in @buf, loading it if it is not
+ * cached.  The buffer remains valid until it is passed to chunk_cache_put().
+ */
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk, uint8_t **buf)
+{
+    ChunkCacheEntry *e;
+    bool sequential;
+    int ret;
+
+    assert(chunk < c->nr_chunks);
+    sequential = chunk == c->last_chunk + 1;
+    c->last_chunk = chunk;
+
+    for (;;) {
+        e = chunk_cache_lookup(c, chunk);
+        if (e) {
+            c->hits++;
+            if (e->readahead) {
+                c->readahead_hits++;
+                e->readahead = false;
+            }
+            e->ref++;
+            chunk_cache_touch(c, e);
+            if (sequential) {
+                chunk_cache_start_readahead(c, chunk);
+            }
+            while (e->loading) {
+                qemu_co_queue_wait(&e->wait, NULL);
+            }
+            break;
+        }
+
+        e = chunk_cache_find_free(c, false);
+        if (e) {
+            c->misses++;
+            e->chunk = chunk;
+            e->ref = 1;
+            e->loading = true;
+            e->readahead = false;
+            chunk_cache_touch(c, e);
+            if (sequential) {
+                chunk_cache_start_readahead(c, chunk);
+            }
+            chunk_cache_load(c, e);
+            break;
+        }
+
+        if (!c->nr_entries) {
+            return -ENOMEM;
+        }
+        /* Every entry is in use, wait for one and look again */
+        qemu_co_queue_wait(&c->free_wait, NULL);
+    }
+
+    ret = e->ret;
+    if (ret < 0) {
+        chunk_cache_unref(c, e);
+        return ret;
+    }
+    *buf = e->buf;
+    return 0;
+}
+
+void coroutine_fn chunk_cache_put(ChunkCache *c, uint8_t *buf)
+{
+    ChunkCacheEntry *e;
+
+    QTAILQ_FOREACH(e, &c->lru, lru) {
+        if (e->buf == buf) {
+            chunk_cache_unref(c, e);
+            return;
+        }
+    }
+    abort();
+}
+
+/* Runs @func in the thread pool of the image's AioContext */
+int coroutine_fn chunk_cache_run_in_thread(ChunkCache *c,
+                                           ThreadPoolFunc *func, void *arg)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(c->bs));
+
+    return thread_pool_submit_co(pool, func, arg);
+}
+
+BlockStatsSpecificChunkCache *chunk_cache_get_stats(ChunkCache *c)
+{
+    BlockStatsSpecificChunkCache *stats;
+
+    stats = g_new0(BlockStatsSpecificChunkCache, 1);
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->readahead_hits = c->readahead_hits;
+    return stats;
+}
+
+/*
+ * Creates a cache for an image with @nr_chunks chunks of at most
+ * @chunk_size bytes, configured by the CHUNK_CACHE_OPTS in @opts.  The
+ * load function gets a buffer of @scratch_size bytes for each chunk.
+ */
+int chunk_cache_create(BlockDriverState *bs, QemuOpts *opts,
+                       ChunkCacheLoadFunc *load, uint32_t nr_chunks,
+                       size_t chunk_size, size_t scratch_size,
+                       ChunkCache **pcache, Error **errp)
+{
+    ChunkCache *c;
+    uint64_t cache_size, readahead;
+
+    cache_size = qemu_opt_get_size(opts, CHUNK_CACHE_OPT_SIZE,
+                                   DEFAULT_CHUNK_CACHE_SIZE);
+    readahead = qemu_opt_get_number(opts, CHUNK_CACHE_OPT_READAHEAD,
+                                    DEFAULT_CHUNK_READAHEAD);
+    if (readahead > MAX_CHUNK_READAHEAD) {
+        error_setg(errp, CHUNK_CACHE_OPT_READAHEAD " must be at most %d",
+                   MAX_CHUNK_READAHEAD);
+        return -EINVAL;
+    }
+
+    c = g_new0(ChunkCache, 1);
+    c->bs = bs;
+    c->load = load;
+    c->nr_chunks = nr_chunks;
+    c->chunk_size = chunk_size;
+    c->scratch_size = scratch_size;
+    /* Even a cache smaller than a chunk holds the chunk being read */
+    c->max_entries = MAX(MIN(cache_size / MAX(chunk_size, 1), INT_MAX), 1);
+    c->readahead = readahead;
+    c->last_chunk = CHUNK_NONE;  /* reading chunk 0 first is sequential */
+    QTAILQ_INIT(&c->lru);
+    qemu_co_queue_init(&c->free_wait);
+
+    trace_chunk_cache_create(c, bs, c->max_entries, chunk_size, c->readahead);
+    *pcache = c;
+    return 0;
+}
+
+void chunk_cache_destroy(ChunkCache *c)
+{
+    ChunkCacheEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+        assert(e->ref == 0);
+        qemu_vfree(e->buf);
+        g_free(e);
+    }
+    g_free(c);
+}
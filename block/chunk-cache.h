@@ -0,0 +1,61 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+
+#define CHUNK_CACHE_OPT_SIZE      "chunk-cache-size"
+#define CHUNK_CACHE_OPT_READAHEAD "readahead"
+
+#define DEFAULT_CHUNK_CACHE_SIZE  (4 * 1024 * 1024)
+#define DEFAULT_CHUNK_READAHEAD   2
+#define MAX_CHUNK_READAHEAD       64
+
+/* QemuOptDesc initializers for the options above */
+#define CHUNK_CACHE_OPTS                                                \
+    {                                                                   \
+        .name = CHUNK_CACHE_OPT_SIZE,                                   \
+        .type = QEMU_OPT_SIZE,                                          \
+        .help = "Maximum size of the decompressed chunk cache",         \
+    },                                                                  \
+    {                                                                   \
+        .name = CHUNK_CACHE_OPT_READAHEAD,                              \
+        .type = QEMU_OPT_NUMBER,                                        \
+        .help = "Number of chunks to decompress ahead of sequential "   \
+                "reads",                                                \
+    }
+
+typedef struct ChunkCache ChunkCache;
+
+/*
+ * Reads chunk @chunk and decompresses it into @buf.  @scratch can be used
+ * for the compressed data.  Several calls may run at the same time for
+ * different chunks, each with its own @buf and @scratch.
+ */
+typedef int coroutine_fn ChunkCacheLoadFunc(BlockDriverState *bs,
+                                            uint32_t chunk, uint8_t *buf,
+                                            uint8_t *scratch);
+
+int chunk_cache_create(BlockDriverState *bs, QemuOpts *opts,
+                       ChunkCacheLoadFunc *load, uint32_t nr_chunks,
+                       size_t chunk_size, size_t scratch_size,
+                       ChunkCache **pcache, Error **errp);
+void chunk_cache_destroy(ChunkCache *c);
+
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk,
+                                 uint8_t **buf);
+void coroutine_fn chunk_cache_put(ChunkCache *c, uint8_t *buf);
+
+int coroutine_fn chunk_cache_run_in_thread(ChunkCache *c,
+                                           ThreadPoolFunc *func, void *arg);
+
+BlockStatsSpecificChunkCache *chunk_cache_get_stats(ChunkCache *c);
+
+#endif
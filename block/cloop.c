@@ -28,23 +28,30 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "qemu/bswap.h"
+#include "qemu/option.h"
+#include "chunk-cache.h"
 #include <zlib.h>
 
 /* Maximum compressed block size */
 #define MAX_BLOCK_SIZE (64 * 1024 * 1024)
 
 typedef struct BDRVCloopState {
-    CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVCloopState;
 
+static QemuOptsList cloop_runtime_opts = {
+    .name = "cloop",
+    .head = QTAILQ_HEAD_INITIALIZER(cloop_runtime_opts.head),
+    .desc = {
+        CHUNK_CACHE_OPTS,
+        { /* end of list */ }
+    },
+};
+
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const char *magic_version_2_0 = "#!/bin/sh\n"
@@ -60,11 +67,58 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+typedef struct CloopInflate {
+    uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;
+    uint32_t out_len;
+} CloopInflate;
+
+/* Runs in the thread pool */
+static int cloop_inflate(void *opaque)
+{
+    CloopInflate *z = opaque;
+    uLongf out_len = z->out_len;
+
+    if (uncompress(z->out, &out_len, z->in, z->in_len) != Z_OK ||
+        out_len != z->out_len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int coroutine_fn cloop_load_block(BlockDriverState *bs,
+                                         uint32_t block_num, uint8_t *buf,
+                                         uint8_t *scratch)
+{
+    BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    struct iovec iov = { .iov_base = scratch, .iov_len = bytes };
+    QEMUIOVector qiov;
+    CloopInflate z = {
+        .in         = scratch,
+        .in_len     = bytes,
+        .out        = buf,
+        .out_len    = s->block_size,
+    };
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_preadv(bs->file, s->offsets[block_num], bytes, &qiov, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return chunk_cache_run_in_thread(s->cache, cloop_inflate, &z);
+}
+
 static int cloop_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
     BDRVCloopState *s = bs->opaque;
     uint32_t offsets_size, max_compressed_block_size = 1, i;
+    QemuOpts *opts = NULL;
+    Error *local_err = NULL;
     int ret;
 
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
@@ -181,36 +235,29 @@ static int cloop_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_try_malloc(max_compressed_block_size + 1);
-    if (s->compressed_block == NULL) {
-        error_setg(errp, "Could not allocate compressed_block");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->uncompressed_block = g_try_malloc(s->block_size);
-    if (s->uncompressed_block == NULL) {
-        error_setg(errp, "Could not allocate uncompressed_block");
-        ret = -ENOMEM;
+    opts = qemu_opts_create(&cloop_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
         goto fail;
     }
 
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
+    ret = chunk_cache_create(bs, opts, cloop_load_block, s->n_blocks,
+                             s->block_size, max_compressed_block_size + 1,
+                             &s->cache, errp);
+    if (ret < 0) {
         goto fail;
     }
-    s->current_block = s->n_blocks;
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks * s->sectors_per_block;
-    qemu_co_mutex_init(&s->lock);
+    qemu_opts_del(opts);
     return 0;
 
 fail:
+    qemu_opts_del(opts);
     g_free(s->offsets);
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
     return ret;
 }
 
@@ -219,38 +266,6 @@ static void cloop_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.request_alignment = BDRV_SECTOR_SIZE; /* No sub-sector I/O */
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
-{
-    BDRVCloopState *s = bs->opaque;
-
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
-
-        ret = bdrv_pread(bs->file, s->offsets[block_num],
-                         s->compressed_block, bytes);
-        if (ret != bytes) {
-            return -1;
-        }
-
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
-
-        s->current_block = block_num;
-    }
-    return 0;
-}
-
 static int coroutine_fn
 cloop_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                 QEMUIOVector *qiov, int flags)
@@ -258,41 +273,48 @@ cloop_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     BDRVCloopState *s = bs->opaque;
     uint64_t sector_num = offset >> BDRV_SECTOR_BITS;
     int nb_sectors = bytes >> BDRV_SECTOR_BITS;
-    int ret, i;
+    uint8_t *block;
+    int ret, i, n;
 
     assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
     assert((bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
 
-    qemu_co_mutex_lock(&s->lock);
-
-    for (i = 0; i < nb_sectors; i++) {
-        void *data;
+    for (i = 0; i < nb_sectors; i += n) {
         uint32_t sector_offset_in_block =
             ((sector_num + i) % s->sectors_per_block),
             block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            ret = -EIO;
-            goto fail;
+
+        ret = chunk_cache_get(s->cache, block_num, &block);
+        if (ret < 0) {
+            return -EIO;
         }
 
-        data = s->uncompressed_block + sector_offset_in_block * 512;
-        qemu_iovec_from_buf(qiov, i * 512, data, 512);
+        n = MIN(nb_sectors - i, s->sectors_per_block - sector_offset_in_block);
+        qemu_iovec_from_buf(qiov, i * 512,
+                            block + sector_offset_in_block * 512, n * 512);
+        chunk_cache_put(s->cache, block);
     }
 
-    ret = 0;
-fail:
-    qemu_co_mutex_unlock(&s->lock);
-
-    return ret;
+    return 0;
 }
 
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
     g_free(s->offsets);
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    chunk_cache_destroy(s->cache);
+}
+
+static BlockStatsSpecific *cloop_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVCloopState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_CLOOP,
+        .u.cloop.data = chunk_cache_get_stats(s->cache),
+    };
+    return stats;
 }
 
 static BlockDriver bdrv_cloop = {
@@ -304,6 +326,7 @@ static BlockDriver bdrv_cloop = {
     .bdrv_refresh_limits = cloop_refresh_limits,
     .bdrv_co_preadv = cloop_co_preadv,
     .bdrv_close     = cloop_close,
+    .bdrv_get_specific_stats = cloop_get_specific_stats,
 };
 
 static void bdrv_cloop_init(void)
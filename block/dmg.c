@@ -28,6 +28,7 @@
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/module.h"
+#include "qemu/option.h"
 #include "dmg.h"
 
 int (*dmg_uncompress_bz2)(char *next_in, unsigned int avail_in,
@@ -41,6 +42,15 @@ enum {
     DMG_SECTORCOUNTS_MAX = DMG_LENGTHS_MAX / 512,
 };
 
+static QemuOptsList dmg_runtime_opts = {
+    .name = "dmg",
+    .head = QTAILQ_HEAD_INITIALIZER(dmg_runtime_opts.head),
+    .desc = {
+        CHUNK_CACHE_OPTS,
+        { /* end of list */ }
+    },
+};
+
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     int len;
@@ -403,6 +413,77 @@ fail:
     return ret;
 }
 
+typedef struct DmgUncompress {
+    uint32_t type;
+    uint8_t *in;
+    uint64_t in_len;
+    uint8_t *out;
+    uint64_t out_len;
+} DmgUncompress;
+
+/* Runs in the thread pool */
+static int dmg_uncompress(void *opaque)
+{
+    DmgUncompress *z = opaque;
+    uLongf out_len = z->out_len;
+
+    switch (z->type) {
+    case 0x80000005: /* zlib compressed */
+        if (uncompress(z->out, &out_len, z->in, z->in_len) != Z_OK ||
+            out_len != z->out_len) {
+            return -EIO;
+        }
+        return 0;
+    case 0x80000006: /* bzip2 compressed */
+        return dmg_uncompress_bz2((char *)z->in, (unsigned int)z->in_len,
+                                  (char *)z->out, (unsigned int)z->out_len);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static int coroutine_fn dmg_load_chunk(BlockDriverState *bs, uint32_t chunk,
+                                       uint8_t *buf, uint8_t *scratch)
+{
+    BDRVDMGState *s = bs->opaque;
+    struct iovec iov = { .iov_len = s->lengths[chunk] };
+    QEMUIOVector qiov;
+    DmgUncompress z = {
+        .type       = s->types[chunk],
+        .in         = scratch,
+        .in_len     = s->lengths[chunk],
+        .out        = buf,
+        .out_len    = 512 * s->sectorcounts[chunk],
+    };
+    int ret;
+
+    switch (s->types[chunk]) { /* block entry type */
+    case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
+        if (z.type == 0x80000006 && !dmg_uncompress_bz2) {
+            return -ENOTSUP;
+        }
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        iov.iov_base = scratch;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_preadv(bs->file, s->offsets[chunk], iov.iov_len,
+                             &qiov, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        return chunk_cache_run_in_thread(s->cache, dmg_uncompress, &z);
+    case 1: /* copy */
+        iov.iov_base = buf;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return bdrv_co_preadv(bs->file, s->offsets[chunk], iov.iov_len,
+                              &qiov, 0);
+    default:
+        /* zero chunks are not cached, see dmg_co_preadv() */
+        return -EIO;
+    }
+}
+
 static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -410,6 +491,8 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
     DmgHeaderState ds;
     uint64_t rsrc_fork_offset, rsrc_fork_length;
     uint64_t plist_xml_offset, plist_xml_length;
+    QemuOpts *opts = NULL;
+    Error *local_err = NULL;
     int64_t offset;
     int ret;
 
@@ -507,34 +590,31 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = qemu_try_blockalign(bs->file->bs,
-                                              ds.max_compressed_size + 1);
-    s->uncompressed_chunk = qemu_try_blockalign(bs->file->bs,
-                                                512 * ds.max_sectors_per_chunk);
-    if (s->compressed_chunk == NULL || s->uncompressed_chunk == NULL) {
-        ret = -ENOMEM;
+    opts = qemu_opts_create(&dmg_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
         goto fail;
     }
 
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
+    ret = chunk_cache_create(bs, opts, dmg_load_chunk, s->n_chunks,
+                             512 * ds.max_sectors_per_chunk,
+                             ds.max_compressed_size + 1, &s->cache, errp);
+    if (ret < 0) {
         goto fail;
     }
 
-    s->current_chunk = s->n_chunks;
-
-    qemu_co_mutex_init(&s->lock);
+    qemu_opts_del(opts);
     return 0;
 
 fail:
+    qemu_opts_del(opts);
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    qemu_vfree(s->compressed_chunk);
-    qemu_vfree(s->uncompressed_chunk);
     return ret;
 }
 
@@ -543,17 +623,6 @@ static void dmg_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.request_alignment = BDRV_SECTOR_SIZE; /* No sub-sector I/O */
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-                uint32_t chunk_num, uint64_t sector_num)
-{
-    if (chunk_num >= s->n_chunks || s->sectors[chunk_num] > sector_num ||
-            s->sectors[chunk_num] + s->sectorcounts[chunk_num] <= sector_num) {
-        return 0;
-    } else {
-        return -1;
-    }
-}
-
 static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
 {
     /* binary search */
@@ -571,81 +640,6 @@ static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, uint64_t sector_num)
-{
-    BDRVDMGState *s = bs->opaque;
-
-    if (!is_sector_in_chunk(s, s->current_chunk, sector_num)) {
-        int ret;
-        uint32_t chunk = search_chunk(s, sector_num);
-
-        if (chunk >= s->n_chunks) {
-            return -1;
-        }
-
-        s->current_chunk = s->n_chunks;
-        switch (s->types[chunk]) { /* block entry type */
-        case 0x80000005: { /* zlib compressed */
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
-
-            s->zstream.next_in = s->compressed_chunk;
-            s->zstream.avail_in = s->lengths[chunk];
-            s->zstream.next_out = s->uncompressed_chunk;
-            s->zstream.avail_out = 512 * s->sectorcounts[chunk];
-            ret = inflateReset(&s->zstream);
-            if (ret != Z_OK) {
-                return -1;
-            }
-            ret = inflate(&s->zstream, Z_FINISH);
-            if (ret != Z_STREAM_END ||
-                s->zstream.total_out != 512 * s->sectorcounts[chunk]) {
-                return -1;
-            }
-            break; }
-        case 0x80000006: /* bzip2 compressed */
-            if (!dmg_uncompress_bz2) {
-                break;
-            }
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
-
-            ret = dmg_uncompress_bz2((char *)s->compressed_chunk,
-                                     (unsigned int) s->lengths[chunk],
-                                     (char *)s->uncompressed_chunk,
-                                     (unsigned int)
-                                         (512 * s->sectorcounts[chunk]));
-            if (ret < 0) {
-                return ret;
-            }
-            break;
-        case 1: /* copy */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
-            break;
-        case 2: /* zero */
-            /* see dmg_read, it is treated specially. No buffer needs to be
-             * pre-filled, the zeroes can be set directly. */
-            break;
-        }
-        s->current_chunk = chunk;
-    }
-    return 0;
-}
-
 static int coroutine_fn
 dmg_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
               QEMUIOVector *qiov, int flags)
@@ -653,37 +647,41 @@ dmg_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     BDRVDMGState *s = bs->opaque;
     uint64_t sector_num = offset >> BDRV_SECTOR_BITS;
     int nb_sectors = bytes >> BDRV_SECTOR_BITS;
-    int ret, i;
+    uint8_t *data;
+    int ret, i, n;
 
     assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
     assert((bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
 
-    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_sectors; i += n) {
+        uint32_t chunk = search_chunk(s, sector_num + i);
+        uint64_t sector_offset_in_chunk;
 
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_chunk;
-        void *data;
-
-        if (dmg_read_chunk(bs, sector_num + i) != 0) {
-            ret = -EIO;
-            goto fail;
+        if (chunk >= s->n_chunks) {
+            return -EIO;
         }
-        /* Special case: current chunk is all zeroes. Do not perform a memcpy as
-         * s->uncompressed_chunk may be too small to cover the large all-zeroes
-         * section. dmg_read_chunk is called to find s->current_chunk */
-        if (s->types[s->current_chunk] == 2) { /* all zeroes block entry */
-            qemu_iovec_memset(qiov, i * 512, 0, 512);
+        sector_offset_in_chunk = sector_num + i - s->sectors[chunk];
+        n = MIN(nb_sectors - i,
+                s->sectorcounts[chunk] - sector_offset_in_chunk);
+
+        /* Special case: the chunk is all zeroes.  It is not cached, as the
+         * cache entries may be too small to cover the large all-zeroes
+         * section. */
+        if (s->types[chunk] == 2) { /* all zeroes block entry */
+            qemu_iovec_memset(qiov, i * 512, 0, n * 512);
             continue;
         }
-        sector_offset_in_chunk = sector_num + i - s->sectors[s->current_chunk];
-        data = s->uncompressed_chunk + sector_offset_in_chunk * 512;
-        qemu_iovec_from_buf(qiov, i * 512, data, 512);
+
+        ret = chunk_cache_get(s->cache, chunk, &data);
+        if (ret < 0) {
+            return -EIO;
+        }
+        qemu_iovec_from_buf(qiov, i * 512,
+                            data + sector_offset_in_chunk * 512, n * 512);
+        chunk_cache_put(s->cache, data);
     }
 
-    ret = 0;
-fail:
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    return 0;
 }
 
 static void dmg_close(BlockDriverState *bs)
@@ -695,10 +693,19 @@ static void dmg_close(BlockDriverState *bs)
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    qemu_vfree(s->compressed_chunk);
-    qemu_vfree(s->uncompressed_chunk);
+    chunk_cache_destroy(s->cache);
+}
+
+static BlockStatsSpecific *dmg_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVDMGState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
 
-    inflateEnd(&s->zstream);
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_DMG,
+        .u.dmg.data = chunk_cache_get_stats(s->cache),
+    };
+    return stats;
 }
 
 static BlockDriver bdrv_dmg = {
@@ -710,6 +717,7 @@ static BlockDriver bdrv_dmg = {
     .bdrv_child_perm     = bdrv_format_default_perms,
     .bdrv_co_preadv = dmg_co_preadv,
     .bdrv_close     = dmg_close,
+    .bdrv_get_specific_stats = dmg_get_specific_stats,
 };
 
 static void bdrv_dmg_init(void)
@@ -28,10 +28,10 @@
 
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "chunk-cache.h"
 #include <zlib.h>
 
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -46,10 +46,7 @@ typedef struct BDRVDMGState {
     uint64_t *lengths;
     uint64_t *sectors;
     uint64_t *sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVDMGState;
 
 extern int (*dmg_uncompress_bz2)(char *next_in, unsigned int avail_in,
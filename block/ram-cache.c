@@ -0,0 +1,947 @@
+/*
+ * Write-back RAM cache block filter driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Keeps recently used clusters of the child node in host memory, and
+ * completes writes as soon as their data is copied there.  Dirty data is
+ * written back when the node is flushed, writeback-interval milliseconds
+ * after a cluster became dirty, and whenever more than max-dirty-ratio
+ * percent of the cache is dirty.  Adjacent dirty ranges are written back
+ * with a single request.
+ *
+ * A cluster that is only partially written is not read from the child:
+ * each entry tracks the range of bytes that is dirty, and the rest of the
+ * cluster is only loaded when a read or a write that does not touch the
+ * dirty range needs it.
+ *
+ * All functions run in the AioContext of the node, so the cache does not
+ * need a lock.  An entry is busy while it is loaded or written back.  Writes
+ * can still modify a busy entry: loading does not overwrite the dirty range,
+ * and writeback only marks an entry clean if no write happened meanwhile.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define RAM_CACHE_OPT_SIZE                "size"
+#define RAM_CACHE_OPT_CLUSTER_SIZE        "cluster-size"
+#define RAM_CACHE_OPT_WRITEBACK_INTERVAL  "writeback-interval"
+#define RAM_CACHE_OPT_MAX_DIRTY_RATIO     "max-dirty-ratio"
+
+#define DEFAULT_RAM_CACHE_SIZE            (32 * MiB)
+#define DEFAULT_RAM_CACHE_CLUSTER_SIZE    (64 * KiB)
+#define DEFAULT_WRITEBACK_INTERVAL        1000 /* ms */
+#define DEFAULT_MAX_DIRTY_RATIO           50
+
+#define MIN_RAM_CACHE_CLUSTER_SIZE        512
+#define MAX_RAM_CACHE_CLUSTER_SIZE        (2 * MiB)
+
+/* Maximum size of a coalesced writeback request */
+#define RAM_CACHE_MAX_WRITEBACK           (4 * MiB)
+
+#define CLUSTER_NONE UINT64_MAX
+
+typedef struct RamCacheEntry {
+    uint64_t cluster;
+    uint8_t *buf;
+
+    /* The whole cluster has been loaded from the child */
+    bool valid;
+
+    /* Being loaded or written back */
+    bool busy;
+
+    /* Bytes [dirty_start, dirty_end) have not been written back yet */
+    uint32_t dirty_start;
+    uint32_t dirty_end;
+
+    /* Incremented by every write to the entry */
+    uint64_t write_gen;
+
+    QTAILQ_ENTRY(RamCacheEntry) lru;
+} RamCacheEntry;
+
+typedef struct BDRVRamCacheState {
+    BlockDriverState *bs;
+    int64_t size;
+    uint32_t cluster_size;
+
+    RamCacheEntry *entries;
+    int nr_entries;
+
+    /* Cluster index -> entry */
+    GHashTable *map;
+
+    /* Least recently used first */
+    QTAILQ_HEAD(, RamCacheEntry) lru;
+
+    int nr_dirty;
+    int max_dirty;
+
+    /* Waiting for an entry to become clean or not busy */
+    CoQueue wait;
+
+    /* Incremented by zero writes and discards, see ram_cache_fill() */
+    uint64_t invalidate_gen;
+
+    uint64_t writeback_interval;
+    QEMUTimer *writeback_timer;
+    bool writeback_running;
+
+    /* Result of the last background writeback */
+    int writeback_error;
+} BDRVRamCacheState;
+
+static QemuOptsList ram_cache_opts = {
+    .name = "ram-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(ram_cache_opts.head),
+    .desc = {
+        {
+            .name = RAM_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of memory used for cached data",
+        },
+        {
+            .name = RAM_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the units in which data is cached",
+        },
+        {
+            .name = RAM_CACHE_OPT_WRITEBACK_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Time in milliseconds after which dirty data is written "
+                    "back (0 = only on flush)",
+        },
+        {
+            .name = RAM_CACHE_OPT_MAX_DIRTY_RATIO,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Percentage of the cache that can be dirty before writes "
+                    "wait for writeback",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void ram_cache_start_writeback(BDRVRamCacheState *s);
+
+static bool ram_cache_entry_dirty(RamCacheEntry *e)
+{
+    return e->dirty_end > e->dirty_start;
+}
+
+static uint32_t ram_cache_cluster_bytes(BDRVRamCacheState *s,
+                                        uint64_t cluster)
+{
+    return MIN(s->cluster_size, s->size - cluster * s->cluster_size);
+}
+
+static RamCacheEntry *ram_cache_lookup(BDRVRamCacheState *s, uint64_t cluster)
+{
+    return g_hash_table_lookup(s->map, &cluster);
+}
+
+static void ram_cache_touch(BDRVRamCacheState *s, RamCacheEntry *e)
+{
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+}
+
+/* Assigns a clean entry to @cluster, or frees it for CLUSTER_NONE */
+static void ram_cache_set_cluster(BDRVRamCacheState *s, RamCacheEntry *e,
+                                  uint64_t cluster)
+{
+    assert(!e->busy && !ram_cache_entry_dirty(e));
+
+    if (e->cluster != CLUSTER_NONE) {
+        g_hash_table_remove(s->map, &e->cluster);
+    }
+    e->cluster = cluster;
+    e->valid = false;
+    if (cluster != CLUSTER_NONE) {
+        g_hash_table_insert(s->map, &e->cluster, e);
+        ram_cache_touch(s, e);
+    } else {
+        QTAILQ_REMOVE(&s->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&s->lru, e, lru);
+    }
+}
+
+static void ram_cache_arm_timer(BDRVRamCacheState *s)
+{
+    if (s->writeback_interval && !timer_pending(s->writeback_timer)) {
+        timer_mod(s->writeback_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  s->writeback_interval);
+    }
+}
+
+static void ram_cache_mark_dirty(BDRVRamCacheState *s, RamCacheEntry *e,
+                                 uint32_t start, uint32_t end)
+{
+    if (!ram_cache_entry_dirty(e)) {
+        e->dirty_start = start;
+        e->dirty_end = end;
+        s->nr_dirty++;
+        ram_cache_arm_timer(s);
+    } else {
+        e->dirty_start = MIN(e->dirty_start, start);
+        e->dirty_end = MAX(e->dirty_end, end);
+    }
+    e->write_gen++;
+}
+
+static void ram_cache_mark_clean(BDRVRamCacheState *s, RamCacheEntry *e)
+{
+    assert(ram_cache_entry_dirty(e));
+    e->dirty_start = e->dirty_end = 0;
+    s->nr_dirty--;
+}
+
+/*
+ * Returns the entry for @cluster in @pe, recycling the least recently used
+ * clean entry if it is not cached.  Waits for writeback if every entry is
+ * dirty or busy.
+ */
+static int coroutine_fn ram_cache_get_entry(BDRVRamCacheState *s,
+                                            uint64_t cluster,
+                                            RamCacheEntry **pe)
+{
+    RamCacheEntry *e;
+
+    for (;;) {
+        e = ram_cache_lookup(s, cluster);
+        if (e) {
+            break;
+        }
+
+        QTAILQ_FOREACH(e, &s->lru, lru) {
+            if (!e->busy && !ram_cache_entry_dirty(e)) {
+                break;
+            }
+        }
+        if (e) {
+            ram_cache_set_cluster(s, e, cluster);
+            break;
+        }
+
+        ram_cache_start_writeback(s);
+        qemu_co_queue_wait(&s->wait, NULL);
+        if (s->writeback_error < 0) {
+            return s->writeback_error;
+        }
+    }
+
+    *pe = e;
+    return 0;
+}
+
+/*
+ * Loads the parts of the cluster that are not dirty from the child.  If a
+ * zero write or discard happened meanwhile, the data that was read may be
+ * stale and the entry stays invalid; the caller should check again.
+ */
+static int coroutine_fn ram_cache_fill(BDRVRamCacheState *s, RamCacheEntry *e)
+{
+    uint64_t invalidate_gen = s->invalidate_gen;
+    uint32_t bytes = ram_cache_cluster_bytes(s, e->cluster);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    assert(!e->busy && !e->valid);
+
+    buf = qemu_try_blockalign(s->bs->file->bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = bytes,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    e->busy = true;
+    ret = bdrv_co_preadv(s->bs->file, e->cluster * s->cluster_size, bytes,
+                         &qiov, 0);
+    e->busy = false;
+    trace_ram_cache_fill(s, e->cluster, ret);
+
+    if (ret >= 0 && invalidate_gen == s->invalidate_gen) {
+        if (ram_cache_entry_dirty(e)) {
+            memcpy(e->buf, buf, e->dirty_start);
+            memcpy(e->buf + e->dirty_end, buf + e->dirty_end,
+                   bytes - e->dirty_end);
+        } else {
+            memcpy(e->buf, buf, bytes);
+        }
+        e->valid = true;
+    }
+
+    qemu_vfree(buf);
+    qemu_co_queue_restart_all(&s->wait);
+    return ret < 0 ? ret : 0;
+}
+
+/* Writes back the dirty ranges of @run[0..@n), which are adjacent */
+static int coroutine_fn ram_cache_write_run(BDRVRamCacheState *s,
+                                            RamCacheEntry **run, int n)
+{
+    uint64_t offset = run[0]->cluster * s->cluster_size + run[0]->dirty_start;
+    uint64_t *write_gen = g_new(uint64_t, n);
+    QEMUIOVector qiov;
+    int i, ret;
+
+    qemu_iovec_init(&qiov, n);
+    for (i = 0; i < n; i++) {
+        RamCacheEntry *e = run[i];
+
+        e->busy = true;
+        write_gen[i] = e->write_gen;
+        qemu_iovec_add(&qiov, e->buf + e->dirty_start,
+                       e->dirty_end - e->dirty_start);
+    }
+
+    ret = bdrv_co_pwritev(s->bs->file, offset, qiov.size, &qiov, 0);
+    trace_ram_cache_writeback(s, offset, qiov.size, n, ret);
+
+    for (i = 0; i < n; i++) {
+        RamCacheEntry *e = run[i];
+
+        e->busy = false;
+        if (ret >= 0 && e->write_gen == write_gen[i]) {
+            ram_cache_mark_clean(s, e);
+        }
+    }
+
+    qemu_iovec_destroy(&qiov);
+    g_free(write_gen);
+    qemu_co_queue_restart_all(&s->wait);
+    return ret < 0 ? ret : 0;
+}
+
+static int ram_cache_compare_cluster(const void *a, const void *b)
+{
+    const RamCacheEntry *ea = *(RamCacheEntry * const *)a;
+    const RamCacheEntry *eb = *(RamCacheEntry * const *)b;
+
+    return ea->cluster < eb->cluster ? -1 : ea->cluster > eb->cluster;
+}
+
+/*
+ * Writes back the entries for clusters [@start, @end) that are dirty when
+ * the function is called.  If an entry is being written back already, waits
+ * for that and writes it again if it is still dirty.
+ */
+static int coroutine_fn ram_cache_writeback(BDRVRamCacheState *s,
+                                            uint64_t start, uint64_t end)
+{
+    RamCacheEntry **dirty, **run;
+    int i, n, nr_run, ret = 0;
+    uint64_t bytes;
+
+    if (!s->nr_dirty) {
+        return 0;
+    }
+
+    dirty = g_new(RamCacheEntry *, s->nr_dirty);
+    n = 0;
+    for (i = 0; i < s->nr_entries; i++) {
+        RamCacheEntry *e = &s->entries[i];
+
+        if (ram_cache_entry_dirty(e) && e->cluster >= start &&
+            e->cluster < end) {
+            dirty[n++] = e;
+        }
+    }
+    qsort(dirty, n, sizeof(dirty[0]), ram_cache_compare_cluster);
+
+    run = g_new(RamCacheEntry *, MAX(n, 1));
+    i = 0;
+    while (i < n) {
+        RamCacheEntry *e = dirty[i];
+
+        if (!ram_cache_entry_dirty(e)) {
+            i++;
+            continue;
+        }
+        if (e->busy) {
+            qemu_co_queue_wait(&s->wait, NULL);
+            continue;
+        }
+
+        /* Extend the run while the dirty ranges touch */
+        run[0] = e;
+        nr_run = 1;
+        bytes = e->dirty_end - e->dirty_start;
+        for (i++; i < n; i++) {
+            RamCacheEntry *prev = run[nr_run - 1];
+            RamCacheEntry *next = dirty[i];
+
+            if (next->cluster != prev->cluster + 1 ||
+                prev->dirty_end != s->cluster_size ||
+                !ram_cache_entry_dirty(next) || next->busy ||
+                next->dirty_start != 0 ||
+                bytes + next->dirty_end > RAM_CACHE_MAX_WRITEBACK) {
+                break;
+            }
+            run[nr_run++] = next;
+            bytes += next->dirty_end;
+        }
+
+        ret = ram_cache_write_run(s, run, nr_run) ?: ret;
+    }
+
+    g_free(run);
+    g_free(dirty);
+    return ret;
+}
+
+static void coroutine_fn ram_cache_writeback_entry(void *opaque)
+{
+    BDRVRamCacheState *s = opaque;
+    BlockDriverState *bs = s->bs;
+
+    s->writeback_error = ram_cache_writeback(s, 0, CLUSTER_NONE);
+    s->writeback_running = false;
+    if (s->writeback_error < 0) {
+        qemu_co_queue_restart_all(&s->wait);
+    }
+    if (s->nr_dirty) {
+        ram_cache_arm_timer(s);
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+static void ram_cache_start_writeback(BDRVRamCacheState *s)
+{
+    Coroutine *co;
+
+    if (s->writeback_running) {
+        return;
+    }
+
+    s->writeback_running = true;
+    s->writeback_error = 0;
+    bdrv_inc_in_flight(s->bs);
+    co = qemu_coroutine_create(ram_cache_writeback_entry, s);
+    bdrv_coroutine_enter(s->bs, co);
+}
+
+static void ram_cache_writeback_timer_cb(void *opaque)
+{
+    BDRVRamCacheState *s = opaque;
+
+    /* No new requests in drained sections; drain_end rearms the timer */
+    if (s->bs->quiesce_counter) {
+        return;
+    }
+    ram_cache_start_writeback(s);
+}
+
+/*
+ * Writes back and drops the cached clusters that overlap with @offset and
+ * @bytes, so that a zero write or discard of the range is not overwritten
+ * by older data.  Writeback yields, so concurrent writes can dirty the
+ * clusters again; they are written back once more before being dropped.
+ */
+static int coroutine_fn ram_cache_invalidate(BDRVRamCacheState *s,
+                                             int64_t offset, int64_t bytes)
+{
+    uint64_t start = offset / s->cluster_size;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, s->cluster_size);
+    bool dirty, busy;
+    int i, ret;
+
+    s->invalidate_gen++;
+
+    do {
+        ret = ram_cache_writeback(s, start, end);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* Nothing yields here, so no write can sneak in before the drop */
+        dirty = busy = false;
+        for (i = 0; i < s->nr_entries; i++) {
+            RamCacheEntry *e = &s->entries[i];
+
+            if (e->cluster == CLUSTER_NONE || e->cluster < start ||
+                e->cluster >= end) {
+                continue;
+            }
+            if (ram_cache_entry_dirty(e)) {
+                dirty = true;
+            } else if (e->busy) {
+                busy = true;
+            } else {
+                ram_cache_set_cluster(s, e, CLUSTER_NONE);
+            }
+        }
+
+        /* Entries that are being loaded are dropped once that is done */
+        if (busy && !dirty) {
+            qemu_co_queue_wait(&s->wait, NULL);
+        }
+    } while (dirty || busy);
+
+    qemu_co_queue_restart_all(&s->wait);
+    return 0;
+}
+
+static int coroutine_fn ram_cache_read_cluster(BDRVRamCacheState *s,
+                                               uint64_t cluster,
+                                               uint32_t start, uint32_t bytes,
+                                               QEMUIOVector *qiov,
+                                               size_t qiov_offset)
+{
+    RamCacheEntry *e;
+    int ret;
+
+    for (;;) {
+        ret = ram_cache_get_entry(s, cluster, &e);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (e->valid ||
+            (start >= e->dirty_start && start + bytes <= e->dirty_end)) {
+            qemu_iovec_from_buf(qiov, qiov_offset, e->buf + start, bytes);
+            ram_cache_touch(s, e);
+            return 0;
+        }
+
+        if (e->busy) {
+            qemu_co_queue_wait(&s->wait, NULL);
+            continue;
+        }
+
+        ret = ram_cache_fill(s, e);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+static int coroutine_fn ram_cache_write_cluster(BDRVRamCacheState *s,
+                                                uint64_t cluster,
+                                                uint32_t start, uint32_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset)
+{
+    RamCacheEntry *e;
+    int ret;
+
+    for (;;) {
+        ret = ram_cache_get_entry(s, cluster, &e);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /*
+         * The dirty range must stay contiguous, so if there would be a gap
+         * between the old and the new data, the gap must be loaded first
+         */
+        if (e->valid || !ram_cache_entry_dirty(e) ||
+            (start <= e->dirty_end && start + bytes >= e->dirty_start)) {
+            qemu_iovec_to_buf(qiov, qiov_offset, e->buf + start, bytes);
+            ram_cache_mark_dirty(s, e, start, start + bytes);
+            ram_cache_touch(s, e);
+            return 0;
+        }
+
+        if (e->busy) {
+            qemu_co_queue_wait(&s->wait, NULL);
+            continue;
+        }
+
+        ret = ram_cache_fill(s, e);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+static int coroutine_fn ram_cache_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret;
+
+    while (done < bytes) {
+        uint64_t cluster = (offset + done) / s->cluster_size;
+        uint32_t start = (offset + done) % s->cluster_size;
+        uint32_t n = MIN(bytes - done, s->cluster_size - start);
+
+        ret = ram_cache_read_cluster(s, cluster, start, n, qiov, done);
+        if (ret < 0) {
+            return ret;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn ram_cache_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret;
+
+    while (done < bytes) {
+        uint64_t cluster = (offset + done) / s->cluster_size;
+        uint32_t start = (offset + done) % s->cluster_size;
+        uint32_t n = MIN(bytes - done, s->cluster_size - start);
+
+        ret = ram_cache_write_cluster(s, cluster, start, n, qiov, done);
+        if (ret < 0) {
+            return ret;
+        }
+        done += n;
+    }
+
+    /* Too much dirty data, wait until writeback catches up */
+    while (s->nr_dirty > s->max_dirty) {
+        ram_cache_start_writeback(s);
+        qemu_co_queue_wait(&s->wait, NULL);
+        if (s->writeback_error < 0) {
+            return s->writeback_error;
+        }
+    }
+
+    return 0;
+}
+
+static int coroutine_fn ram_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    int ret;
+
+    ret = ram_cache_invalidate(s, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    /* Drop what concurrent reads have loaded meanwhile */
+    return ram_cache_invalidate(s, offset, bytes) ?: ret;
+}
+
+static int coroutine_fn ram_cache_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    int ret;
+
+    ret = ram_cache_invalidate(s, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    return ram_cache_invalidate(s, offset, bytes) ?: ret;
+}
+
+static int coroutine_fn ram_cache_co_flush(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    int ret;
+
+    ret = ram_cache_writeback(s, 0, CLUSTER_NONE);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_flush(bs->file->bs);
+}
+
+/*
+ * Dirty clusters are reported as data, because the child does not know
+ * about them yet; everything else is passed through.
+ */
+static int coroutine_fn ram_cache_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    uint64_t cluster = offset / s->cluster_size;
+    uint64_t next_dirty = CLUSTER_NONE;
+    RamCacheEntry *e;
+    int i;
+
+    e = ram_cache_lookup(s, cluster);
+    if (e && ram_cache_entry_dirty(e)) {
+        *pnum = MIN(bytes, (cluster + 1) * s->cluster_size - offset);
+        return BDRV_BLOCK_DATA;
+    }
+
+    for (i = 0; s->nr_dirty && i < s->nr_entries; i++) {
+        e = &s->entries[i];
+        if (ram_cache_entry_dirty(e) && e->cluster > cluster) {
+            next_dirty = MIN(next_dirty, e->cluster);
+        }
+    }
+
+    *pnum = bytes;
+    if (next_dirty != CLUSTER_NONE) {
+        *pnum = MIN(bytes, next_dirty * s->cluster_size - offset);
+    }
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static void ram_cache_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    timer_del(s->writeback_timer);
+    timer_free(s->writeback_timer);
+    s->writeback_timer = NULL;
+}
+
+static void ram_cache_attach_aio_context(BlockDriverState *bs,
+                                         AioContext *new_context)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    s->writeback_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME,
+                                       SCALE_MS, ram_cache_writeback_timer_cb,
+                                       s);
+}
+
+static void coroutine_fn ram_cache_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    timer_del(s->writeback_timer);
+}
+
+static void coroutine_fn ram_cache_co_drain_end(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    if (s->nr_dirty) {
+        ram_cache_arm_timer(s);
+    }
+}
+
+static void ram_cache_free(BDRVRamCacheState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_entries; i++) {
+        qemu_vfree(s->entries[i].buf);
+    }
+    g_free(s->entries);
+    s->entries = NULL;
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+}
+
+static int ram_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    uint64_t cache_size, cluster_size, interval, ratio;
+    int i, ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED;
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+                               ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP) &
+                                    bs->file->bs->supported_zero_flags);
+
+    opts = qemu_opts_create(&ram_cache_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, RAM_CACHE_OPT_SIZE,
+                                   DEFAULT_RAM_CACHE_SIZE);
+    cluster_size = qemu_opt_get_size(opts, RAM_CACHE_OPT_CLUSTER_SIZE,
+                                     DEFAULT_RAM_CACHE_CLUSTER_SIZE);
+    interval = qemu_opt_get_number(opts, RAM_CACHE_OPT_WRITEBACK_INTERVAL,
+                                   DEFAULT_WRITEBACK_INTERVAL);
+    ratio = qemu_opt_get_number(opts, RAM_CACHE_OPT_MAX_DIRTY_RATIO,
+                                DEFAULT_MAX_DIRTY_RATIO);
+
+    if (cluster_size < MIN_RAM_CACHE_CLUSTER_SIZE ||
+        cluster_size > MAX_RAM_CACHE_CLUSTER_SIZE ||
+        !is_power_of_2(cluster_size)) {
+        error_setg(errp, RAM_CACHE_OPT_CLUSTER_SIZE " must be a power of two "
+                   "between %d and %" PRId64, MIN_RAM_CACHE_CLUSTER_SIZE,
+                   MAX_RAM_CACHE_CLUSTER_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (cache_size < cluster_size ||
+        cache_size / cluster_size > INT_MAX) {
+        error_setg(errp, RAM_CACHE_OPT_SIZE " must be at least "
+                   RAM_CACHE_OPT_CLUSTER_SIZE " and at most %" PRIu64,
+                   (uint64_t)INT_MAX * cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (ratio < 1 || ratio > 100) {
+        error_setg(errp, RAM_CACHE_OPT_MAX_DIRTY_RATIO
+                   " must be between 1 and 100");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->size = bdrv_getlength(bs->file->bs);
+    if (s->size < 0) {
+        error_setg_errno(errp, -s->size, "Could not get the image size");
+        ret = s->size;
+        goto fail;
+    }
+
+    s->bs = bs;
+    s->cluster_size = cluster_size;
+    s->writeback_interval = interval;
+    s->nr_entries = cache_size / cluster_size;
+    s->max_dirty = MAX(s->nr_entries * ratio / 100, 1);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    qemu_co_queue_init(&s->wait);
+
+    s->entries = g_try_new0(RamCacheEntry, s->nr_entries);
+    if (!s->entries) {
+        s->nr_entries = 0;
+        goto fail_nomem;
+    }
+    for (i = 0; i < s->nr_entries; i++) {
+        RamCacheEntry *e = &s->entries[i];
+
+        e->cluster = CLUSTER_NONE;
+        e->buf = qemu_try_blockalign(bs->file->bs, cluster_size);
+        if (!e->buf) {
+            goto fail_nomem;
+        }
+        QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+    }
+
+    ram_cache_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    trace_ram_cache_open(s, bs, s->nr_entries, s->cluster_size);
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail_nomem:
+    error_setg(errp, "Could not allocate %" PRIu64 " bytes of cache",
+               cache_size);
+    ret = -ENOMEM;
+fail:
+    ram_cache_free(s);
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void ram_cache_close(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    /* bdrv_close() has flushed the cache, unless writeback failed */
+    ram_cache_detach_aio_context(bs);
+    ram_cache_free(s);
+}
+
+static int ram_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    /* The cache has been flushed, and the options cannot change */
+    return 0;
+}
+
+static void ram_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 const BdrvChildRole *role,
+                                 BlockReopenQueue *reopen_queue,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+
+    /* Other writers would make the cached data stale */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int64_t ram_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static bool ram_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_ram_cache = {
+    .format_name                        = "ram-cache",
+    .instance_size                      = sizeof(BDRVRamCacheState),
+
+    .bdrv_open                          = ram_cache_open,
+    .bdrv_close                         = ram_cache_close,
+    .bdrv_reopen_prepare                = ram_cache_reopen_prepare,
+    .bdrv_child_perm                    = ram_cache_child_perm,
+
+    .bdrv_getlength                     = ram_cache_getlength,
+
+    .bdrv_co_preadv                     = ram_cache_co_preadv,
+    .bdrv_co_pwritev                    = ram_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = ram_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = ram_cache_co_pdiscard,
+    .bdrv_co_flush                      = ram_cache_co_flush,
+
+    .bdrv_co_block_status               = ram_cache_co_block_status,
+
+    .bdrv_attach_aio_context            = ram_cache_attach_aio_context,
+    .bdrv_detach_aio_context            = ram_cache_detach_aio_context,
+    .bdrv_co_drain_begin                = ram_cache_co_drain_begin,
+    .bdrv_co_drain_end                  = ram_cache_co_drain_end,
+
+    .bdrv_recurse_is_first_non_filter   = ram_cache_recurse_is_first_non_filter,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_ram_cache_init(void)
+{
+    bdrv_register(&bdrv_ram_cache);
+}
+
+block_init(bdrv_ram_cache_init);
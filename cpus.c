@@ -41,6 +41,7 @@
 #include "sysemu/hvf.h"
 #include "sysemu/whpx.h"
 #include "exec/exec-all.h"
+#include "exec/tb-profile.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -225,6 +226,15 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+
+    tb_speculate_enable(qemu_opt_get_bool(opts, "speculate", false));
+
+    t = qemu_opt_get(opts, "profile");
+    if (t) {
+        tb_profile_enable(t, qemu_opt_get(opts, "profile-file"), errp);
+    } else if (qemu_opt_get(opts, "profile-file")) {
+        error_setg(errp, "'profile-file' requires 'profile'");
+    }
 }
 
 /* The current number of executed instructions is based on what we
@@ -1137,6 +1147,22 @@ static void qemu_kvm_destroy_vcpu(CPUState *cpu)
 
 static void qemu_tcg_destroy_vcpu(CPUState *cpu)
 {
+    tb_speculate_cleanup(cpu);
+}
+
+/*
+ * Translate the likely successors of recently translated TBs while @cpu
+ * is halted.  Called with the iothread lock held.
+ */
+static void qemu_tcg_speculate(CPUState *cpu)
+{
+    bool more = true;
+
+    while (more && cpu_thread_is_idle(cpu) && !cpu_is_stopped(cpu)) {
+        qemu_mutex_unlock_iothread();
+        more = tb_speculate(cpu);
+        qemu_mutex_lock_iothread();
+    }
 }
 
 static void qemu_cpu_stop(CPUState *cpu, bool exit)
@@ -1161,6 +1187,16 @@ static void qemu_wait_io_event_common(CPUState *cpu)
 
 static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
 {
+    CPUState *c;
+
+    /* Use the spare time, if any, before sleeping */
+    CPU_FOREACH(c) {
+        if (!all_cpu_threads_idle()) {
+            break;
+        }
+        qemu_tcg_speculate(c);
+    }
+
     while (all_cpu_threads_idle()) {
         stop_tcg_kick_timer();
         break; // TODO Is it safe?
@@ -1505,6 +1541,7 @@ void qemu_tcg_rr_cpu_thread_func(void)
 
                 process_icount_data(cpu);
                 qemu_mutex_lock_iothread();
+                qemu_flush_coalesced_mmio_buffer();
 
                 if (r == EXCP_DEBUG) {
                     cpu_handle_guest_debug(cpu);
@@ -1696,6 +1733,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
             qemu_mutex_unlock_iothread();
             r = tcg_cpu_exec(cpu);
             qemu_mutex_lock_iothread();
+            qemu_flush_coalesced_mmio_buffer();
             switch (r) {
             case EXCP_DEBUG:
                 cpu_handle_guest_debug(cpu);
@@ -1721,6 +1759,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
         }
 
         atomic_mb_set(&cpu->exit_request, 0);
+        qemu_tcg_speculate(cpu);
         qemu_wait_io_event(cpu);
     } while (!cpu->unplug || cpu_can_run(cpu));
 
@@ -11,6 +11,9 @@ function link_bin() {
   echo "Linking $1..."
   base=$(basename $1)
   ln -sf $1 $base.bc
+  # Only the code that can yield inside coroutines needs Asyncify
+  $top/emscripten/gen_asyncify_list.py $top add > asyncify-add.json || exit 1
+  $top/emscripten/gen_asyncify_list.py $top remove > asyncify-remove.json
   time emcc $base.bc $OPTS \
     $build/stub/*.so \
     $build/$GLIB_SRC/glib/.libs/libglib-2.0.so \
@@ -27,6 +30,10 @@ function link_bin() {
     -s EXPORTED_FUNCTIONS='["_main","_helper_ret_ldub_mmu","_helper_le_lduw_mmu","_helper_le_ldul_mmu","_helper_le_ldq_mmu","_helper_be_lduw_mmu","_helper_be_ldul_mmu","_helper_be_ldq_mmu","_helper_ret_stb_mmu","_helper_le_stw_mmu","_helper_le_stl_mmu","_helper_le_stq_mmu","_helper_be_stw_mmu","_helper_be_stl_mmu","_helper_be_stq_mmu","_call_helper"]' \
     -s EXTRA_EXPORTED_RUNTIME_METHODS='["addFunction"]' \
     -s ALLOW_MEMORY_GROWTH=1 \
+    -s ASYNCIFY=1 \
+    -s ASYNCIFY_IGNORE_INDIRECT=1 \
+    -s ASYNCIFY_ADD=@asyncify-add.json \
+    -s ASYNCIFY_REMOVE=@asyncify-remove.json \
     --shell-file $top/shell.html \
     $ARGS
   ls -lh $base*
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+# Generate the Asyncify function lists for the asyncify coroutine backend.
+#
+# Only functions that can be on the stack of a coroutine when it yields
+# must be instrumented.  They are found on a call graph built from the
+# source tree:
+#
+# - the roots are the coroutine entry points, i.e. the arguments of
+#   qemu_coroutine_create(), and the coroutine_fn functions.  Entry points
+#   that are passed through a parameter, a local variable or a table (like
+#   the block-backend and 9p ones) are followed back to the functions that
+#   are assigned to them;
+# - the edges are direct calls, whether or not the callee is coroutine_fn
+#   (e.g. qcow2_cache_do_get() -> bdrv_pread()), and calls through struct
+#   members that are declared coroutine_fn or CoroutineEntry.  Such a call
+#   can reach every function that is assigned to a member of that name,
+#   e.g. ".bdrv_co_preadv = qcow2_co_preadv";
+# - a function is on a yield path if it is reachable from a root and it
+#   can reach qemu_coroutine_switch().
+#
+# Other indirect calls are not followed, and Asyncify ignores them as well
+# (ASYNCIFY_IGNORE_INDIRECT).  Function pointers that can yield must
+# therefore be declared coroutine_fn, except for the few that are listed in
+# yielding_member_calls below, and for the entry function itself, which is
+# called by coroutine_asyncify_trampoline().
+#
+# "add" prints the functions on a yield path and the yield side of the
+# backend (see util/coroutine-asyncify.c), for "emcc -s ASYNCIFY_ADD=@file".
+# "remove" prints the enter side of the backend, where unwinding stops, for
+# "emcc -s ASYNCIFY_REMOVE=@file".  It also keeps everything that enters a
+# coroutine from being instrumented because of a call to it.
+#
+# Usage: gen_asyncify_list.py SRCDIR add|remove > asyncify-{add,remove}.json
+
+import json
+import os
+import re
+import sys
+
+backend = [
+    'coroutine_asyncify_trampoline',
+    'coroutine_asyncify_suspend',
+    'qemu_coroutine_switch',
+]
+
+remove = [
+    'coroutine_asyncify_enter',
+    'qemu_aio_coroutine_enter',
+]
+
+yields = ['qemu_coroutine_switch']
+
+# (caller, member) pairs of calls through members that are not declared
+# coroutine_fn, but whose targets can yield when called from a coroutine
+yielding_member_calls = [
+    # qcow2_close() and bdrv_qed_close() flush, e.g. after blk_unref() in
+    # qcow2_co_create()
+    ('bdrv_close', 'bdrv_close'),
+    # before_write_notifiers, e.g. backup_before_write_notify()
+    ('notifier_with_return_list_notify', 'notify'),
+]
+
+skip_dirs = ['build', 'roms', 'tests']
+
+keywords = set(['if', 'for', 'while', 'switch', 'return', 'sizeof',
+                'typeof', '__typeof__', 'defined', '__attribute__',
+                'offsetof', 'case', 'do', 'else', 'goto'])
+
+comment = re.compile(r'/\*.*?\*/|//[^\n]*|"(?:\\.|[^"\\\n])*"|'
+                     r"'(?:\\.|[^'\\\n])*'", re.S)
+preprocessor = re.compile(r'^[ \t]*#(?:[^\n]*\\\n)*[^\n]*', re.M)
+ident = re.compile(r'\b[A-Za-z_]\w*\b')
+call = re.compile(r'(->|\.)?\s*\b([A-Za-z_]\w*)\s*\(')
+member_assign = re.compile(r'(?:\.|->)\s*(\w+)\s*=\s*&?\s*(\w+)\s*[,;}]')
+coroutine_fn = re.compile(r'\bcoroutine_fn\b[\w\s\*]*?\b(\w+)\s*\(')
+coroutine_member = re.compile(r'\bcoroutine_fn\s*\(\s*\*\s*(\w+)\s*\)|'
+                              r'\bCoroutineEntry\s*\*\s*(\w+)\s*;')
+table = re.compile(r'\b(\w+)\s*\[[^\]]*\]\s*=\s*$')
+
+class Function:
+    def __init__(self, name, params, body):
+        self.name = name
+        self.params = params
+        self.body = body
+        self.calls = set()
+        self.member_calls = set()
+        for m in call.finditer(body):
+            if m.group(1):
+                self.member_calls.add(m.group(2))
+            elif m.group(2) not in keywords:
+                self.calls.add(m.group(2))
+
+def strip(text):
+    text = comment.sub(lambda m: '""' if m.group(0)[0] == '"' else ' ', text)
+    return preprocessor.sub('', text)
+
+def split_args(text, start):
+    """Split the arguments of the call whose '(' is at text[start - 1]"""
+    args, depth, arg_start = [], 0, start
+    for i in range(start, len(text)):
+        c = text[i]
+        if c in '([{':
+            depth += 1
+        elif c in ')]}':
+            if depth == 0:
+                args.append(text[arg_start:i].strip())
+                return args
+            depth -= 1
+        elif c == ',' and depth == 0:
+            args.append(text[arg_start:i].strip())
+            arg_start = i + 1
+    return args
+
+def param_name(param):
+    m = re.search(r'\(\s*\*\s*(\w+)\s*\)', param)
+    if m:
+        return m.group(1)
+    names = ident.findall(param)
+    return names[-1] if names else None
+
+def parse(text, functions, tables):
+    """Add the function definitions and initialized tables in @text"""
+    depth, top = 0, 0
+    i = 0
+    while i < len(text):
+        c = text[i]
+        if c == '{':
+            if depth == 0:
+                header, open_brace = text[top:i], i
+            depth += 1
+        elif c == '}':
+            depth -= 1
+            if depth == 0:
+                add_block(header, text[open_brace + 1:i], functions, tables)
+                top = i + 1
+        elif c == ';' and depth == 0:
+            top = i + 1
+        i += 1
+
+def add_block(header, body, functions, tables):
+    header = header.strip()
+    m = table.search(header)
+    if m:
+        tables.setdefault(m.group(1), set()).update(ident.findall(body))
+        return
+    if not header.endswith(')'):
+        return
+    for m in call.finditer(header):
+        if not m.group(1) and m.group(2) not in keywords:
+            break
+    else:
+        return
+    params = [param_name(p) for p in split_args(header, m.end())]
+    functions.setdefault(m.group(2), []).append(
+        Function(m.group(2), params, body))
+
+def scan(srcdir):
+    functions, tables, members = {}, {}, {}
+    coroutine_fns, coroutine_members = set(), set()
+    for root, dirs, files in os.walk(srcdir):
+        dirs[:] = [d for d in dirs
+                   if not d.startswith('.') and d not in skip_dirs]
+        for f in files:
+            if not f.endswith(('.c', '.h')):
+                continue
+            with open(os.path.join(root, f), errors='replace') as fp:
+                text = fp.read()
+            text = strip(text)
+            coroutine_fns.update(coroutine_fn.findall(text))
+            for m in coroutine_member.finditer(text):
+                coroutine_members.add(m.group(1) or m.group(2))
+            parse(text, functions, tables)
+            for m in member_assign.finditer(text):
+                members.setdefault(m.group(1), set()).add(m.group(2))
+    return functions, tables, members, coroutine_members, coroutine_fns
+
+def resolve_entry(arg, fn, functions, tables, depth=0):
+    """Return the functions that the expression @arg in @fn can evaluate to"""
+    arg = re.sub(r'^\(\s*CoroutineEntry\s*\*\s*\)|^&', '', arg).strip()
+    if arg in functions:
+        return set([arg])
+    if depth > 4 or not re.match(r'^\w+$', arg):
+        return None
+    result = set()
+    if arg in fn.params:
+        # Follow the parameter back to the callers of @fn
+        index = fn.params.index(arg)
+        for callers in functions.values():
+            for caller in callers:
+                for m in re.finditer(r'\b%s\s*\(' % fn.name, caller.body):
+                    args = split_args(caller.body, m.end())
+                    if index < len(args):
+                        r = resolve_entry(args[index], caller, functions,
+                                          tables, depth + 1)
+                        result |= r or set()
+    for m in re.finditer(r'\b%s\s*=\s*([^;=][^;]*);' % arg, fn.body):
+        for name in ident.findall(m.group(1)):
+            if name in functions:
+                result.add(name)
+            elif name in tables:
+                result |= tables[name] & set(functions)
+    return result or None
+
+def entry_points(functions, tables):
+    entries = set()
+    for fns in list(functions.values()):
+        for fn in fns:
+            for m in re.finditer(r'\bqemu_coroutine_create\s*\(', fn.body):
+                args = split_args(fn.body, m.end())
+                r = resolve_entry(args[0], fn, functions, tables)
+                if r is None:
+                    sys.stderr.write('%s: cannot resolve coroutine entry '
+                                     'point "%s"\n' % (fn.name, args[0]))
+                    sys.exit(1)
+                entries |= r
+    return entries
+
+def edges(functions, members, coroutine_members):
+    graph = {}
+    for name, fns in functions.items():
+        out = graph.setdefault(name, set())
+        for fn in fns:
+            out.update(c for c in fn.calls if c in functions)
+            for m in fn.member_calls:
+                if (m in coroutine_members or
+                    (name, m) in yielding_member_calls):
+                    out.update(t for t in members.get(m, ())
+                               if t in functions)
+    return graph
+
+def reach(graph, start):
+    seen, todo = set(start), list(start)
+    while todo:
+        for callee in graph.get(todo.pop(), ()):
+            if callee not in seen:
+                seen.add(callee)
+                todo.append(callee)
+    return seen
+
+def add_list(srcdir):
+    functions, tables, members, coroutine_members, coroutine_fns = \
+        scan(srcdir)
+    bad = sorted(set(remove) & coroutine_fns)
+    if bad:
+        sys.stderr.write('coroutine_fn functions in ASYNCIFY_REMOVE: %s\n' %
+                         ', '.join(bad))
+        sys.exit(1)
+
+    graph = edges(functions, members, coroutine_members)
+    for name in remove:
+        graph.pop(name, None)
+    reverse = {}
+    for caller, callees in graph.items():
+        for callee in callees:
+            reverse.setdefault(callee, set()).add(caller)
+
+    roots = entry_points(functions, tables) | (coroutine_fns & set(graph))
+    on_path = reach(graph, roots) & reach(reverse, yields)
+    return sorted((on_path | set(backend)) - set(remove))
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3 or sys.argv[2] not in ('add', 'remove'):
+        sys.stderr.write('Usage: %s SRCDIR add|remove\n' % sys.argv[0])
+        sys.exit(1)
+    if sys.argv[2] == 'add':
+        names = add_list(sys.argv[1])
+    else:
+        names = remove
+    json.dump(names, sys.stdout, indent=0)
+    sys.stdout.write('\n')
@@ -951,6 +951,9 @@ void cpu_exec_unrealizefn(CPUState *cpu)
     }
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_free_notifier_list(cpu);
+    if (tcg_enabled()) {
+        tlb_destroy(cpu);
+    }
 #endif
 }
 
@@ -1001,6 +1004,10 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
     }
 
     cpu->iommu_notifiers = g_array_new(false, true, sizeof(TCGIOMMUNotifier));
+
+    if (tcg_enabled()) {
+        tlb_init(cpu);
+    }
 #endif
 }
 
@@ -1656,6 +1663,9 @@ void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
         kvm_flush_coalesced_mmio_buffer();
+    if (tcg_enabled()) {
+        tcg_flush_coalesced_mmio_buffer();
+    }
 }
 
 void qemu_mutex_lock_ramlist(void)
@@ -2489,6 +2499,33 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the contents of an anonymous RAM block with a private
+ * mapping of @fd, starting at @offset.  The guest sees the file
+ * contents, but pages are only read when first touched and writes
+ * never reach the file.  Returns -ENOTSUP if the block is not backed
+ * by private anonymous memory of the host page size.
+ */
+int qemu_ram_map_file(RAMBlock *rb, int fd, off_t offset)
+{
+    void *area;
+
+    if ((rb->flags & (RAM_PREALLOC | RAM_SHARED)) || rb->fd >= 0 ||
+        xen_enabled() || phys_mem_alloc != qemu_anon_ram_alloc ||
+        rb->page_size != qemu_real_host_page_size ||
+        (offset & (qemu_real_host_page_size - 1))) {
+        return -ENOTSUP;
+    }
+
+    area = mmap(rb->host, rb->used_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (area != rb->host) {
+        return -errno;
+    }
+    qemu_ram_setup_dump(rb->host, rb->used_length);
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -3470,53 +3507,49 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* Memory returned by address_space_map() for non-RAM regions */
+struct BounceBuffer {
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
-} BounceBuffer;
-
-static BounceBuffer bounce;
+    size_t len;
+    QLIST_ENTRY(BounceBuffer) link;
+    uint8_t buffer[];
+};
 
-typedef struct MapClient {
+typedef struct AddressSpaceMapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(
+    AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3532,28 +3565,87 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    as->max_bounce_buffer_size = size;
+    if (as->bounce_buffer_size < size) {
+        address_space_notify_map_clients_locked(as);
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+/* Reserves up to *plen bytes of bounce buffer memory in @as */
+static BounceBuffer *address_space_get_bounce_buffer(AddressSpace *as,
+                                                     hwaddr addr,
+                                                     hwaddr *plen)
+{
+    BounceBuffer *bounce;
+    hwaddr l;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    if (as->bounce_buffer_size >= as->max_bounce_buffer_size) {
+        qemu_mutex_unlock(&as->bounce_lock);
+        return NULL;
+    }
+    l = MIN(*plen, as->max_bounce_buffer_size - as->bounce_buffer_size);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size + l);
+
+    bounce = g_malloc(sizeof(*bounce) + l);
+    bounce->addr = addr;
+    bounce->len = l;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    qemu_mutex_unlock(&as->bounce_lock);
+
+    *plen = l;
+    return bounce;
+}
+
+static BounceBuffer *address_space_find_bounce_buffer(AddressSpace *as,
+                                                      void *buffer)
+{
+    BounceBuffer *bounce;
+
+    /* Fast path for RAM; a buffer of our own would be accounted for */
+    if (!atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_put_bounce_buffer(AddressSpace *as,
+                                            BounceBuffer *bounce)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_REMOVE(bounce, link);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size - bounce->len);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, int len,
@@ -3623,8 +3715,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3648,26 +3740,26 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        l = MIN(l, TARGET_PAGE_SIZE);
+        bounce = address_space_get_bounce_buffer(as, addr, &l);
+        if (!bounce) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                          bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3687,7 +3779,10 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce;
+
+    bounce = address_space_find_bounce_buffer(as, buffer);
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3703,14 +3798,11 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    memory_region_unref(bounce->mr);
+    address_space_put_bounce_buffer(as, bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <float.h>
+#include <math.h>
 #include "qemu/bitops.h"
 #include "fpu/softfloat.h"
 
@@ -336,8 +338,8 @@ static inline float64 float64_pack_raw(FloatParts p)
 #include "softfloat-specialize.h"
 
 /* Canonicalize EXP and FRAC, setting CLS.  */
-static FloatParts canonicalize(FloatParts part, const FloatFmt *parm,
-                               float_status *status)
+static FloatParts sf_canonicalize(FloatParts part, const FloatFmt *parm,
+                                  float_status *status)
 {
     if (part.exp == parm->exp_max && !parm->arm_althp) {
         if (part.frac == 0) {
@@ -513,7 +515,7 @@ static FloatParts round_canonical(FloatParts p, float_status *s,
 static FloatParts float16a_unpack_canonical(float16 f, float_status *s,
                                             const FloatFmt *params)
 {
-    return canonicalize(float16_unpack_raw(f), params, s);
+    return sf_canonicalize(float16_unpack_raw(f), params, s);
 }
 
 static FloatParts float16_unpack_canonical(float16 f, float_status *s)
@@ -534,7 +536,7 @@ static float16 float16_round_pack_canonical(FloatParts p, float_status *s)
 
 static FloatParts float32_unpack_canonical(float32 f, float_status *s)
 {
-    return canonicalize(float32_unpack_raw(f), &float32_params, s);
+    return sf_canonicalize(float32_unpack_raw(f), &float32_params, s);
 }
 
 static float32 float32_round_pack_canonical(FloatParts p, float_status *s)
@@ -544,7 +546,7 @@ static float32 float32_round_pack_canonical(FloatParts p, float_status *s)
 
 static FloatParts float64_unpack_canonical(float64 f, float_status *s)
 {
-    return canonicalize(float64_unpack_raw(f), &float64_params, s);
+    return sf_canonicalize(float64_unpack_raw(f), &float64_params, s);
 }
 
 static float64 float64_round_pack_canonical(FloatParts p, float_status *s)
@@ -720,6 +722,170 @@ static FloatParts addsub_floats(FloatParts a, FloatParts b, bool subtract,
     g_assert_not_reached();
 }
 
+/*
+ * Hardfloat
+ *
+ * The float32 and float64 operations below first try to compute the result
+ * with the host FPU, and only fall back to the bit-level code when the host
+ * result could differ from what softfloat computes, including the exception
+ * flags.  This is the case unless all of the following hold:
+ *
+ * - the rounding mode is round-to-nearest-even, which is what the host uses;
+ *
+ * - the inexact flag is already set.  Reading the host FPU flags after every
+ *   operation is about as slow as softfloat, but guests rarely clear the
+ *   inexact flag, and once it is set the host does not need to tell whether
+ *   the result is exact;
+ *
+ * - the inputs are zero or normal, after flushing them to zero if requested.
+ *   NaNs, infinities and denormals are rare and their handling is target
+ *   specific;
+ *
+ * - the result is not tiny.  An infinite result from finite inputs means
+ *   overflow, which is raised here; a result that might be tiny but not
+ *   exactly zero is recomputed by softfloat, which knows about underflow,
+ *   tininess detection and flushing outputs to zero.
+ *
+ * Targets that clear the flags before every operation never meet the second
+ * condition, so hardfloat is disabled for them.  It is also disabled when the
+ * host does not evaluate float and double expressions in their own precision.
+ */
+
+#if defined(TARGET_PPC) || defined(__FAST_MATH__) || \
+    (defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0)
+# define QEMU_NO_HARDFLOAT 1
+# define QEMU_SOFTFLOAT_ATTR __attribute__((flatten))
+#else
+# define QEMU_NO_HARDFLOAT 0
+# define QEMU_SOFTFLOAT_ATTR __attribute__((flatten, noinline))
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+typedef bool (*f32_check_fn)(union_float32 a, union_float32 b);
+typedef bool (*f64_check_fn)(union_float64 a, union_float64 b);
+
+typedef float32 (*soft_f32_op2_fn)(float32 a, float32 b, float_status *s);
+typedef float64 (*soft_f64_op2_fn)(float64 a, float64 b, float_status *s);
+typedef float (*hard_f32_op2_fn)(float a, float b);
+typedef double (*hard_f64_op2_fn)(double a, double b);
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely(s->float_exception_flags & float_flag_inexact &&
+                  s->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool f32_is_zon(union_float32 a)
+{
+    return float32_is_zero(a.s) || float32_is_normal(a.s);
+}
+
+static inline bool f64_is_zon(union_float64 a)
+{
+    return float64_is_zero(a.s) || float64_is_normal(a.s);
+}
+
+static inline bool f32_is_zon2(union_float32 a, union_float32 b)
+{
+    return f32_is_zon(a) && f32_is_zon(b);
+}
+
+static inline bool f64_is_zon2(union_float64 a, union_float64 b)
+{
+    return f64_is_zon(a) && f64_is_zon(b);
+}
+
+static inline bool f32_is_zon3(union_float32 a, union_float32 b,
+                               union_float32 c)
+{
+    return f32_is_zon(a) && f32_is_zon(b) && f32_is_zon(c);
+}
+
+static inline bool f64_is_zon3(union_float64 a, union_float64 b,
+                               union_float64 c)
+{
+    return f64_is_zon(a) && f64_is_zon(b) && f64_is_zon(c);
+}
+
+/*
+ * Computes @hard(@xa, @xb) on the host if @pre accepts the inputs.  A tiny
+ * result is recomputed with @soft if @post returns true for the inputs,
+ * i.e. unless the inputs guarantee that the result is exactly zero.
+ */
+static inline float32 float32_gen2(float32 xa, float32 xb, float_status *s,
+                                   hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                                   f32_check_fn pre, f32_check_fn post)
+{
+    union_float32 ua, ub, ur;
+
+    ua.s = xa;
+    ub.s = xb;
+
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+
+    ua.s = float32_squash_input_denormal(ua.s, s);
+    ub.s = float32_squash_input_denormal(ub.s, s);
+    if (unlikely(!pre(ua, ub))) {
+        goto soft;
+    }
+
+    ur.h = hard(ua.h, ub.h);
+    if (unlikely(float32_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && post(ua, ub)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(ua.s, ub.s, s);
+}
+
+static inline float64 float64_gen2(float64 xa, float64 xb, float_status *s,
+                                   hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                                   f64_check_fn pre, f64_check_fn post)
+{
+    union_float64 ua, ub, ur;
+
+    ua.s = xa;
+    ub.s = xb;
+
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+
+    ua.s = float64_squash_input_denormal(ua.s, s);
+    ub.s = float64_squash_input_denormal(ub.s, s);
+    if (unlikely(!pre(ua, ub))) {
+        goto soft;
+    }
+
+    ur.h = hard(ua.h, ub.h);
+    if (unlikely(float64_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) && post(ua, ub)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(ua.s, ub.s, s);
+}
+
 /*
  * Returns the result of adding or subtracting the floating-point
  * values `a' and `b'. The operation is performed according to the
@@ -736,8 +902,8 @@ float16  __attribute__((flatten)) float16_add(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_add(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -746,8 +912,8 @@ float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_add(float64 a, float64 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_add(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -766,8 +932,8 @@ float16 __attribute__((flatten)) float16_sub(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_sub(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -776,8 +942,8 @@ float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_sub(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -786,6 +952,64 @@ float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
     return float64_round_pack_canonical(pr, status);
 }
 
+static float hard_f32_add(float a, float b)
+{
+    return a + b;
+}
+
+static float hard_f32_sub(float a, float b)
+{
+    return a - b;
+}
+
+static double hard_f64_add(double a, double b)
+{
+    return a + b;
+}
+
+static double hard_f64_sub(double a, double b)
+{
+    return a - b;
+}
+
+static bool f32_addsub_post(union_float32 a, union_float32 b)
+{
+    return !(float32_is_zero(a.s) && float32_is_zero(b.s));
+}
+
+static bool f64_addsub_post(union_float64 a, union_float64 b)
+{
+    return !(float64_is_zero(a.s) && float64_is_zero(b.s));
+}
+
+float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
+                                             float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_add, soft_f32_add,
+                        f32_is_zon2, f32_addsub_post);
+}
+
+float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
+                                             float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_sub, soft_f32_sub,
+                        f32_is_zon2, f32_addsub_post);
+}
+
+float64 __attribute__((flatten)) float64_add(float64 a, float64 b,
+                                             float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_add, soft_f64_add,
+                        f64_is_zon2, f64_addsub_post);
+}
+
+float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
+                                             float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_sub, soft_f64_sub,
+                        f64_is_zon2, f64_addsub_post);
+}
+
 /*
  * Returns the result of multiplying the floating-point values `a' and
  * `b'. The operation is performed according to the IEC/IEEE Standard
@@ -845,8 +1069,8 @@ float16 __attribute__((flatten)) float16_mul(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_mul(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -855,8 +1079,8 @@ float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
-                                             float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_mul(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -865,6 +1089,40 @@ float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
     return float64_round_pack_canonical(pr, status);
 }
 
+static float hard_f32_mul(float a, float b)
+{
+    return a * b;
+}
+
+static double hard_f64_mul(double a, double b)
+{
+    return a * b;
+}
+
+static bool f32_mul_post(union_float32 a, union_float32 b)
+{
+    return !(float32_is_zero(a.s) || float32_is_zero(b.s));
+}
+
+static bool f64_mul_post(union_float64 a, union_float64 b)
+{
+    return !(float64_is_zero(a.s) || float64_is_zero(b.s));
+}
+
+float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
+                                             float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_mul, soft_f32_mul,
+                        f32_is_zon2, f32_mul_post);
+}
+
+float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
+                                             float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_mul, soft_f64_mul,
+                        f64_is_zon2, f64_mul_post);
+}
+
 /*
  * Returns the result of multiplying the floating-point values `a' and
  * `b' then adding 'c', with no intermediate rounding step after the
@@ -1079,8 +1337,9 @@ float16 __attribute__((flatten)) float16_muladd(float16 a, float16 b, float16 c,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
-                                                int flags, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_muladd(float32 a, float32 b, float32 c, int flags,
+                float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -1090,8 +1349,9 @@ float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
-                                                int flags, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_muladd(float64 a, float64 b, float64 c, int flags,
+                float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -1101,6 +1361,131 @@ float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
     return float64_round_pack_canonical(pr, status);
 }
 
+/*
+ * If a or b is zero, the product is an exact zero and the result is the
+ * sum of that zero and c, so there is no need to check for tininess.
+ * Halving the result is left to softfloat.
+ */
+float32 __attribute__((flatten)) float32_muladd(float32 xa, float32 xb,
+                                                float32 xc, int flags,
+                                                float_status *s)
+{
+    union_float32 ua, ub, uc, ur;
+
+    ua.s = xa;
+    ub.s = xb;
+    uc.s = xc;
+
+    if (unlikely(!can_use_fpu(s) || (flags & float_muladd_halve_result))) {
+        goto soft;
+    }
+
+    ua.s = float32_squash_input_denormal(ua.s, s);
+    ub.s = float32_squash_input_denormal(ub.s, s);
+    uc.s = float32_squash_input_denormal(uc.s, s);
+    if (unlikely(!f32_is_zon3(ua, ub, uc))) {
+        goto soft;
+    }
+
+    if (float32_is_zero(ua.s) || float32_is_zero(ub.s)) {
+        union_float32 up;
+        bool prod_sign;
+
+        prod_sign = float32_is_neg(ua.s) ^ float32_is_neg(ub.s);
+        prod_sign ^= !!(flags & float_muladd_negate_product);
+        up.s = float32_set_sign(float32_zero, prod_sign);
+
+        if (flags & float_muladd_negate_c) {
+            uc.h = -uc.h;
+        }
+        ur.h = up.h + uc.h;
+    } else {
+        float ha = ua.h, hc = uc.h;
+
+        if (flags & float_muladd_negate_product) {
+            ha = -ha;
+        }
+        if (flags & float_muladd_negate_c) {
+            hc = -hc;
+        }
+
+        ur.h = fmaf(ha, ub.h, hc);
+
+        if (unlikely(float32_is_infinity(ur.s))) {
+            s->float_exception_flags |= float_flag_overflow;
+        } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+            goto soft;
+        }
+    }
+    if (flags & float_muladd_negate_result) {
+        return float32_chs(ur.s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_muladd(ua.s, ub.s, uc.s, flags, s);
+}
+
+float64 __attribute__((flatten)) float64_muladd(float64 xa, float64 xb,
+                                                float64 xc, int flags,
+                                                float_status *s)
+{
+    union_float64 ua, ub, uc, ur;
+
+    ua.s = xa;
+    ub.s = xb;
+    uc.s = xc;
+
+    if (unlikely(!can_use_fpu(s) || (flags & float_muladd_halve_result))) {
+        goto soft;
+    }
+
+    ua.s = float64_squash_input_denormal(ua.s, s);
+    ub.s = float64_squash_input_denormal(ub.s, s);
+    uc.s = float64_squash_input_denormal(uc.s, s);
+    if (unlikely(!f64_is_zon3(ua, ub, uc))) {
+        goto soft;
+    }
+
+    if (float64_is_zero(ua.s) || float64_is_zero(ub.s)) {
+        union_float64 up;
+        bool prod_sign;
+
+        prod_sign = float64_is_neg(ua.s) ^ float64_is_neg(ub.s);
+        prod_sign ^= !!(flags & float_muladd_negate_product);
+        up.s = float64_set_sign(float64_zero, prod_sign);
+
+        if (flags & float_muladd_negate_c) {
+            uc.h = -uc.h;
+        }
+        ur.h = up.h + uc.h;
+    } else {
+        double ha = ua.h, hc = uc.h;
+
+        if (flags & float_muladd_negate_product) {
+            ha = -ha;
+        }
+        if (flags & float_muladd_negate_c) {
+            hc = -hc;
+        }
+
+        ur.h = fma(ha, ub.h, hc);
+
+        if (unlikely(float64_is_infinity(ur.s))) {
+            s->float_exception_flags |= float_flag_overflow;
+        } else if (unlikely(fabs(ur.h) <= DBL_MIN)) {
+            goto soft;
+        }
+    }
+    if (flags & float_muladd_negate_result) {
+        return float64_chs(ur.s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f64_muladd(ua.s, ub.s, uc.s, flags, s);
+}
+
 /*
  * Returns the result of dividing the floating-point value `a' by the
  * corresponding value `b'. The operation is performed according to
@@ -1114,17 +1499,19 @@ static FloatParts div_floats(FloatParts a, FloatParts b, float_status *s)
     if (a.cls == float_class_normal && b.cls == float_class_normal) {
         uint64_t temp_lo, temp_hi;
         int exp = a.exp - b.exp;
+        /* div128To64 needs the msb of the divisor to be set, so shift both
+         * the dividend and the divisor left by one more bit */
         if (a.frac < b.frac) {
             exp -= 1;
-            shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT + 1,
-                              &temp_hi, &temp_lo);
+            temp_hi = a.frac;
+            temp_lo = 0;
         } else {
-            shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT,
+            shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT + 1,
                               &temp_hi, &temp_lo);
         }
         /* LSB of quot is set if inexact which roundandpack will use
          * to set flags. Yet again we re-use a for the result */
-        a.frac = div128To64(temp_lo, temp_hi, b.frac);
+        a.frac = div128To64(temp_lo, temp_hi, b.frac << 1);
         a.sign = sign;
         a.exp = exp;
         return a;
@@ -1170,7 +1557,8 @@ float16 float16_div(float16 a, float16 b, float_status *status)
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_div(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -1179,7 +1567,8 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_div(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -1188,6 +1577,49 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     return float64_round_pack_canonical(pr, status);
 }
 
+static float hard_f32_div(float a, float b)
+{
+    return a / b;
+}
+
+static double hard_f64_div(double a, double b)
+{
+    return a / b;
+}
+
+/* Division by zero is left to softfloat, which raises divbyzero */
+static bool f32_div_pre(union_float32 a, union_float32 b)
+{
+    return f32_is_zon(a) && float32_is_normal(b.s);
+}
+
+static bool f64_div_pre(union_float64 a, union_float64 b)
+{
+    return f64_is_zon(a) && float64_is_normal(b.s);
+}
+
+static bool f32_div_post(union_float32 a, union_float32 b)
+{
+    return !float32_is_zero(a.s);
+}
+
+static bool f64_div_post(union_float64 a, union_float64 b)
+{
+    return !float64_is_zero(a.s);
+}
+
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_div, soft_f32_div,
+                        f32_div_pre, f32_div_post);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_div, soft_f64_div,
+                        f64_div_pre, f64_div_post);
+}
+
 /*
  * Float to Float conversions
  *
@@ -2078,20 +2510,63 @@ float16 __attribute__((flatten)) float16_sqrt(float16 a, float_status *status)
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_sqrt(float32 a, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float32
+soft_f32_sqrt(float32 a, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pr = sqrt_float(pa, status, &float32_params);
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_sqrt(float64 a, float_status *status)
+static QEMU_SOFTFLOAT_ATTR float64
+soft_f64_sqrt(float64 a, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pr = sqrt_float(pa, status, &float64_params);
     return float64_round_pack_canonical(pr, status);
 }
 
+/* The square root of a positive normal number is always normal */
+float32 __attribute__((flatten)) float32_sqrt(float32 xa, float_status *s)
+{
+    union_float32 ua, ur;
+
+    ua.s = xa;
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+
+    ua.s = float32_squash_input_denormal(ua.s, s);
+    if (unlikely(!f32_is_zon(ua) || float32_is_neg(ua.s))) {
+        goto soft;
+    }
+    ur.h = sqrtf(ua.h);
+    return ur.s;
+
+ soft:
+    return soft_f32_sqrt(ua.s, s);
+}
+
+float64 __attribute__((flatten)) float64_sqrt(float64 xa, float_status *s)
+{
+    union_float64 ua, ur;
+
+    ua.s = xa;
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+
+    ua.s = float64_squash_input_denormal(ua.s, s);
+    if (unlikely(!f64_is_zon(ua) || float64_is_neg(ua.s))) {
+        goto soft;
+    }
+    ur.h = sqrt(ua.h);
+    return ur.s;
+
+ soft:
+    return soft_f64_sqrt(ua.s, s);
+}
+
 /*----------------------------------------------------------------------------
 | The pattern for a default generated NaN.
 *----------------------------------------------------------------------------*/
@@ -297,6 +297,23 @@ STEXI
 @item info opcount
 @findex info opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+#if defined(CONFIG_TCG)
+    {
+        .name       = "tb-profile",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show the most executed translated code",
+        .cmd        = hmp_info_tb_profile,
+    },
+#endif
+
+STEXI
+@item info tb-profile [@var{max}]
+@findex info tb-profile
+Show the @var{max} (default 20) most executed translated blocks, and
+instructions if they are counted.  This requires @option{-accel tcg,profile=...}.
 ETEXI
 
     {
@@ -1552,6 +1552,8 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        /* NCQ lets the guest issue many small commands at once */
+        ad->port.merge_requests = true;
         ide_register_restart_cb(&ad->port);
     }
     g_free(irqs);
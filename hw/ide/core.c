@@ -2506,6 +2506,7 @@ int ide_init_drive(IDEState *s, BlockBackend *blk, IDEDriveKind kind,
         }
         blk_set_dev_ops(blk, &ide_hd_block_ops, s);
     }
+    blk_set_request_merging(blk, s->bus->merge_requests);
     if (serial) {
         pstrcpy(s->drive_serial_str, sizeof(s->drive_serial_str), serial);
     } else {
@@ -116,6 +116,9 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
+uint64_t block_latency_histogram_percentile(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            double percentile);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
 #endif
@@ -24,6 +24,7 @@
 #endif
 
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
 #include "qemu/queue.h"
 #ifdef CONFIG_TCG
 #include "tcg-target.h"
@@ -66,6 +67,31 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/*
+ * The size of the TLB of each MMU mode changes at run time, between
+ * 2^CPU_TLB_DYN_MIN_BITS and 2^CPU_TLB_DYN_MAX_BITS entries; see
+ * tlb_mmu_resize_locked() in accel/tcg/cputlb.c.  The backend loads the
+ * table pointer and the index mask from env instead of using constants.
+ */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+
+# if HOST_LONG_BITS == 32
+/* Make sure we do not require a double-word shift for the TLB load */
+#  define CPU_TLB_DYN_MAX_BITS (32 - TARGET_PAGE_BITS)
+# else
+/*
+ * With 4 KiB pages, 2^22 entries cover 16 GiB, which is in the same
+ * ballpark as the second level TLB of current x86 hosts.  There is no
+ * point in sizing the TLB past the guest's address space, either.
+ */
+#  define CPU_TLB_DYN_MAX_BITS \
+    MIN(22, TARGET_VIRT_ADDR_SPACE_BITS - TARGET_PAGE_BITS)
+# endif
+
+#else /* !TCG_TARGET_IMPLEMENTS_DYN_TLB */
+
 /* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_BITS to ensure that
  * the TLB is not unnecessarily small, but still small enough for the
  * TLB lookup instruction sequence used by the TCG target.
@@ -98,6 +124,8 @@ typedef uint64_t target_ulong;
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
+
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
        bit TARGET_PAGE_BITS-1..4  : Nonzero for accesses that should not
@@ -140,11 +168,46 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+typedef struct CPUTLBDesc {
+    /*
+     * The TLB is resized when it is flushed, based on the largest number
+     * of entries in use at a flush since the window began.
+     */
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+/* Number of address spaces besides the current one whose TLB is kept */
+#define CPU_TLB_NB_TAG_BANKS 8
+
+typedef struct CPUTLBBank CPUTLBBank;
+
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
+    /* tlb_mask[i] contains (n_entries - 1) << CPU_TLB_ENTRY_BITS */    \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+    /* Address space the tables above belong to, see tlb_switch_tag() */ \
+    uint32_t tlb_tag;                                                   \
+    CPUTLBBank *tlb_banks;
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+#endif
+
 #define CPU_COMMON_TLB \
+    /*                                                                  \
+     * tlb_lock serializes TLB flushes with tlb_reset_dirty(), which    \
+     * is called on behalf of other vCPUs.                              \
+     */                                                                 \
+    QemuSpin tlb_lock;                                                  \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     size_t tlb_flush_count;                                             \
     target_ulong tlb_flush_addr;                                        \
@@ -99,6 +99,40 @@ void cpu_address_space_init(CPUState *cpu, int asidx,
 
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_TCG)
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB of the specified CPU.  Must be called before the
+ * first TLB flush.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
+/**
+ * tlb_switch_tag:
+ * @cpu: CPU whose TLB should be switched
+ * @tag: tag of the new address space, e.g. an x86 PCID
+ *
+ * Make @tag the current address space of the TLB.  The entries of the
+ * previous address space are kept aside, and become visible again when
+ * its tag is switched back, unless they have been flushed or evicted in
+ * the meantime.  Page flushes apply to all address spaces; full flushes
+ * drop them all.
+ */
+void tlb_switch_tag(CPUState *cpu, uint32_t tag);
+/**
+ * tlb_flush_tag:
+ * @cpu: CPU whose TLB should be flushed
+ * @tag: tag of the address space to flush
+ *
+ * Flush the TLB entries of the address space @tag, which does not
+ * have to be the current one.
+ */
+void tlb_flush_tag(CPUState *cpu, uint32_t tag);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -257,7 +291,29 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   int mmu_idx, target_ulong size);
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr);
+/**
+ * tcg_flush_coalesced_mmio_buffer:
+ *
+ * Perform the writes to coalesced MMIO ranges that were queued by TCG.
+ * Called by qemu_flush_coalesced_mmio_buffer() with the iothread lock held.
+ */
+void tcg_flush_coalesced_mmio_buffer(void);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+static inline void tlb_destroy(CPUState *cpu)
+{
+}
+static inline void tlb_switch_tag(CPUState *cpu, uint32_t tag)
+{
+}
+static inline void tlb_flush_tag(CPUState *cpu, uint32_t tag)
+{
+}
+static inline void tcg_flush_coalesced_mmio_buffer(void)
+{
+}
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
@@ -490,6 +546,8 @@ static inline void mmap_unlock(void) {}
 
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
+/* Returns true if the code at @addr is RAM already mapped by the TLB */
+bool tlb_probe_code(CPUArchState *env1, target_ulong addr);
 
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr);
@@ -509,6 +567,18 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        target_ulong *address);
 bool memory_region_is_unassigned(MemoryRegion *mr);
 
+/* tb-speculate.c */
+void tb_speculate_enable(bool enable);
+/* Queues @pc to be translated the next time @cpu is idle */
+void tb_speculate_queue(CPUState *cpu, target_ulong pc,
+                        target_ulong cs_base, uint32_t flags);
+/*
+ * Translates one queued TB for @cpu, without the iothread lock.  Returns
+ * false when there is nothing left to translate.
+ */
+bool tb_speculate(CPUState *cpu);
+void tb_speculate_cleanup(CPUState *cpu);
+
 #endif
 
 /* vl.c */
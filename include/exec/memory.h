@@ -32,6 +32,9 @@
 #define MAX_PHYS_ADDR_SPACE_BITS 62
 #define MAX_PHYS_ADDR            (((hwaddr)1 << MAX_PHYS_ADDR_SPACE_BITS) - 1)
 
+/* Default limit on the memory used by the bounce buffers of an AddressSpace */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (64 * 1024)
+
 #define TYPE_MEMORY_REGION "qemu:memory-region"
 #define MEMORY_REGION(obj) \
         OBJECT_CHECK(MemoryRegion, (obj), TYPE_MEMORY_REGION)
@@ -437,9 +440,20 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(memory_listeners_as, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /* Bounce buffers used by address_space_map() for non-RAM regions,
+     * and the callers waiting for one.  Protected by bounce_lock;
+     * bounce_buffer_size can also be read atomically without it.
+     */
+    QemuMutex bounce_lock;
+    size_t bounce_buffer_size;
+    size_t max_bounce_buffer_size;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
+typedef struct BounceBuffer BounceBuffer;
 typedef struct FlatRange FlatRange;
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
@@ -1379,6 +1393,20 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_is_coalesced: Check if writes to a range can be coalesced.
+ *
+ * Returns %true if the @size bytes at @addr are entirely within a range
+ * added with memory_region_set_coalescing() or
+ * memory_region_add_coalescing().
+ *
+ * @mr: the memory region to be checked.
+ * @addr: the start of the range within the region.
+ * @size: the size of the range.
+ */
+bool memory_region_is_coalesced(MemoryRegion *mr, hwaddr addr,
+                                unsigned size);
+
 /**
  * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
  *                                    accesses.
@@ -1987,8 +2015,12 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len,
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Regions that are not RAM are accessed through bounce buffers.  Several of
+ * them can be in use at the same time, up to the limit set with
+ * address_space_set_max_bounce_buffer_size().
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2013,6 +2045,35 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: schedule @bh when a bounce buffer of
+ * @as is released
+ *
+ * The bottom half runs once, and may run immediately if the address space
+ * already has free bounce buffer memory.
+ *
+ * @as: #AddressSpace whose address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel
+ * address_space_register_map_client()
+ *
+ * @as: #AddressSpace used
+ * @bh: bottom half that was registered
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_set_max_bounce_buffer_size: limit the memory used by the
+ * bounce buffers of @as
+ *
+ * Buffers that are already mapped are not affected.
+ *
+ * @as: #AddressSpace to configure
+ * @size: maximum number of bytes, at least one page is recommended
+ */
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
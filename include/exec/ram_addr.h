@@ -22,6 +22,7 @@
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
 #include "exec/ramlist.h"
+#include "qemu/cutils.h"
 
 struct RAMBlock {
     struct rcu_head rcu;
@@ -41,6 +42,10 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /* one bit per word of bmap; a clear bit means that the word is
+     * zero, so that clean areas can be skipped quickly
+     */
+    unsigned long *bmap_summary;
     /* bitmap of pages that haven't been sent even once
      * only maintained and used in postcopy at the moment
      * where it's used to send the dirtymap at the start
@@ -49,6 +54,12 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* bitmap of pages present in the migration file with mapped-ram,
+     * and where the bitmap and the pages are stored in the file
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -382,6 +393,9 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/* Words of the dirty bitmap that are checked together for being clean */
+#define DIRTY_SYNC_CHUNK_WORDS 64
+
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t start,
@@ -397,31 +411,47 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
          (start + rb->offset) &&
         !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
+        int k, n;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
         unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
                                         DIRTY_MEMORY_BLOCK_SIZE);
         unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+        unsigned long *chunk;
 
         rcu_read_lock();
 
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                *real_dirty_pages += ctpopl(bits);
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
+        for (k = page; k < page + nr; k += n) {
+            /* Skip clean chunks without touching them word by word; a
+             * chunk never crosses the end of a dirty memory block.
+             */
+            n = MIN(page + nr - k, DIRTY_SYNC_CHUNK_WORDS);
+            n = MIN(n, BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE) - offset);
+            chunk = &src[idx][offset];
+
+            if (!buffer_is_zero(chunk, n * sizeof(unsigned long))) {
+                int i;
+
+                for (i = 0; i < n; i++) {
+                    if (chunk[i]) {
+                        unsigned long bits = atomic_xchg(&chunk[i], 0);
+                        unsigned long new_dirty;
+                        *real_dirty_pages += ctpopl(bits);
+                        new_dirty = ~dest[k + i];
+                        dest[k + i] |= bits;
+                        new_dirty &= bits;
+                        num_dirty += ctpopl(new_dirty);
+                        set_bit(k + i, rb->bmap_summary);
+                    }
+                }
             }
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset += n;
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
@@ -441,6 +471,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                set_bit(BIT_WORD(k), rb->bmap_summary);
             }
         }
     }
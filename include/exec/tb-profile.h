@@ -0,0 +1,51 @@
+/*
+ * Execution counters for translated guest code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_TB_PROFILE_H
+#define EXEC_TB_PROFILE_H
+
+#include "qemu/fprintf-fn.h"
+
+/*
+ * When enabled, the translator emits inline increments of counters that
+ * are kept per guest PC, so that the hot guest code can be found without
+ * logging every executed TB.  The counters are plain memory increments;
+ * with MTTCG, concurrent updates from several vCPUs may be lost.
+ */
+typedef enum TBProfileLevel {
+    TB_PROFILE_OFF,
+    TB_PROFILE_TB,      /* count TB executions */
+    TB_PROFILE_INSN,    /* ... and instruction executions */
+    TB_PROFILE_MEM,     /* ... and guest memory accesses per instruction */
+} TBProfileLevel;
+
+typedef struct TBProfileEntry {
+    uint64_t pc;
+    uint64_t count;             /* executions */
+    uint64_t mem_accesses;      /* only for instructions */
+    unsigned icount;            /* only for TBs, size of the last one */
+} TBProfileEntry;
+
+extern TBProfileLevel tb_profile_level;
+
+/*
+ * Enables the counters at @level ("off", "tb", "insn" or "mem").  If
+ * @file is not NULL, the hottest TBs are written to it when QEMU exits.
+ */
+void tb_profile_enable(const char *level, const char *file, Error **errp);
+
+/* Returns the counters of the TB or instruction at @pc, creating them */
+TBProfileEntry *tb_profile_get_tb(uint64_t pc);
+TBProfileEntry *tb_profile_get_insn(uint64_t pc);
+
+/*
+ * Prints the @max hottest TBs, by number of executed instructions, and
+ * the hottest instructions if they are counted.
+ */
+void tb_profile_dump(FILE *f, fprintf_function cpu_fprintf, int max);
+
+#endif
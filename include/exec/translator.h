@@ -60,6 +60,9 @@ typedef enum DisasJumpType {
  * @num_insns: Number of translated instructions (including current).
  * @max_insns: Maximum number of instructions to be translated in this TB.
  * @singlestep_enabled: "Hardware" single stepping enabled.
+ * @goto_tb_pc: Targets of the direct jumps out of this TB.
+ * @goto_tb_flags: TB flags that the targets are entered with.
+ * @goto_tb_mask: Which entries of @goto_tb_pc are valid.
  *
  * Architecture-agnostic disassembly context.
  */
@@ -71,6 +74,9 @@ typedef struct DisasContextBase {
     int num_insns;
     int max_insns;
     bool singlestep_enabled;
+    target_ulong goto_tb_pc[2];
+    uint32_t goto_tb_flags[2];
+    unsigned goto_tb_mask;
 } DisasContextBase;
 
 /**
@@ -141,4 +147,24 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
 void translator_loop_temp_check(DisasContextBase *db);
 
+/**
+ * translator_note_goto_tb:
+ * @db: Disassembly context
+ * @n: Jump slot, as passed to tcg_gen_goto_tb()
+ * @pc: Guest PC of the jump target
+ * @flags: TB flags of the jump target
+ *
+ * Tells the translator loop that the TB ends with a direct jump to @pc,
+ * so that the target can be translated before it is first executed.
+ * Targets only need to call this for jumps that stay within the cs_base
+ * of the current TB.
+ */
+static inline void translator_note_goto_tb(DisasContextBase *db, int n,
+                                           target_ulong pc, uint32_t flags)
+{
+    db->goto_tb_pc[n] = pc;
+    db->goto_tb_flags[n] = flags;
+    db->goto_tb_mask |= 1 << n;
+}
+
 #endif  /* EXEC__TRANSLATOR_H */
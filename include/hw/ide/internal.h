@@ -472,6 +472,8 @@ struct IDEBus {
     int bus_id;
     int max_units;
     IDEDMA *dma;
+    /* Merge adjacent requests of the drives, see blk_set_request_merging() */
+    bool merge_requests;
     uint8_t unit;
     uint8_t cmd;
     qemu_irq irq;
@@ -291,6 +291,7 @@ struct PCIDevice {
     char name[64];
     PCIIORegion io_regions[PCI_NUM_REGIONS];
     AddressSpace bus_master_as;
+    uint64_t max_bounce_buffer_size;
     MemoryRegion bus_master_container_region;
     MemoryRegion bus_master_enable_region;
 
@@ -66,7 +66,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* order of arming, breaks expire_time ties */
+    int heap_index;             /* position in the timer list's heap */
     int scale;
 };
 
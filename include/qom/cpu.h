@@ -367,6 +367,8 @@ struct CPUState {
 
     /* Accessed in parallel; all accesses must be atomic */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* Only accessed by the vCPU thread, see tb_speculate() */
+    struct TBSpeculateQueue *tb_speculate_queue;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -2193,6 +2193,20 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
     }
 }
 
+bool memory_region_is_coalesced(MemoryRegion *mr, hwaddr addr,
+                                unsigned size)
+{
+    CoalescedMemoryRange *cmr;
+
+    QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
+        if (addrrange_contains(cmr->addr, int128_make64(addr)) &&
+            addrrange_contains(cmr->addr, int128_make64(addr + size - 1))) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void memory_region_set_flush_coalesced(MemoryRegion *mr)
 {
     mr->flush_coalesced_mmio = true;
@@ -2798,6 +2812,11 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
+    qemu_mutex_init(&as->bounce_lock);
+    as->bounce_buffer_size = 0;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
 }
@@ -2805,8 +2824,11 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
 
     flatview_unref(as->current_map);
+    qemu_mutex_destroy(&as->bounce_lock);
     g_free(as->name);
     g_free(as->ioeventfds);
     memory_region_unref(as->root);
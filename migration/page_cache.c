@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -31,11 +31,19 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Number of pages a given address can be cached in.  Pages that map to
+ * the same set do not evict each other until all ways are in use, and
+ * then the least recently used page of the set is replaced.
+ */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
@@ -44,24 +52,67 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
+    /* bumped on every hit or insertion, orders pages in a set */
+    uint64_t lru_clock;
 };
 
-PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+static CacheItem *cache_alloc_items(size_t num_pages, Error **errp)
 {
-    int64_t i;
-    size_t num_pages = new_size / page_size;
-    PageCache *cache;
+    CacheItem *items;
+    size_t i;
 
+    /* We prefer not to abort if there is no memory */
+    items = g_try_malloc(num_pages * sizeof(*items));
+    if (!items) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                   "Failed to allocate page cache");
+        return NULL;
+    }
+
+    for (i = 0; i < num_pages; i++) {
+        items[i].it_data = NULL;
+        items[i].it_age = 0;
+        items[i].it_lru = 0;
+        items[i].it_addr = -1;
+    }
+    return items;
+}
+
+static bool cache_check_size(int64_t new_size, size_t page_size,
+                             Error **errp)
+{
     if (new_size < page_size) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "is smaller than one target page size");
-        return NULL;
+        return false;
     }
 
     /* round down to the nearest power of 2 */
-    if (!is_power_of_2(num_pages)) {
+    if (!is_power_of_2(new_size / page_size)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "is not a power of two number of pages");
+        return false;
+    }
+    return true;
+}
+
+static void cache_set_geometry(PageCache *cache, size_t num_pages)
+{
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+
+    DPRINTF("Setting cache to %zu sets of %zu pages\n",
+            cache->num_sets, cache->num_ways);
+}
+
+PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+{
+    PageCache *cache;
+
+    if (!cache_check_size(new_size, page_size, errp)) {
         return NULL;
     }
 
@@ -74,26 +125,15 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_num_items = num_pages;
-
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    cache->lru_clock = 0;
+    cache_set_geometry(cache, new_size / page_size);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
+    cache->page_cache = cache_alloc_items(cache->max_num_items, errp);
     if (!cache->page_cache) {
-        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
-                   "Failed to allocate page cache");
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
@@ -113,40 +153,78 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache->num_sets);
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    size_t way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_data && set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
 
-    return &cache->page_cache[pos];
+/*
+ * Pick the slot for a page that is not in the cache: a free way if the
+ * set has one, otherwise the least recently used page that has not been
+ * touched in the last CACHED_PAGE_LIFETIME cycles.  Returns NULL if all
+ * pages in the set are still fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set, *victim = NULL;
+    size_t way;
+
+    set = cache_get_set(cache, addr);
+    for (way = 0; way < cache->num_ways; way++) {
+        CacheItem *it = &set[way];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        if (!victim || it->it_lru < victim->it_lru) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
@@ -155,17 +233,21 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
+    int ret = 0;
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            /* all the pages of the set are fresh, don't replace them */
+            return -1;
+        }
+        if (it->it_data) {
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -179,7 +261,63 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
+    return ret;
+}
+
+static int cache_item_cmp_lru(const void *a, const void *b)
+{
+    const CacheItem *ia = a, *ib = b;
+
+    /* most recently used first */
+    return ia->it_lru < ib->it_lru ? 1 : ia->it_lru > ib->it_lru ? -1 : 0;
+}
+
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp)
+{
+    CacheItem *old_items, *set;
+    size_t old_num_items, num_pages, i, way;
+
+    if (!cache_check_size(new_size, cache->page_size, errp)) {
+        return -1;
+    }
+
+    num_pages = new_size / cache->page_size;
+    if (num_pages == cache->max_num_items) {
+        return 0;
+    }
+
+    old_items = cache->page_cache;
+    old_num_items = cache->max_num_items;
+    cache->page_cache = cache_alloc_items(num_pages, errp);
+    if (!cache->page_cache) {
+        cache->page_cache = old_items;
+        return -1;
+    }
+    cache_set_geometry(cache, num_pages);
+
+    /*
+     * Move the pages over most recently used first, so that when
+     * shrinking the cache the hottest pages of each set are kept.
+     */
+    qsort(old_items, old_num_items, sizeof(*old_items), cache_item_cmp_lru);
+    cache->num_items = 0;
+    for (i = 0; i < old_num_items && old_items[i].it_data; i++) {
+        set = cache_get_set(cache, old_items[i].it_addr);
+        for (way = 0; way < cache->num_ways && set[way].it_data; way++) {
+            continue;
+        }
+        if (way < cache->num_ways) {
+            set[way] = old_items[i];
+            cache->num_items++;
+        } else {
+            g_free(old_items[i].it_data);
+        }
+    }
+    /* the unused entries are sorted last and have no data */
+    g_free(old_items);
+
     return 0;
 }
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -36,7 +36,21 @@ PageCache *cache_init(int64_t cache_size, size_t page_size, Error **errp);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_resize: change the size of the page cache, keeping the pages
+ * that fit in the new size; when shrinking, the most recently used
+ * pages are kept.
+ *
+ * Returns 0 on success, -1 on error; the cache is unchanged on error
+ *
+ * @cache pointer to the PageCache struct
+ * @new_size: new cache size in bytes
+ * @errp: set *errp if the check failed, with reason
+ */
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp);
+
+/**
+ * cache_is_cached: Checks to see if the page is cached, and marks it
+ * as recently used if it is
  *
  * Returns %true if page is cached
  *
@@ -44,8 +58,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -59,9 +72,12 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the set the page maps to is full, its least recently used page is
+ * evicted, unless all of them were used in the last two generations.
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -27,6 +27,7 @@
 #include "exec/cpu-common.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 
 
@@ -137,6 +138,77 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static QIOChannelFile *channel_get_file(void *opaque)
+{
+    return (QIOChannelFile *)object_dynamic_cast(OBJECT(opaque),
+                                                 TYPE_QIO_CHANNEL_FILE);
+}
+
+static int channel_get_fd(void *opaque)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque);
+
+    return fioc ? fioc->fd : -1;
+}
+
+static int64_t channel_seek(void *opaque, int64_t offset, int whence)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque);
+    off_t ret;
+
+    if (!fioc) {
+        return -ESPIPE;
+    }
+    ret = lseek(fioc->fd, offset, whence);
+    return ret < 0 ? -errno : ret;
+}
+
+#ifndef _WIN32
+static ssize_t channel_pread_buffer(void *opaque, uint8_t *buf,
+                                    size_t size, int64_t pos)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque);
+    ssize_t done = 0, len;
+
+    if (!fioc) {
+        return -ESPIPE;
+    }
+    while (done < size) {
+        len = pread(fioc->fd, buf + done, size - done, pos + done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static ssize_t channel_pwrite_buffer(void *opaque, const uint8_t *buf,
+                                     size_t size, int64_t pos)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque);
+    ssize_t done = 0, len;
+
+    if (!fioc) {
+        return -ESPIPE;
+    }
+    while (done < size) {
+        len = pwrite(fioc->fd, buf + done, size - done, pos + done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        done += len;
+    }
+    return done;
+}
+#endif
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -157,6 +229,11 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .get_fd = channel_get_fd,
+    .seek = channel_seek,
+#ifndef _WIN32
+    .pread_buffer = channel_pread_buffer,
+#endif
 };
 
 
@@ -166,6 +243,11 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .get_fd = channel_get_fd,
+    .seek = channel_seek,
+#ifndef _WIN32
+    .pwrite_buffer = channel_pwrite_buffer,
+#endif
 };
 
 
@@ -586,6 +586,102 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+int qemu_get_fd(QEMUFile *f)
+{
+    if (!f->ops->get_fd) {
+        return -1;
+    }
+    return f->ops->get_fd(f->opaque);
+}
+
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    if (!f->ops->seek) {
+        return false;
+    }
+    if (qemu_file_is_writable(f) ? !f->ops->pwrite_buffer
+                                 : !f->ops->pread_buffer) {
+        return false;
+    }
+    return f->ops->seek(f->opaque, 0, SEEK_CUR) >= 0;
+}
+
+/*
+ * Return the offset in the file of the next byte to be read or
+ * written by the stream functions.
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (ret >= 0 && !qemu_file_is_writable(f)) {
+        /* Data that was read ahead has not been consumed yet */
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
+}
+
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    ret = f->ops->pwrite_buffer(f->opaque, buf, size, pos);
+    if (ret != size) {
+        qemu_file_set_error(f, ret < 0 ? ret : -EIO);
+        return;
+    }
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t pos)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return 0;
+    }
+
+    ret = f->ops->pread_buffer(f->opaque, buf, size, pos);
+    if (ret != size) {
+        qemu_file_set_error(f, ret < 0 ? ret : -EIO);
+        return 0;
+    }
+    return size;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -99,6 +99,23 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Move the stream position of a seekable transport, as lseek() does.
+ * Returns the new offset from the start of the file, or a negative
+ * errno value if the transport cannot seek.
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
+/*
+ * Read or write a buffer at offset 'pos' of a seekable transport,
+ * independent of the stream position.  The handler must transfer all
+ * of the data or return a negative errno value.
+ */
+typedef ssize_t (QEMUFilePReadBufferFunc)(void *opaque, uint8_t *buf,
+                                          size_t size, int64_t pos);
+typedef ssize_t (QEMUFilePWriteBufferFunc)(void *opaque, const uint8_t *buf,
+                                           size_t size, int64_t pos);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +123,10 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileGetFD *get_fd;
+    QEMUFileSeekFunc *seek;
+    QEMUFilePReadBufferFunc *pread_buffer;
+    QEMUFilePWriteBufferFunc *pwrite_buffer;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -130,6 +151,21 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
 
+/*
+ * Positioned I/O, only available if the transport is a regular file.
+ * Offsets are absolute positions in the file.  qemu_file_set_offset()
+ * flushes or discards the stream buffer, so that the stream carries on
+ * at the given offset.  Data written with qemu_put_buffer_at() counts
+ * towards qemu_ftell() and the rate limit, like stream data.
+ */
+bool qemu_file_is_seekable(QEMUFile *f);
+int64_t qemu_file_get_offset(QEMUFile *f);
+int qemu_file_set_offset(QEMUFile *f, int64_t offset);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t pos);
+
 #include "migration/qemu-file-types.h"
 
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
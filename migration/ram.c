@@ -30,6 +30,7 @@
 #include "cpu.h"
 #include <zlib.h>
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -76,6 +77,20 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * With mapped-ram, the RAM_SAVE_FLAG_MEM_SIZE record of each block is
+ * followed by a header: version (be32), target page size, offset of
+ * the bitmap of saved pages and offset of the pages (be64 each).  The
+ * bitmap and the pages are stored at those offsets of the file, and
+ * the stream continues after the pages.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE    (4 + 3 * 8)
+/* So that the pages can be mapped, even with huge pages */
+#define MAPPED_RAM_FILE_ALIGN  (1 * MiB)
+/* Largest run of contiguous pages written with a single system call */
+#define MAPPED_RAM_MAX_WRITE   (1 * MiB)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -117,7 +132,9 @@ static void XBZRLE_cache_unlock(void)
  * This function is called from qmp_migrate_set_cache_size in main
  * thread, possibly while a migration is in progress.  A running
  * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * hence changes to the cache are protected by XBZRLE.lock().  The
+ * cached pages are kept, so that resizing does not cause a burst of
+ * full page sends.
  *
  * Returns 0 for success or -1 for error
  *
@@ -126,7 +143,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -144,16 +160,9 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
-        if (!new_cache) {
-            ret = -1;
-            goto out;
-        }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        ret = cache_resize(XBZRLE.cache, new_size, errp);
     }
-out:
+
     XBZRLE_cache_unlock();
     return ret;
 }
@@ -313,6 +322,10 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /* mapped-ram: contiguous pages not written to the file yet */
+    RAMBlock *mapped_ram_block;
+    ram_addr_t mapped_ram_start;
+    ram_addr_t mapped_ram_len;
 };
 typedef struct RAMState RAMState;
 
@@ -1420,8 +1433,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) > 0) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1444,17 +1459,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret > 0) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -1462,6 +1481,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -1505,6 +1525,46 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     return 1;
 }
 
+/**
+ * migration_bitmap_find_next: find_next_bit() on the dirty bitmap
+ *
+ * Words that bmap_summary reports as clean are skipped without being
+ * read; summary bits of words that turn out to be clean are dropped,
+ * so that the next search skips them too.
+ *
+ * Returns the index of the next dirty page, or @size if none
+ *
+ * @rb: RAMBlock where to search for dirty pages
+ * @size: number of pages in @rb
+ * @start: page where we start the search
+ */
+static unsigned long migration_bitmap_find_next(RAMBlock *rb,
+                                                unsigned long size,
+                                                unsigned long start)
+{
+    unsigned long nwords = BITS_TO_LONGS(size);
+    unsigned long word = BIT_WORD(start);
+    unsigned long bits;
+
+    if (start >= size) {
+        return size;
+    }
+
+    bits = rb->bmap[word] & BITMAP_FIRST_WORD_MASK(start);
+    while (!bits) {
+        word = find_next_bit(rb->bmap_summary, nwords, word + 1);
+        if (word >= nwords) {
+            return size;
+        }
+        bits = rb->bmap[word];
+        if (!bits) {
+            clear_bit(word, rb->bmap_summary);
+        }
+    }
+
+    return MIN(word * BITS_PER_LONG + ctzl(bits), size);
+}
+
 /**
  * migration_bitmap_find_dirty: find the next dirty page from start
  *
@@ -1521,7 +1581,6 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
                                           unsigned long start)
 {
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = rb->bmap;
     unsigned long next;
 
     if (!qemu_ram_is_migratable(rb)) {
@@ -1531,7 +1590,7 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     if (rs->ram_bulk_stage && start > 0) {
         next = start + 1;
     } else {
-        next = find_next_bit(bitmap, size, start);
+        next = migration_bitmap_find_next(rb, size, start);
     }
 
     return next;
@@ -1602,7 +1661,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int64_t start_time, end_time;
     uint64_t bytes_xfer_now;
 
     ram_counters.dirty_sync_count++;
@@ -1612,6 +1671,7 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
@@ -1623,7 +1683,10 @@ static void migration_bitmap_sync(RAMState *rs)
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    ram_counters.dirty_sync_time =
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time) / SCALE_US;
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    ram_counters.dirty_sync_time);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1813,6 +1876,111 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64) * 8;
+}
+
+/*
+ * mapped_ram_save_block_header: reserve room in the file for the
+ * bitmap and the pages of @block, and continue the stream after them
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block being described
+ */
+static void mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    int64_t offset = qemu_file_get_offset(f);
+
+    if (offset < 0) {
+        qemu_file_set_error(f, offset);
+        return;
+    }
+
+    block->file_bmap = bitmap_new(bitmap_size * BITS_PER_BYTE);
+    block->bitmap_offset = offset + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static void mapped_ram_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->mapped_ram_block;
+
+    if (!rs->mapped_ram_len) {
+        return;
+    }
+    qemu_put_buffer_at(rs->f, block->host + rs->mapped_ram_start,
+                       rs->mapped_ram_len,
+                       block->pages_offset + rs->mapped_ram_start);
+    rs->mapped_ram_len = 0;
+}
+
+/*
+ * ram_save_mapped_page: write a page at its place in the file
+ *
+ * Pages are not written right away, but gathered into runs of
+ * contiguous pages; mapped_ram_flush() must be called before the
+ * end of the iteration.  Zero pages that were never written are
+ * skipped, as the file reads as zero there.
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (!test_bit(page, block->file_bmap)) {
+        if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            ram_counters.duplicate++;
+            return 1;
+        }
+        set_bit(page, block->file_bmap);
+    }
+
+    if (rs->mapped_ram_block != block ||
+        rs->mapped_ram_start + rs->mapped_ram_len != offset ||
+        rs->mapped_ram_len >= MAPPED_RAM_MAX_WRITE) {
+        mapped_ram_flush(rs);
+        rs->mapped_ram_block = block;
+        rs->mapped_ram_start = offset;
+    }
+    rs->mapped_ram_len += TARGET_PAGE_SIZE;
+
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/* Write the bitmaps once all the pages are in the file */
+static void mapped_ram_save_bitmaps(RAMState *rs)
+{
+    RAMBlock *block;
+    unsigned long *le_bmap;
+    size_t size;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        size = mapped_ram_bitmap_size(block);
+        le_bmap = bitmap_new(size * BITS_PER_BYTE);
+        bitmap_to_le(le_bmap, block->file_bmap, size * BITS_PER_BYTE);
+        qemu_put_buffer_at(rs->f, (uint8_t *)le_bmap, size,
+                           block->bitmap_offset);
+        g_free(le_bmap);
+    }
+}
+
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
@@ -2194,6 +2362,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     /*
      * When starting the process of a new block, the first page of
      * the block should be sent out before other pages in the same
@@ -2420,8 +2592,12 @@ static void ram_save_cleanup(void *opaque)
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->bmap_summary);
+        block->bmap_summary = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2691,6 +2867,7 @@ static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
                  * that weren't previously dirty.
                  */
                 rs->migration_dirty_pages += !test_and_set_bit(page, bitmap);
+                set_bit(BIT_WORD(page), block->bmap_summary);
             }
         }
 
@@ -2929,6 +3106,8 @@ static void ram_list_init_bitmaps(void)
             pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
             bitmap_set(block->bmap, 0, pages);
+            block->bmap_summary = bitmap_new(BITS_TO_LONGS(pages));
+            bitmap_set(block->bmap_summary, 0, BITS_TO_LONGS(pages));
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
@@ -3024,6 +3203,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a seekable migration file, "
+                     "such as file:");
+        return -1;
+    }
+
     if (compress_threads_save_setup()) {
         return -1;
     }
@@ -3048,6 +3233,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_mapped_ram()) {
+            mapped_ram_save_block_header(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -3128,6 +3316,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    mapped_ram_flush(rs);
     flush_compressed_data(rs);
     rcu_read_unlock();
 
@@ -3187,6 +3376,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    mapped_ram_flush(rs);
+    if (migrate_mapped_ram()) {
+        mapped_ram_save_bitmaps(rs);
+    }
     flush_compressed_data(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
@@ -3717,6 +3910,96 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/*
+ * mapped_ram_load_block: restore a RAMBlock from the migration file
+ *
+ * Where possible the pages are mapped from the file, and only read
+ * when the guest first touches them.  Otherwise the pages that were
+ * saved are read right away.
+ *
+ * Returns 0 for success or a negative errno value.
+ *
+ * @f: QEMUFile where to read the data from
+ * @block: block being restored
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    unsigned long *bmap, *le_bmap, start, end;
+    uint32_t version;
+    uint64_t page_size;
+    int ret;
+
+    if (!qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a seekable migration file, "
+                     "such as file:");
+        return -EINVAL;
+    }
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (version != MAPPED_RAM_HDR_VERSION || page_size != TARGET_PAGE_SIZE) {
+        error_report("Unsupported mapped-ram header for RAM block %s "
+                     "(version %" PRIu32 ", page size %" PRIu64 ")",
+                     block->idstr, version, page_size);
+        return -EINVAL;
+    }
+
+#ifndef _WIN32
+    ret = qemu_ram_map_file(block, qemu_get_fd(f), block->pages_offset);
+    if (ret == 0) {
+        trace_mapped_ram_load_block(block->idstr, true);
+        return qemu_file_set_offset(f,
+                                    block->pages_offset + block->used_length);
+    }
+    if (ret != -ENOTSUP) {
+        error_report("Failed to map RAM block %s from the migration file: %s",
+                     block->idstr, strerror(-ret));
+        return ret;
+    }
+#endif
+    trace_mapped_ram_load_block(block->idstr, false);
+
+    bmap = bitmap_new(bitmap_size * BITS_PER_BYTE);
+    le_bmap = bitmap_new(bitmap_size * BITS_PER_BYTE);
+    qemu_get_buffer_at(f, (uint8_t *)le_bmap, bitmap_size,
+                       block->bitmap_offset);
+    bitmap_from_le(bmap, le_bmap, bitmap_size * BITS_PER_BYTE);
+    g_free(le_bmap);
+
+    for (start = 0; start < pages; start = end) {
+        if (test_bit(start, bmap)) {
+            end = find_next_zero_bit(bmap, pages, start);
+            qemu_get_buffer_at(f, block->host + (start << TARGET_PAGE_BITS),
+                               (end - start) << TARGET_PAGE_BITS,
+                               block->pages_offset +
+                               (start << TARGET_PAGE_BITS));
+        } else {
+            /* Not in the file, so the page was zero */
+            end = find_next_bit(bmap, pages, start);
+            for (; start < end; start++) {
+                ram_handle_compressed(block->host +
+                                      (start << TARGET_PAGE_BITS),
+                                      0, TARGET_PAGE_SIZE);
+            }
+        }
+    }
+    g_free(bmap);
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -3834,6 +4117,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4005,6 +4291,7 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *block)
      * dirty bitmap for this ramblock.
      */
     bitmap_complement(block->bmap, block->bmap, nbits);
+    bitmap_set(block->bmap_summary, 0, BITS_TO_LONGS(nbits));
 
     trace_ram_dirty_bitmap_reload_complete(block->idstr);
 
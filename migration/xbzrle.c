@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -23,18 +24,18 @@
   nzrun = length byte...
 
   length = uleb128 encoded integer
+
+  Both kinds of run are maximal, so the encoding of a page is unique and
+  all the implementations below must produce exactly the same bytes.
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +127,417 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vectorized encoders split the page into runs with the loop below;
+ * they only differ in how they find the end of a run.  find_diff returns
+ * the first offset at or after i where the buffers differ, find_same the
+ * first one where they are equal, or slen if there is none.  Overflow
+ * is checked at the same points as in xbzrle_encode_buffer_int, so that
+ * the result is the same even when dst is too small.
+ */
+typedef int XbzrleFindFn(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static inline __attribute__((__always_inline__)) int
+xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen,
+                   XbzrleFindFn *find_diff, XbzrleFindFn *find_same)
+{
+    int d = 0, i = 0, j;
+    uint32_t nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find_diff(old_buf, new_buf, i, slen);
+
+        /* buffer unchanged */
+        if (j - i == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (j == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, j - i);
+        i = j;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = j;
+    }
+
+    return d;
+}
+
+static inline int find_diff_tail(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int find_same_tail(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static inline uint32_t cmpeq_sse2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i)
+{
+    return _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(old_buf + i)),
+                       _mm_loadu_si128((const __m128i *)(new_buf + i))));
+}
+
+static inline int find_diff_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t m;
+
+    for (; i + 16 <= slen; i += 16) {
+        m = cmpeq_sse2(old_buf, new_buf, i) ^ 0xFFFF;
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t m;
+
+    for (; i + 16 <= slen; i += 16) {
+        m = cmpeq_sse2(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_sse2, find_same_sse2);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t cmpeq_avx2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i)
+{
+    return _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(old_buf + i)),
+                          _mm256_loadu_si256((const __m256i *)(new_buf + i))));
+}
+
+static inline int find_diff_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t m;
+
+    for (; i + 32 <= slen; i += 32) {
+        m = ~cmpeq_avx2(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t m;
+
+    for (; i + 32 <= slen; i += 32) {
+        m = cmpeq_avx2(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz32(m);
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_avx2, find_same_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline uint64_t cmpeq_avx512bw(const uint8_t *old_buf,
+                                      const uint8_t *new_buf, int i)
+{
+    return _mm512_cmpeq_epi8_mask(
+        _mm512_loadu_si512((const __m512i *)(old_buf + i)),
+        _mm512_loadu_si512((const __m512i *)(new_buf + i)));
+}
+
+static inline int find_diff_avx512bw(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t m;
+
+    for (; i + 64 <= slen; i += 64) {
+        m = ~cmpeq_avx512bw(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz64(m);
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_avx512bw(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t m;
+
+    for (; i + 64 <= slen; i += 64) {
+        m = cmpeq_avx512bw(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz64(m);
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                         int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_avx512bw, find_same_avx512bw);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW  1
+#define CACHE_AVX2      2
+#define CACHE_SSE2      4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_buffer_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512bw;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* AVX-512 also needs the opmask and ZMM state enabled.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/*
+ * NEON has no movemask; narrowing the 0x00/0xff byte lanes by 4 bits
+ * gives a 64-bit value with a nibble per byte instead.
+ */
+static inline uint64_t cmpeq_neon(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i)
+{
+    uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+    return vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static inline int find_diff_neon(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t m;
+
+    for (; i + 16 <= slen; i += 16) {
+        m = ~cmpeq_neon(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz64(m) / 4;
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_neon(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t m;
+
+    for (; i + 16 <= slen; i += 16) {
+        m = cmpeq_neon(old_buf, new_buf, i);
+        if (m) {
+            return i + ctz64(m) / 4;
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_neon, find_same_neon);
+}
+
+/* NEON is always available on AArch64.  */
+static bool use_neon = true;
+#define encode_accel \
+    (use_neon ? xbzrle_encode_buffer_neon : xbzrle_encode_buffer_int)
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (!use_neon) {
+        return false;
+    }
+    use_neon = false;
+    return true;
+}
+
+#else
+#define encode_accel xbzrle_encode_buffer_int
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -70,6 +70,7 @@
 #endif
 #include "exec/memory.h"
 #include "exec/exec-all.h"
+#include "exec/tb-profile.h"
 #include "qemu/log.h"
 #include "qemu/option.h"
 #include "hmp.h"
@@ -1410,6 +1411,13 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
+
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    int max = qdict_get_try_int(qdict, "max", 20);
+
+    tb_profile_dump((FILE *)mon, monitor_fprintf, max);
+}
 #endif
 
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#include <math.h>
 
 #include "qemu-version.h"
 #include "qapi/error.h"
@@ -31,10 +32,13 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
+#include "qemu/units.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
 #include "qom/object_interfaces.h"
@@ -66,6 +70,11 @@ enum {
     OPTION_SIZE = 264,
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
+    OPTION_RWMIX_READ = 267,
+    OPTION_RANDOM = 268,
+    OPTION_ZIPF = 269,
+    OPTION_JOBS = 270,
+    OPTION_SEED = 271,
 };
 
 typedef enum OutputFormat {
@@ -3936,10 +3945,96 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Zipf distribution over the ranks 1..n with exponent s, sampled in constant
+ * time with the rejection-inversion method (W. Hörmann, G. Derflinger,
+ * "Rejection-inversion to generate variates from monotone discrete
+ * distributions", 1996).  Rank 1 is the most likely.
+ */
+typedef struct BenchZipf {
+    double s;
+    uint64_t n;
+    double h_integral_x1;
+    double h_integral_n;
+    double threshold;
+} BenchZipf;
+
+/* (exp(x) - 1) / x, precise also for x close to 0 */
+static double bench_zipf_helper1(double x)
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2;
+}
+
+/* log(1 + x) / x, precise also for x close to 0 */
+static double bench_zipf_helper2(double x)
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x / 2;
+}
+
+static double bench_zipf_h(BenchZipf *z, double x)
+{
+    return exp(-z->s * log(x));
+}
+
+static double bench_zipf_h_integral(BenchZipf *z, double x)
+{
+    double log_x = log(x);
+
+    return bench_zipf_helper1((1 - z->s) * log_x) * log_x;
+}
+
+static double bench_zipf_h_integral_inverse(BenchZipf *z, double x)
+{
+    double t = MAX(x * (1 - z->s), -1);
+
+    return exp(bench_zipf_helper2(t) * x);
+}
+
+static void bench_zipf_init(BenchZipf *z, double s, uint64_t n)
+{
+    z->s = s;
+    z->n = n;
+    z->h_integral_x1 = bench_zipf_h_integral(z, 1.5) - 1;
+    z->h_integral_n = bench_zipf_h_integral(z, n + 0.5);
+    z->threshold = 2 - bench_zipf_h_integral_inverse(z,
+                            bench_zipf_h_integral(z, 2.5) - bench_zipf_h(z, 2));
+}
+
+/* Returns a rank between 0 (the most likely) and n - 1 */
+static uint64_t bench_zipf_next(BenchZipf *z, GRand *rand)
+{
+    for (;;) {
+        double u = z->h_integral_n +
+            g_rand_double(rand) * (z->h_integral_x1 - z->h_integral_n);
+        double x = bench_zipf_h_integral_inverse(z, u);
+        uint64_t k = MIN(MAX(x + 0.5, 1), z->n);
+
+        if (k - x <= z->threshold ||
+            u >= bench_zipf_h_integral(z, k + 0.5) - bench_zipf_h(z, k)) {
+            return k - 1;
+        }
+    }
+}
+
+typedef enum BenchOffsetMode {
+    BENCH_OFFSET_SEQUENTIAL,
+    BENCH_OFFSET_RANDOM,
+    BENCH_OFFSET_ZIPF,
+} BenchOffsetMode;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    BlockAcctCookie acct;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int rwmix_read;
     int bufsize;
     int step;
     int nrreq;
@@ -3947,12 +4042,45 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
+
+    BenchOffsetMode offset_mode;
+    uint64_t start;
+    uint64_t nr_blocks;
+    BenchZipf zipf;
+    GRand *rand;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
+
+/*
+ * Latency histogram boundaries from 1 us to about 60 s, with 8 bins per
+ * power of two, so that percentiles are off by at most 12.5%
+ */
+#define BENCH_HISTOGRAM_OCTAVES      26
+#define BENCH_HISTOGRAM_OCTAVE_BINS  8
+
+static uint64List *bench_histogram_boundaries(void)
+{
+    uint64List *list = NULL, *entry;
+    int i, j;
+
+    for (i = BENCH_HISTOGRAM_OCTAVES - 1; i >= 0; i--) {
+        for (j = BENCH_HISTOGRAM_OCTAVE_BINS - 1; j >= 0; j--) {
+            entry = g_new0(uint64List, 1);
+            entry->value = (1000ULL << i) * (BENCH_HISTOGRAM_OCTAVE_BINS + j) /
+                           BENCH_HISTOGRAM_OCTAVE_BINS;
+            entry->next = list;
+            list = entry;
+        }
+    }
+    return list;
+}
+
+static void bench_submit(BenchData *b);
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3962,63 +4090,111 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static void bench_drained_flush_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
+
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
     BlockAIOCB *acb;
+    int remaining;
 
     if (ret < 0) {
         error_report("Failed request: %s", strerror(-ret));
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
-
-        b->n--;
-        b->in_flight--;
+    block_acct_done(blk_get_stats(b->blk), &req->acct);
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
+    remaining = b->n - b->in_flight;
+    b->n--;
+    b->in_flight--;
 
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
             }
+
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (b->drain_on_flush) {
+            return;
         }
     }
 
+    bench_submit(b);
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    switch (b->offset_mode) {
+    case BENCH_OFFSET_SEQUENTIAL:
+        offset = b->offset;
+        b->offset += b->step;
+        b->offset %= b->image_size;
+        return offset;
+    case BENCH_OFFSET_RANDOM:
+        offset = g_rand_double(b->rand) * b->nr_blocks;
+        return b->start + MIN(offset, b->nr_blocks - 1) * b->bufsize;
+    case BENCH_OFFSET_ZIPF:
+        return b->start + bench_zipf_next(&b->zipf, b->rand) * b->bufsize;
+    default:
+        abort();
+    }
+}
+
+static void bench_submit(BenchData *b)
+{
+    BenchRequest *req;
+    BlockAIOCB *acb;
+
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        int64_t offset = bench_next_offset(b);
+        bool is_write = b->rwmix_read == 0 ||
+            (b->rwmix_read < 100 &&
+             g_rand_int_range(b->rand, 0, 100) >= b->rwmix_read);
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
+         * and the next offset is ready for the next submission.
          */
+        req = QSLIST_FIRST(&b->free_reqs);
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+
+        block_acct_start(blk_get_stats(b->blk), &req->acct, b->bufsize,
+                         is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+        if (is_write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0, bench_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0, bench_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4027,6 +4203,75 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static QDict *bench_get_result(BlockAcctStats *stats, enum BlockAcctType type,
+                               double seconds)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    QDict *result = qdict_new();
+    QDict *latency = qdict_new();
+    QList *boundaries = qlist_new();
+    QList *bins = qlist_new();
+    uint64_t ops = stats->nr_ops[type];
+    int i;
+
+    qdict_put_int(result, "ops", ops);
+    qdict_put_int(result, "bytes", stats->nr_bytes[type]);
+    qdict_put(result, "iops", qnum_from_double(ops / seconds));
+    qdict_put(result, "bandwidth",
+              qnum_from_double(stats->nr_bytes[type] / seconds));
+
+    qdict_put_int(latency, "mean", ops ? stats->total_time_ns[type] / ops : 0);
+    qdict_put_int(latency, "p50",
+                  block_latency_histogram_percentile(stats, type, 50));
+    qdict_put_int(latency, "p99",
+                  block_latency_histogram_percentile(stats, type, 99));
+    qdict_put_int(latency, "p99.9",
+                  block_latency_histogram_percentile(stats, type, 99.9));
+    for (i = 0; i < hist->nbins - 1; i++) {
+        qlist_append_int(boundaries, hist->boundaries[i]);
+    }
+    for (i = 0; i < hist->nbins; i++) {
+        qlist_append_int(bins, hist->bins[i]);
+    }
+    qdict_put(latency, "boundaries", boundaries);
+    qdict_put(latency, "bins", bins);
+    qdict_put(result, "latency", latency);
+
+    return result;
+}
+
+static void bench_print_result(const char *name, QDict *result)
+{
+    QDict *latency = qdict_get_qdict(result, "latency");
+
+    if (!qdict_get_int(result, "ops")) {
+        return;
+    }
+
+    printf("%s: %" PRId64 " ops, %" PRId64 " bytes, %.1f IOPS, "
+           "%.1f MiB/s\n", name,
+           qdict_get_int(result, "ops"), qdict_get_int(result, "bytes"),
+           qdict_get_double(result, "iops"),
+           qdict_get_double(result, "bandwidth") / MiB);
+    printf("  latency (us): mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f\n",
+           qdict_get_int(latency, "mean") / 1000.0,
+           qdict_get_int(latency, "p50") / 1000.0,
+           qdict_get_int(latency, "p99") / 1000.0,
+           qdict_get_int(latency, "p99.9") / 1000.0);
+}
+
+static bool bench_running(BenchData *jobs, int nr_jobs)
+{
+    int i;
+
+    for (i = 0; i < nr_jobs; i++) {
+        if (jobs[i].n > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
@@ -4042,13 +4287,26 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int rwmix_read = -1;
+    BenchOffsetMode offset_mode = BENCH_OFFSET_SEQUENTIAL;
+    double zipf_theta = 0;
+    int nr_jobs = 1;
+    uint32_t seed = 0;
+    OutputFormat output_format = OFORMAT_HUMAN;
     int64_t image_size;
+    uint64_t nr_blocks;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BlockAcctStats *stats;
+    BenchData *jobs = NULL;
+    uint8_t *buf = NULL;
+    uint64List *boundaries = NULL;
+    QDict *result;
+    QString *str;
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
-    int i;
+    double seconds;
+    int i, j;
     bool force_share = false;
     size_t buf_size;
 
@@ -4060,6 +4318,12 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"rwmix-read", required_argument, 0, OPTION_RWMIX_READ},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"zipf", required_argument, 0, OPTION_ZIPF},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"seed", required_argument, 0, OPTION_SEED},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
@@ -4187,6 +4451,70 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_RWMIX_READ:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            rwmix_read = res;
+            break;
+        }
+        case OPTION_RANDOM:
+            if (offset_mode == BENCH_OFFSET_SEQUENTIAL) {
+                offset_mode = BENCH_OFFSET_RANDOM;
+            }
+            break;
+        case OPTION_ZIPF:
+        {
+            char *end;
+
+            errno = 0;
+            zipf_theta = strtod(optarg, &end);
+            if (errno || end == optarg || *end ||
+                !(zipf_theta > 0 && zipf_theta <= 100)) {
+                error_report("Invalid zipf exponent specified");
+                return 1;
+            }
+            offset_mode = BENCH_OFFSET_ZIPF;
+            break;
+        }
+        case OPTION_JOBS:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res < 1 ||
+                res > 1024) {
+                error_report("Invalid number of jobs specified");
+                return 1;
+            }
+            nr_jobs = res;
+            break;
+        }
+        case OPTION_SEED:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > UINT32_MAX) {
+                error_report("Invalid random seed specified");
+                return 1;
+            }
+            seed = res;
+            break;
+        }
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json "
+                             "as argument.");
+                return 1;
+            }
+            break;
         }
     }
 
@@ -4195,7 +4523,14 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    /* -w alone writes only, --rwmix-read mixes reads into the writes */
+    if (rwmix_read < 0) {
+        rwmix_read = is_write ? 0 : 100;
+    } else if (rwmix_read < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    if (rwmix_read == 100 && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4205,6 +4540,16 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (offset_mode != BENCH_OFFSET_SEQUENTIAL && step) {
+        error_report("Step size can't be used with random offsets");
+        ret = -1;
+        goto out;
+    }
+    if (offset_mode != BENCH_OFFSET_SEQUENTIAL && !bufsize) {
+        error_report("Random offsets need a buffer size");
+        ret = -1;
+        goto out;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
                    force_share);
@@ -4219,56 +4564,143 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    /* Random requests are aligned to the buffer size and after @offset */
+    nr_blocks = bufsize && image_size > offset ?
+                (image_size - offset) / bufsize : 0;
+    if (offset_mode != BENCH_OFFSET_SEQUENTIAL && !nr_blocks) {
+        error_report("Image too small for random requests after offset %"
+                     PRId64, offset);
+        ret = -1;
+        goto out;
     }
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s requests, %zu bytes each, %d in parallel ",
+               count, rwmix_read == 100 ? "read" :
+                      rwmix_read == 0 ? "write" : "mixed",
+               bufsize, depth);
+        if (offset_mode == BENCH_OFFSET_SEQUENTIAL) {
+            printf("(starting at offset %" PRId64 ", step size %zu)\n",
+                   offset, step ?: bufsize);
+        } else if (offset_mode == BENCH_OFFSET_RANDOM) {
+            printf("(random offsets after %" PRId64 ")\n", offset);
+        } else {
+            printf("(zipf offsets after %" PRId64 ", exponent %g)\n",
+                   offset, zipf_theta);
+        }
+        if (rwmix_read > 0 && rwmix_read < 100) {
+            printf("%d%% of the requests are reads\n", rwmix_read);
+        }
+        if (nr_jobs > 1) {
+            printf("Running %d jobs at the same time\n", nr_jobs);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
+    }
+
+    stats = blk_get_stats(blk);
+    boundaries = bench_histogram_boundaries();
+    block_latency_histogram_set(stats, BLOCK_ACCT_READ, boundaries);
+    block_latency_histogram_set(stats, BLOCK_ACCT_WRITE, boundaries);
+
+    buf_size = (size_t)nr_jobs * depth * bufsize;
+    buf = blk_blockalign(blk, buf_size);
+    memset(buf, pattern, buf_size);
+
+    blk_register_buf(blk, buf, buf_size);
+
+    jobs = g_new0(BenchData, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        BenchData *b = &jobs[i];
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .rwmix_read     = rwmix_read,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = count,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .buf            = buf + (size_t)i * depth * bufsize,
+            .offset_mode    = offset_mode,
+            .start          = offset,
+            .nr_blocks      = nr_blocks,
+            .rand           = g_rand_new_with_seed(seed + i),
+        };
 
-    blk_register_buf(blk, data.buf, buf_size);
+        /* Sequential jobs start at evenly spread offsets */
+        b->offset = offset;
+        if (nr_blocks) {
+            b->offset += nr_blocks * i / nr_jobs * bufsize;
+        }
+        if (offset_mode == BENCH_OFFSET_ZIPF) {
+            bench_zipf_init(&b->zipf, zipf_theta, nr_blocks);
+        }
+
+        b->reqs = g_new(BenchRequest, depth);
+        for (j = 0; j < depth; j++) {
+            BenchRequest *req = &b->reqs[j];
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+            req->b = b;
+            qemu_iovec_init(&req->qiov, 1);
+            qemu_iovec_add(&req->qiov, b->buf + j * bufsize, bufsize);
+            QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+        }
     }
 
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    for (i = 0; i < nr_jobs; i++) {
+        bench_submit(&jobs[i]);
+    }
 
-    while (data.n > 0) {
+    while (bench_running(jobs, nr_jobs)) {
         main_loop_wait(false);
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    seconds = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+
+    result = qdict_new();
+    qdict_put_int(result, "jobs", nr_jobs);
+    qdict_put_int(result, "depth", depth);
+    qdict_put_int(result, "buffer-size", bufsize);
+    qdict_put(result, "time", qnum_from_double(seconds));
+    qdict_put(result, "read", bench_get_result(stats, BLOCK_ACCT_READ,
+                                               seconds));
+    qdict_put(result, "write", bench_get_result(stats, BLOCK_ACCT_WRITE,
+                                                seconds));
+
+    if (output_format == OFORMAT_JSON) {
+        str = qobject_to_json_pretty(QOBJECT(result));
+        printf("%s\n", qstring_get_str(str));
+        qobject_unref(str);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", seconds);
+        bench_print_result("read", qdict_get_qdict(result, "read"));
+        bench_print_result("write", qdict_get_qdict(result, "write"));
+    }
+    qobject_unref(result);
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
+    if (jobs) {
+        for (i = 0; i < nr_jobs; i++) {
+            for (j = 0; j < depth; j++) {
+                qemu_iovec_destroy(&jobs[i].reqs[j].qiov);
+            }
+            g_free(jobs[i].reqs);
+            g_rand_free(jobs[i].rand);
+        }
+        g_free(jobs);
     }
-    qemu_vfree(data.buf);
+    qapi_free_uint64List(boundaries);
+    if (buf) {
+        blk_unregister_buf(blk, buf);
+    }
+    qemu_vfree(buf);
     blk_unref(blk);
 
     if (ret) {
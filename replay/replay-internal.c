@@ -13,8 +13,61 @@
 #include "qemu-common.h"
 #include "sysemu/replay.h"
 #include "replay-internal.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "sysemu/sysemu.h"
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+/* Current version of the replay mechanism.
+   Increase it when file format changes. */
+#define REPLAY_VERSION              0xe02008
+/* Version, codec and offset of the index */
+#define HEADER_SIZE                 (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+/*
+ * After the header, the event stream is stored in blocks of up to
+ * REPLAY_BLOCK_SIZE bytes.  Each block starts with its stored size and its
+ * uncompressed size, 4 bytes each; blocks that do not compress are stored
+ * as is, with equal sizes.  The index at the end of the file gives, for
+ * each block, its offset in the event stream, its offset in the file and
+ * the instruction count when it was started, so that a replay can resume
+ * from a snapshot without decompressing the preceding blocks.
+ */
+#define REPLAY_BLOCK_SIZE           (256 * KiB)
+#define REPLAY_BLOCK_HEADER_SIZE    (2 * sizeof(uint32_t))
+
+enum ReplayCodec {
+    REPLAY_CODEC_NONE,
+    REPLAY_CODEC_ZSTD,
+};
+
+typedef struct ReplayIndexEntry {
+    uint64_t offset;        /* position in the event stream */
+    uint64_t file_offset;   /* position of the block in the file */
+    uint64_t step;          /* replay_state.current_step at its start */
+} ReplayIndexEntry;
+
+typedef struct ReplayLog {
+    uint32_t codec;
+    /* Uncompressed data of the current block */
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    /* Compressed data of the current block */
+    uint8_t *zbuf;
+    size_t zbuf_size;
+    /* ReplayIndexEntry for each block, the current one is the last one
+       when recording */
+    GArray *index;
+    unsigned block;
+    bool eof;
+    bool read_error;
+} ReplayLog;
+
+static ReplayLog replay_log;
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -35,12 +88,292 @@ static void replay_write_error(void)
     }
 }
 
+static ReplayIndexEntry *replay_log_block(unsigned i)
+{
+    return &g_array_index(replay_log.index, ReplayIndexEntry, i);
+}
+
+static void replay_log_start_block(uint64_t offset, uint64_t file_offset)
+{
+    ReplayIndexEntry e = {
+        .offset = offset,
+        .file_offset = file_offset,
+        .step = replay_state.current_step,
+    };
+
+    g_array_append_val(replay_log.index, e);
+    replay_log.block = replay_log.index->len - 1;
+    replay_log.len = 0;
+}
+
+/* Writes out the current block and starts the next one */
+static void replay_log_write_block(void)
+{
+    ReplayIndexEntry *e = replay_log_block(replay_log.block);
+    uint8_t header[REPLAY_BLOCK_HEADER_SIZE];
+    const uint8_t *data = replay_log.buf;
+    size_t size = replay_log.len;
+
+    if (!size) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    if (replay_log.codec == REPLAY_CODEC_ZSTD) {
+        size_t ret = ZSTD_compress(replay_log.zbuf, replay_log.zbuf_size,
+                                   replay_log.buf, replay_log.len,
+                                   ZSTD_CLEVEL_DEFAULT);
+        if (!ZSTD_isError(ret) && ret < replay_log.len) {
+            data = replay_log.zbuf;
+            size = ret;
+        }
+    }
+#endif
+
+    stl_be_p(header, size);
+    stl_be_p(header + 4, replay_log.len);
+    if (fwrite(header, 1, sizeof(header), replay_file) != sizeof(header) ||
+        fwrite(data, 1, size, replay_file) != size) {
+        replay_write_error();
+    }
+    replay_log_start_block(e->offset + replay_log.len,
+                           e->file_offset + sizeof(header) + size);
+}
+
+/* Makes block @i the current one for reading */
+static void replay_log_read_block(unsigned i)
+{
+    ReplayIndexEntry *e;
+    uint8_t header[REPLAY_BLOCK_HEADER_SIZE];
+    uint32_t size, len;
+
+    if (i >= replay_log.index->len) {
+        replay_log.eof = true;
+        return;
+    }
+    replay_log.block = i;
+    replay_log.len = replay_log.pos = 0;
+    e = replay_log_block(i);
+
+    if (fseeko(replay_file, e->file_offset, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), replay_file) != sizeof(header)) {
+        goto fail;
+    }
+    size = ldl_be_p(header);
+    len = ldl_be_p(header + 4);
+    if (len > REPLAY_BLOCK_SIZE || size > replay_log.zbuf_size) {
+        goto fail;
+    }
+
+    if (size == len) {
+        if (fread(replay_log.buf, 1, len, replay_file) != len) {
+            goto fail;
+        }
+    } else {
+#ifdef CONFIG_ZSTD
+        size_t ret;
+
+        if (fread(replay_log.zbuf, 1, size, replay_file) != size) {
+            goto fail;
+        }
+        ret = ZSTD_decompress(replay_log.buf, REPLAY_BLOCK_SIZE,
+                              replay_log.zbuf, size);
+        if (ZSTD_isError(ret) || ret != len) {
+            goto fail;
+        }
+#else
+        goto fail;
+#endif
+    }
+    replay_log.len = len;
+
+#ifdef POSIX_FADV_WILLNEED
+    /* Start reading the next block while this one is replayed */
+    if (i + 1 < replay_log.index->len) {
+        ReplayIndexEntry *next = replay_log_block(i + 1);
+        uint64_t end = i + 2 < replay_log.index->len
+            ? replay_log_block(i + 2)->file_offset : 0;
+
+        posix_fadvise(fileno(replay_file), next->file_offset,
+                      end ? end - next->file_offset : 0,
+                      POSIX_FADV_WILLNEED);
+    }
+#endif
+    return;
+
+fail:
+    error_report("replay read error");
+    replay_log.read_error = true;
+}
+
+static void replay_log_init(uint32_t codec)
+{
+    replay_log.codec = codec;
+    replay_log.buf = g_malloc(REPLAY_BLOCK_SIZE);
+#ifdef CONFIG_ZSTD
+    replay_log.zbuf_size = ZSTD_compressBound(REPLAY_BLOCK_SIZE);
+#else
+    replay_log.zbuf_size = REPLAY_BLOCK_SIZE;
+#endif
+    replay_log.zbuf = g_malloc(replay_log.zbuf_size);
+    replay_log.index = g_array_new(false, false, sizeof(ReplayIndexEntry));
+    replay_log.pos = replay_log.len = 0;
+    replay_log.eof = replay_log.read_error = false;
+}
+
+void replay_log_open(const char *fname, ReplayMode mode, bool compress)
+{
+    uint8_t header[HEADER_SIZE];
+    uint64_t index_offset, count;
+    uint32_t codec;
+    uint64_t i;
+
+    assert(!replay_file);
+    replay_file = fopen(fname, mode == REPLAY_MODE_RECORD ? "wb" : "rb");
+    if (replay_file == NULL) {
+        error_report("Replay: open %s: %s", fname, strerror(errno));
+        exit(1);
+    }
+
+    if (mode == REPLAY_MODE_RECORD) {
+        replay_log_init(compress ? REPLAY_CODEC_ZSTD : REPLAY_CODEC_NONE);
+        /* The header is written by replay_log_close() */
+        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_start_block(0, HEADER_SIZE);
+        return;
+    }
+
+    if (fread(header, 1, sizeof(header), replay_file) != sizeof(header) ||
+        ldl_be_p(header) != REPLAY_VERSION) {
+        error_report("Replay: invalid input log file version");
+        exit(1);
+    }
+    codec = ldl_be_p(header + 4);
+    index_offset = ldq_be_p(header + 8);
+#ifdef CONFIG_ZSTD
+    if (codec > REPLAY_CODEC_ZSTD) {
+#else
+    if (codec != REPLAY_CODEC_NONE) {
+#endif
+        error_report("Replay: log compressed with an unsupported method");
+        exit(1);
+    }
+    replay_log_init(codec);
+
+    if (fseeko(replay_file, index_offset, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(uint64_t), replay_file) != sizeof(uint64_t)) {
+        goto fail;
+    }
+    count = ldq_be_p(header);
+    for (i = 0; i < count; i++) {
+        uint8_t buf[3 * sizeof(uint64_t)];
+        ReplayIndexEntry e;
+
+        if (fread(buf, 1, sizeof(buf), replay_file) != sizeof(buf)) {
+            goto fail;
+        }
+        e.offset = ldq_be_p(buf);
+        e.file_offset = ldq_be_p(buf + 8);
+        e.step = ldq_be_p(buf + 16);
+        g_array_append_val(replay_log.index, e);
+    }
+    replay_log_read_block(0);
+    return;
+
+fail:
+    error_report("Replay: cannot read the index of the log");
+    exit(1);
+}
+
+void replay_log_close(void)
+{
+    uint8_t header[HEADER_SIZE];
+    uint64_t index_offset;
+    unsigned i;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_log_write_block();
+        /* Drop the empty block that was just started */
+        g_array_set_size(replay_log.index, replay_log.index->len - 1);
+        index_offset = ftello(replay_file);
+
+        stq_be_p(header, replay_log.index->len);
+        if (fwrite(header, 1, sizeof(uint64_t), replay_file) !=
+            sizeof(uint64_t)) {
+            replay_write_error();
+        }
+        for (i = 0; i < replay_log.index->len; i++) {
+            ReplayIndexEntry *e = replay_log_block(i);
+            uint8_t buf[3 * sizeof(uint64_t)];
+
+            stq_be_p(buf, e->offset);
+            stq_be_p(buf + 8, e->file_offset);
+            stq_be_p(buf + 16, e->step);
+            if (fwrite(buf, 1, sizeof(buf), replay_file) != sizeof(buf)) {
+                replay_write_error();
+            }
+        }
+
+        stl_be_p(header, REPLAY_VERSION);
+        stl_be_p(header + 4, replay_log.codec);
+        stq_be_p(header + 8, index_offset);
+        fseek(replay_file, 0, SEEK_SET);
+        if (fwrite(header, 1, sizeof(header), replay_file) != sizeof(header)) {
+            replay_write_error();
+        }
+    }
+
+    fclose(replay_file);
+    replay_file = NULL;
+    g_free(replay_log.buf);
+    g_free(replay_log.zbuf);
+    g_array_free(replay_log.index, true);
+    replay_log.buf = replay_log.zbuf = NULL;
+    replay_log.index = NULL;
+}
+
+uint64_t replay_log_tell(void)
+{
+    uint64_t offset = replay_log_block(replay_log.block)->offset;
+
+    return offset + (replay_mode == REPLAY_MODE_RECORD
+                     ? replay_log.len : replay_log.pos);
+}
+
+void replay_log_seek(uint64_t offset, uint64_t step)
+{
+    unsigned lo = 0, hi = replay_log.index->len;
+
+    /* Find the last block that starts at or before offset */
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+
+        if (replay_log_block(mid)->offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo >= replay_log.index->len || replay_log_block(lo)->step > step) {
+        error_report("Replay: VM state does not belong to this log");
+        exit(1);
+    }
+
+    replay_log.eof = replay_log.read_error = false;
+    replay_log_read_block(lo);
+    if (offset - replay_log_block(lo)->offset > replay_log.len) {
+        error_report("Replay: VM state does not belong to this log");
+        exit(1);
+    }
+    replay_log.pos = offset - replay_log_block(lo)->offset;
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
-            replay_write_error();
+        if (replay_log.len == REPLAY_BLOCK_SIZE) {
+            replay_log_write_block();
         }
+        replay_log.buf[replay_log.len++] = byte;
     }
 }
 
@@ -73,17 +406,50 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
+        while (size) {
+            size_t n;
+
+            if (replay_log.len == REPLAY_BLOCK_SIZE) {
+                replay_log_write_block();
+            }
+            n = MIN(size, REPLAY_BLOCK_SIZE - replay_log.len);
+            memcpy(replay_log.buf + replay_log.len, buf, n);
+            replay_log.len += n;
+            buf += n;
+            size -= n;
+        }
+    }
+}
+
+/* Copies @size bytes from the log to @buf, returns the number copied */
+static size_t replay_log_read(uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size && !replay_log.eof && !replay_log.read_error) {
+        size_t n;
+
+        if (replay_log.pos == replay_log.len) {
+            replay_log_read_block(replay_log.block + 1);
+            continue;
         }
+        n = MIN(size - done, replay_log.len - replay_log.pos);
+        memcpy(buf + done, replay_log.buf + replay_log.pos, n);
+        replay_log.pos += n;
+        done += n;
     }
+    return done;
 }
 
 uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (likely(replay_log.pos < replay_log.len)) {
+            byte = replay_log.buf[replay_log.pos++];
+        } else {
+            replay_log_read(&byte, 1);
+        }
     }
     return byte;
 }
@@ -125,7 +491,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (replay_log_read(buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -136,7 +502,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (replay_log_read(*buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -145,11 +511,11 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_log.eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (replay_log.read_error) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
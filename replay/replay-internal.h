@@ -92,6 +92,17 @@ extern ReplayState replay_state;
 /* File for replay writing */
 extern FILE *replay_file;
 
+/*! Opens the log file and reads or reserves its header. */
+void replay_log_open(const char *fname, ReplayMode mode, bool compress);
+/*! Writes out the buffered events, the index and the header,
+    and closes the log file. */
+void replay_log_close(void);
+/*! Returns the current position in the event stream. */
+uint64_t replay_log_tell(void);
+/*! Resumes reading at a position returned by replay_log_tell(),
+    that was reached after @step instructions. */
+void replay_log_seek(uint64_t offset, uint64_t step);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
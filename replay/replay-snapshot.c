@@ -24,7 +24,7 @@
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
-    state->file_offset = ftell(replay_file);
+    state->file_offset = replay_log_tell();
     state->host_clock_last = qemu_clock_get_last(QEMU_CLOCK_HOST);
 
     return 0;
@@ -33,7 +33,9 @@ static int replay_pre_save(void *opaque)
 static int replay_post_load(void *opaque, int version_id)
 {
     ReplayState *state = opaque;
-    fseek(replay_file, state->file_offset, SEEK_SET);
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        replay_log_seek(state->file_offset, state->current_step);
+    }
     qemu_clock_set_last(QEMU_CLOCK_HOST, state->host_clock_last);
     /* If this was a vmstate, saved in recording mode,
        we need to initialize replay data fields. */
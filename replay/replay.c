@@ -20,12 +20,6 @@
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 
-/* Current version of the replay mechanism.
-   Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02007
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
-
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 char *replay_snapshot;
 
@@ -224,17 +218,11 @@ out:
     return res;
 }
 
-static void replay_enable(const char *fname, int mode)
+static void replay_enable(const char *fname, int mode, bool compress)
 {
-    const char *fmode = NULL;
-    assert(!replay_file);
-
     switch (mode) {
     case REPLAY_MODE_RECORD:
-        fmode = "wb";
-        break;
     case REPLAY_MODE_PLAY:
-        fmode = "rb";
         break;
     default:
         fprintf(stderr, "Replay: internal error: invalid replay mode\n");
@@ -243,11 +231,7 @@ static void replay_enable(const char *fname, int mode)
 
     atexit(replay_finish);
 
-    replay_file = fopen(fname, fmode);
-    if (replay_file == NULL) {
-        fprintf(stderr, "Replay: open %s: %s\n", fname, strerror(errno));
-        exit(1);
-    }
+    replay_log_open(fname, mode, compress);
 
     replay_filename = g_strdup(fname);
     replay_mode = mode;
@@ -258,17 +242,7 @@ static void replay_enable(const char *fname, int mode)
     replay_state.current_step = 0;
     replay_state.has_unread_data = 0;
 
-    /* skip file header for RECORD and check it for PLAY */
-    if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
-    } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
-            fprintf(stderr, "Replay: invalid input log file version\n");
-            exit(1);
-        }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+    if (replay_mode == REPLAY_MODE_PLAY) {
         replay_fetch_data_kind();
     }
 
@@ -280,6 +254,7 @@ void replay_configure(QemuOpts *opts)
     const char *fname;
     const char *rr;
     ReplayMode mode = REPLAY_MODE_NONE;
+    bool compress;
     Location loc;
 
     if (!opts) {
@@ -308,9 +283,19 @@ void replay_configure(QemuOpts *opts)
         exit(1);
     }
 
+#ifdef CONFIG_ZSTD
+    compress = qemu_opt_get_bool(opts, "rrcompress", true);
+#else
+    compress = qemu_opt_get_bool(opts, "rrcompress", false);
+    if (compress) {
+        error_report("Replay log compression requires zstd support");
+        exit(1);
+    }
+#endif
+
     replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
     replay_vmstate_register();
-    replay_enable(fname, mode);
+    replay_enable(fname, mode, compress);
 
 out:
     loc_pop(&loc);
@@ -349,14 +334,9 @@ void replay_finish(void)
         if (replay_mode == REPLAY_MODE_RECORD) {
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
 
-        fclose(replay_file);
-        replay_file = NULL;
+        replay_log_close();
     }
     if (replay_filename) {
         g_free(replay_filename);
@@ -177,6 +177,8 @@ typedef enum X86Seg {
 #define HF_IOBPT_SHIFT      24 /* an io breakpoint enabled */
 #define HF_MPX_EN_SHIFT     25 /* MPX Enabled (CR4+XCR0+BNDCFGx) */
 #define HF_MPX_IU_SHIFT     26 /* BND registers in-use */
+/* TB flags only: index of the cc_op on entry in tb_cc_ops, 0 if unknown */
+#define HF_TB_CC_OP_SHIFT   27
 
 #define HF_CPL_MASK          (3 << HF_CPL_SHIFT)
 #define HF_INHIBIT_IRQ_MASK  (1 << HF_INHIBIT_IRQ_SHIFT)
@@ -202,6 +204,7 @@ typedef enum X86Seg {
 #define HF_IOBPT_MASK        (1 << HF_IOBPT_SHIFT)
 #define HF_MPX_EN_MASK       (1 << HF_MPX_EN_SHIFT)
 #define HF_MPX_IU_MASK       (1 << HF_MPX_IU_SHIFT)
+#define HF_TB_CC_OP_MASK     (0x1fU << HF_TB_CC_OP_SHIFT)
 
 /* hflags2 */
 
@@ -234,6 +237,9 @@ typedef enum X86Seg {
 #define CR0_AM_MASK  (1U << 18)
 #define CR0_PG_MASK  (1U << 31)
 
+#define CR3_PCID_MASK     0xfffULL
+#define CR3_NOFLUSH_MASK  (1ULL << 63)
+
 #define CR4_VME_MASK  (1U << 0)
 #define CR4_PVI_MASK  (1U << 1)
 #define CR4_TSD_MASK  (1U << 2)
@@ -1440,6 +1446,12 @@ struct X86CPU {
     /* Stop SMI delivery for migration compatibility with old machines */
     bool kvm_no_smi_migration;
 
+    /* TCG: translate blocks for the cc_op they are entered with, so that
+     * flags computed by a block can be consumed by its successors without
+     * going through the CC_OP_DYNAMIC helpers.
+     */
+    bool tb_cc_op;
+
     /* Number of physical address bits supported */
     uint32_t phys_bits;
 
@@ -1738,6 +1750,7 @@ static inline target_long lshift(target_long x, int n)
 
 /* translate.c */
 void tcg_x86_init(void);
+extern uint8_t tb_cc_op_index[CC_OP_NB];
 
 #include "exec/cpu-all.h"
 #include "svm.h"
@@ -1753,6 +1766,9 @@ static inline void cpu_get_tb_cpu_state(CPUX86State *env, target_ulong *pc,
     *pc = *cs_base + env->eip;
     *flags = env->hflags |
         (env->eflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK | AC_MASK));
+    if (x86_env_get_cpu(env)->tb_cc_op) {
+        *flags |= (uint32_t)tb_cc_op_index[env->cc_op] << HF_TB_CC_OP_SHIFT;
+    }
 }
 
 void do_cpu_init(X86CPU *cpu);
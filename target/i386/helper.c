@@ -671,9 +671,24 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
+    bool noflush = false;
 
+#ifdef TARGET_X86_64
+    if (env->cr[4] & CR4_PCIDE_MASK) {
+        noflush = new_cr3 & CR3_NOFLUSH_MASK;
+        new_cr3 &= ~CR3_NOFLUSH_MASK;
+    }
+#endif
     env->cr[3] = new_cr3;
-    if (env->cr[0] & CR0_PG_MASK) {
+    if (env->cr[4] & CR4_PCIDE_MASK) {
+        /* The TLB of the previous PCID is kept, see tlb_switch_tag() */
+        qemu_log_mask(CPU_LOG_MMU, "CR3 update: CR3=" TARGET_FMT_lx
+                      " noflush=%d\n", new_cr3, noflush);
+        tlb_switch_tag(CPU(cpu), new_cr3 & CR3_PCID_MASK);
+        if (!noflush) {
+            tlb_flush_tag(CPU(cpu), new_cr3 & CR3_PCID_MASK);
+        }
+    } else if (env->cr[0] & CR0_PG_MASK) {
         qemu_log_mask(CPU_LOG_MMU,
                         "CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
         tlb_flush(CPU(cpu));
@@ -690,7 +705,7 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
 #endif
     if ((new_cr4 ^ env->cr[4]) &
         (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK |
-         CR4_SMEP_MASK | CR4_SMAP_MASK | CR4_LA57_MASK)) {
+         CR4_SMEP_MASK | CR4_SMAP_MASK | CR4_LA57_MASK | CR4_PCIDE_MASK)) {
         tlb_flush(CPU(cpu));
     }
 
@@ -716,6 +731,19 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
         new_cr4 &= ~CR4_PKE_MASK;
     }
 
+#ifdef TARGET_X86_64
+    if (!(env->features[FEAT_1_ECX] & CPUID_EXT_PCID)) {
+        new_cr4 &= ~CR4_PCIDE_MASK;
+    }
+#else
+    new_cr4 &= ~CR4_PCIDE_MASK;
+#endif
+    if ((new_cr4 ^ env->cr[4]) & CR4_PCIDE_MASK) {
+        /* Without PCIDE, all address spaces are PCID 0 */
+        tlb_switch_tag(CPU(cpu), new_cr4 & CR4_PCIDE_MASK ?
+                       env->cr[3] & CR3_PCID_MASK : 0);
+    }
+
     env->cr[4] = new_cr4;
     env->hflags = hflags;
 
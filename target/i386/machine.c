@@ -298,6 +298,8 @@ static int cpu_post_load(void *opaque, int version_id)
         cpu_x86_update_dr7(env, dr7);
     }
     tlb_flush(cs);
+    tlb_switch_tag(cs, env->cr[4] & CR4_PCIDE_MASK ?
+                   env->cr[3] & CR3_PCID_MASK : 0);
     return 0;
 }
 
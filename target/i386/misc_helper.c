@@ -150,9 +150,23 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         cpu_x86_update_cr0(env, t0);
         break;
     case 3:
+#ifdef TARGET_X86_64
+        /* The no-flush bit is only defined with PCIDE */
+        if ((t0 & CR3_NOFLUSH_MASK) && !(env->cr[4] & CR4_PCIDE_MASK)) {
+            raise_exception_ra(env, EXCP0D_GPF, GETPC());
+        }
+#endif
         cpu_x86_update_cr3(env, t0);
         break;
     case 4:
+#ifdef TARGET_X86_64
+        /* PCIDE can only be set in IA-32e mode, and while the PCID is 0 */
+        if ((t0 & CR4_PCIDE_MASK) && !(env->cr[4] & CR4_PCIDE_MASK) &&
+            (env->features[FEAT_1_ECX] & CPUID_EXT_PCID) &&
+            (!(env->hflags & HF_LMA_MASK) || (env->cr[3] & CR3_PCID_MASK))) {
+            raise_exception_ra(env, EXCP0D_GPF, GETPC());
+        }
+#endif
         cpu_x86_update_cr4(env, t0);
         break;
     case 8:
@@ -186,6 +200,50 @@ void helper_invlpg(CPUX86State *env, target_ulong addr)
     tlb_flush_page(CPU(cpu), addr);
 }
 
+void helper_invpcid(CPUX86State *env, target_ulong type, target_ulong addr)
+{
+    X86CPU *cpu = x86_env_get_cpu(env);
+    uintptr_t ra = GETPC();
+    uint64_t pcid, linear_addr;
+
+    /* The descriptor is a PCID followed by a linear address */
+    pcid = cpu_ldq_data_ra(env, addr, ra);
+    linear_addr = cpu_ldq_data_ra(env, addr + 8, ra);
+
+    switch (type) {
+    case 0: /* individual address */
+    case 1: /* single context */
+        if (pcid & ~CR3_PCID_MASK) {
+            raise_exception_ra(env, EXCP0D_GPF, ra);
+        }
+        if (pcid && !(env->cr[4] & CR4_PCIDE_MASK)) {
+            raise_exception_ra(env, EXCP0D_GPF, ra);
+        }
+        if (type == 0) {
+#ifdef TARGET_X86_64
+            int shift = env->cr[4] & CR4_LA57_MASK ? 56 : 47;
+
+            if ((env->hflags & HF_LMA_MASK) &&
+                (int64_t)linear_addr >> shift != 0 &&
+                (int64_t)linear_addr >> shift != -1) {
+                raise_exception_ra(env, EXCP0D_GPF, ra);
+            }
+#endif
+            /* Global pages are not tagged, so flush it everywhere */
+            tlb_flush_page(CPU(cpu), linear_addr);
+        } else {
+            tlb_flush_tag(CPU(cpu), pcid);
+        }
+        break;
+    case 2: /* all contexts, including global pages */
+    case 3: /* all contexts */
+        tlb_flush(CPU(cpu));
+        break;
+    default:
+        raise_exception_ra(env, EXCP0D_GPF, ra);
+    }
+}
+
 void helper_rdtsc(CPUX86State *env)
 {
     uint64_t val;
@@ -117,6 +117,8 @@ typedef struct DisasContext {
     int ss32;   /* 32 bit stack segment */
     CCOp cc_op;  /* current CC operation */
     bool cc_op_dirty;
+    CCOp jmp_cc_op; /* CC operation in env at the next direct jump */
+    bool tb_cc_op; /* TBs are translated for their entry CC operation */
     int addseg; /* non zero if either DS/ES/SS have a non zero base */
     int f_st;   /* currently unused */
     int vm86;   /* vm86 mode */
@@ -224,6 +226,22 @@ static const uint8_t cc_op_live[CC_OP_NB] = {
     [CC_OP_POPCNT] = USES_CC_SRC,
 };
 
+/* CC operations that TBs can be translated for, see HF_TB_CC_OP_SHIFT.
+   These are the ones that are most often live across a jump.  */
+static const CCOp tb_cc_ops[(HF_TB_CC_OP_MASK >> HF_TB_CC_OP_SHIFT) + 1] = {
+    CC_OP_DYNAMIC, CC_OP_EFLAGS, CC_OP_CLR,
+    CC_OP_ADDB, CC_OP_ADDW, CC_OP_ADDL, CC_OP_ADDQ,
+    CC_OP_SUBB, CC_OP_SUBW, CC_OP_SUBL, CC_OP_SUBQ,
+    CC_OP_LOGICB, CC_OP_LOGICW, CC_OP_LOGICL, CC_OP_LOGICQ,
+    CC_OP_INCB, CC_OP_INCW, CC_OP_INCL, CC_OP_INCQ,
+    CC_OP_DECB, CC_OP_DECW, CC_OP_DECL, CC_OP_DECQ,
+    CC_OP_SHLB, CC_OP_SHLW, CC_OP_SHLL, CC_OP_SHLQ,
+    CC_OP_SARB, CC_OP_SARW, CC_OP_SARL, CC_OP_SARQ,
+};
+
+/* Inverse of tb_cc_ops, 0 for the CC operations that are not in it.  */
+uint8_t tb_cc_op_index[CC_OP_NB];
+
 static void set_cc_op(DisasContext *s, CCOp op)
 {
     int dead;
@@ -1043,6 +1061,7 @@ static inline void gen_jcc1(DisasContext *s, int b, TCGLabel *l1)
         tcg_gen_andi_tl(cpu_T0, cc.reg, cc.mask);
         cc.reg = cpu_T0;
     }
+    s->jmp_cc_op = s->cc_op;
     set_cc_op(s, CC_OP_DYNAMIC);
     if (cc.use_reg2) {
         tcg_gen_brcond_tl(cc.cond, cc.reg, cc.reg2, l1);
@@ -1057,10 +1076,20 @@ static TCGLabel *gen_jz_ecx_string(DisasContext *s, target_ulong next_eip)
 {
     TCGLabel *l1 = gen_new_label();
     TCGLabel *l2 = gen_new_label();
+    CCOp cc_op = s->cc_op;
+
+    /* l2 is also reached after the string operation, which may have
+       changed CC_OP, so only the exit through l2 uses CC_OP_DYNAMIC.  */
+    gen_update_cc_op(s);
+    set_cc_op(s, CC_OP_DYNAMIC);
     gen_op_jnz_ecx(s->aflag, l1);
     gen_set_label(l2);
     gen_jmp_tb(s, next_eip, 1);
     gen_set_label(l1);
+
+    /* The string operation starts with the CC_OP stored in env above.  */
+    s->cc_op = cc_op;
+    s->cc_op_dirty = false;
     return l2;
 }
 
@@ -2188,12 +2217,24 @@ static inline bool use_goto_tb(DisasContext *s, target_ulong pc)
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 {
     target_ulong pc = s->cs_base + eip;
-
-    if (use_goto_tb(s, pc))  {
+    uint32_t flags = s->base.tb->flags;
+
+    /* The successor is looked up once, with the CC_OP that env has at
+       that point, and then always entered through the direct jump.  If
+       CC_OP is only known at run time, it may be entered with another
+       one, so it must be looked up every time instead.  */
+    if (use_goto_tb(s, pc) &&
+        !(s->tb_cc_op && s->jmp_cc_op == CC_OP_DYNAMIC)) {
         /* jump to same page: we can use a direct jump */
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb(s->base.tb, tb_num);
+        if (s->tb_cc_op) {
+            flags &= ~HF_TB_CC_OP_MASK;
+            flags |= (uint32_t)tb_cc_op_index[s->jmp_cc_op]
+                     << HF_TB_CC_OP_SHIFT;
+        }
+        translator_note_goto_tb(&s->base, tb_num, pc, flags);
         s->base.is_jmp = DISAS_NORETURN;
     } else {
         /* jump to another page */
@@ -2613,6 +2654,7 @@ static void gen_jr(DisasContext *s, TCGv dest)
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 {
     gen_update_cc_op(s);
+    s->jmp_cc_op = s->cc_op;
     set_cc_op(s, CC_OP_DYNAMIC);
     if (s->jmp_opt) {
         gen_goto_tb(s, tb_num, eip);
@@ -8300,6 +8342,34 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
     case 0x1c2:
     case 0x1c4 ... 0x1c6:
     case 0x1d0 ... 0x1fe:
+        if (b == 0x138 && (s->prefix & PREFIX_DATA) &&
+            !(s->prefix & (PREFIX_REPZ | PREFIX_REPNZ))) {
+            /* invpcid is in the 0f 38 map, but it is not an SSE insn */
+            if (x86_ldub_code(env, s) == 0x82) {
+                modrm = x86_ldub_code(env, s);
+                reg = ((modrm >> 3) & 7) | rex_r;
+                mod = (modrm >> 6) & 3;
+                if (!(s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_INVPCID)
+                    || mod == 3 || s->vm86) {
+                    goto illegal_op;
+                }
+                if (s->cpl != 0) {
+                    gen_exception(s, EXCP0D_GPF, pc_start - s->cs_base);
+                    break;
+                }
+                ot = CODE64(s) ? MO_64 : MO_32;
+                gen_op_mov_v_reg(ot, cpu_T0, reg);
+                gen_extu(ot, cpu_T0);
+                gen_update_cc_op(s);
+                gen_jmp_im(pc_start - s->cs_base);
+                gen_lea_modrm(env, s, modrm);
+                gen_helper_invpcid(cpu_env, cpu_T0, cpu_A0);
+                gen_jmp_im(s->pc - s->cs_base);
+                gen_eob(s);
+                break;
+            }
+            s->pc--;
+        }
         gen_sse(env, s, b, pc_start, rex_r);
         break;
     default:
@@ -8393,6 +8463,12 @@ void tcg_x86_init(void)
                                      offsetof(CPUX86State, bnd_regs[i].ub),
                                      bnd_regu_names[i]);
     }
+
+    for (i = 1; i < ARRAY_SIZE(tb_cc_ops); ++i) {
+        if (tb_cc_ops[i] != CC_OP_DYNAMIC) {
+            tb_cc_op_index[tb_cc_ops[i]] = i;
+        }
+    }
 }
 
 static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
@@ -8411,8 +8487,11 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
     dc->cpl = (flags >> HF_CPL_SHIFT) & 3;
     dc->iopl = (flags >> IOPL_SHIFT) & 3;
     dc->tf = (flags >> TF_SHIFT) & 1;
-    dc->cc_op = CC_OP_DYNAMIC;
+    /* CC_OP in env is tb_cc_ops[] of the index in the TB flags */
+    dc->cc_op = tb_cc_ops[(flags & HF_TB_CC_OP_MASK) >> HF_TB_CC_OP_SHIFT];
     dc->cc_op_dirty = false;
+    dc->jmp_cc_op = CC_OP_DYNAMIC;
+    dc->tb_cc_op = x86_env_get_cpu(env)->tb_cc_op;
     dc->cs_base = cs_base;
     dc->popl_esp_hack = 0;
     /* select memory access functions */
@@ -8466,6 +8545,12 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 
 static void i386_tr_tb_start(DisasContextBase *db, CPUState *cpu)
 {
+    DisasContext *dc = container_of(db, DisasContext, base);
+
+    /* CC_SRCT is not kept in env, recompute it from CC_DST and CC_SRC */
+    if (dc->cc_op >= CC_OP_SUBB && dc->cc_op <= CC_OP_SUBQ) {
+        tcg_gen_add_tl(cpu_cc_srcT, cpu_cc_dst, cpu_cc_src);
+    }
 }
 
 static void i386_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
@@ -37,6 +37,7 @@ extern "C" {
 
 #define HAVE_TCG_QEMU_TB_EXEC
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 20
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
 
 #define TCG_TARGET_REG_BITS  32
 #define TCG_TARGET_NB_REGS   31
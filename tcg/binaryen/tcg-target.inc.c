@@ -252,11 +252,13 @@ static BinaryenExpressionRef tcg_out_tlb_op(TCGContext *s, uint32_t addr_const,
     TCGMemOp opc = get_memop(oi);
     bool is_signed = (opc & MO_SIGN) != 0;
 
+    int mask_off = offsetof(CPUArchState, tlb_mask[mem_index]);
+    int table_off = offsetof(CPUArchState, tlb_table[mem_index]);
     int cmp_off =
         (is_load
-         ? offsetof(CPUArchState, tlb_table[mem_index][0].addr_read)
-         : offsetof(CPUArchState, tlb_table[mem_index][0].addr_write));
-    int add_off = offsetof(CPUArchState, tlb_table[mem_index][0].addend);
+         ? offsetof(CPUTLBEntry, addr_read)
+         : offsetof(CPUTLBEntry, addr_write));
+    int add_off = offsetof(CPUTLBEntry, addend);
 
     // TMP0 <- virt_page
     BinaryenExpressionRef tmp0 = BinaryenTeeLocal(MODULE, TLB_TMP0, BinaryenBinary(MODULE, BinaryenShrUInt32(),
@@ -264,16 +266,22 @@ static BinaryenExpressionRef tcg_out_tlb_op(TCGContext *s, uint32_t addr_const,
         CONST32(TARGET_PAGE_BITS)
     ));
 
-    // TMP1 <- offset in TLB + TLB base address
+    // TMP1 <- tlb_table[mem_index] + (offset in TLB & tlb_mask[mem_index])
     BinaryenExpressionRef tmp1 = BinaryenTeeLocal(MODULE, TLB_TMP1,
         BinaryenBinary(MODULE, BinaryenAddInt32(),
-            REG32(0),
-            BinaryenBinary(MODULE, BinaryenShlInt32(),
-                BinaryenBinary(MODULE, BinaryenAndInt32(),
+            BinaryenLoad(
+                MODULE, 4, 0, table_off, 0, BinaryenTypeInt32(),
+                REG32(0)
+            ),
+            BinaryenBinary(MODULE, BinaryenAndInt32(),
+                BinaryenBinary(MODULE, BinaryenShlInt32(),
                     tmp0,
-                    CONST32(CPU_TLB_SIZE - 1)
+                    CONST32(CPU_TLB_ENTRY_BITS)
                 ),
-                CONST32(CPU_TLB_ENTRY_BITS)
+                BinaryenLoad(
+                    MODULE, 4, 0, mask_off, 0, BinaryenTypeInt32(),
+                    REG32(0)
+                )
             )
         )
     );
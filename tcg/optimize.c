@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "exec/cpu-common.h"
+#include "qemu/range.h"
 #include "tcg-op.h"
 
 #define CASE_OP_32_64(x)                        \
@@ -587,6 +588,275 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* Loads and stores of env fields.  Within a basic block, the optimizer
+   remembers which temps hold the contents of a field (from a previous load
+   or store), so that loading it again becomes a move, and which stores
+   have not been read yet, so that one overwritten by a later store to the
+   same field can be dropped.  Fields that back a TCG global are left
+   alone: the register allocator loads and stores them behind our back.  */
+#define MAX_ENV_INFOS 16
+
+struct env_value {
+    intptr_t ofs;
+    int size;
+    TCGOpcode ld_opc;       /* Load that produces VAL from the field.  */
+    TCGTemp *val;
+};
+
+struct env_store {
+    intptr_t ofs;
+    int size;
+    TCGOp *op;
+};
+
+struct env_info {
+    TCGTemp *env;
+    bool enabled;
+    int nb_values;
+    int nb_stores;
+    struct env_value values[MAX_ENV_INFOS];
+    struct env_store stores[MAX_ENV_INFOS];
+};
+
+static void env_info_init(TCGContext *s, struct env_info *ei)
+{
+    int i;
+
+    ei->env = tcgv_ptr_temp(cpu_env);
+    ei->enabled = true;
+    ei->nb_values = 0;
+    ei->nb_stores = 0;
+
+    /* A global based on another pointer (e.g. a register window) can
+       point into env, so nothing would be known about env accesses.  */
+    for (i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+        if (!ts->fixed_reg && ts->mem_base != ei->env) {
+            ei->enabled = false;
+        }
+    }
+}
+
+/* Return the size of the env field accessed by OPC, or 0 if OPC is not a
+   load or store of an integer.  LD_OPC is set to the load that returns
+   the value of the field as stored by OPC, or NB_OPS if none does.  */
+static int env_access_size(TCGOpcode opc, TCGOpcode *ld_opc)
+{
+    *ld_opc = opc;
+    switch (opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+        return 2;
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_ld_i32:
+        return 4;
+    case INDEX_op_ld_i64:
+        return 8;
+    CASE_OP_32_64(st8):
+        *ld_opc = NB_OPS;
+        return 1;
+    CASE_OP_32_64(st16):
+        *ld_opc = NB_OPS;
+        return 2;
+    case INDEX_op_st32_i64:
+        *ld_opc = NB_OPS;
+        return 4;
+    case INDEX_op_st_i32:
+        *ld_opc = INDEX_op_ld_i32;
+        return 4;
+    case INDEX_op_st_i64:
+        *ld_opc = INDEX_op_ld_i64;
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool env_field_is_global(TCGContext *s, intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+        if (!ts->fixed_reg &&
+            ranges_overlap(ts->mem_offset, ts->type == TCG_TYPE_I64 ? 8 : 4,
+                           ofs, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void env_forget_values(struct env_info *ei, intptr_t ofs, int size)
+{
+    int i, j;
+
+    for (i = j = 0; i < ei->nb_values; i++) {
+        if (!ranges_overlap(ei->values[i].ofs, ei->values[i].size,
+                            ofs, size)) {
+            ei->values[j++] = ei->values[i];
+        }
+    }
+    ei->nb_values = j;
+}
+
+static void env_forget_temp(struct env_info *ei, TCGTemp *ts)
+{
+    int i, j;
+
+    for (i = j = 0; i < ei->nb_values; i++) {
+        if (ei->values[i].val != ts) {
+            ei->values[j++] = ei->values[i];
+        }
+    }
+    ei->nb_values = j;
+}
+
+/* The field at OFS is read, so the stores to it are needed.  If DEAD,
+   the field is overwritten and the stores it covers are removed.  */
+static void env_forget_stores(TCGContext *s, struct env_info *ei,
+                              intptr_t ofs, int size, bool dead)
+{
+    int i, j;
+
+    for (i = j = 0; i < ei->nb_stores; i++) {
+        struct env_store *st = &ei->stores[i];
+        if (!ranges_overlap(st->ofs, st->size, ofs, size)) {
+            ei->stores[j++] = *st;
+        } else if (dead && st->ofs >= ofs &&
+                   st->ofs + st->size <= ofs + size) {
+            tcg_op_remove(s, st->op);
+        }
+    }
+    ei->nb_stores = j;
+}
+
+static void env_forget_all(struct env_info *ei)
+{
+    ei->nb_values = 0;
+    ei->nb_stores = 0;
+}
+
+/* Track the effect of OP on env.  Return true if OP, a load, was replaced
+   by a move from a temp that already holds the field.  */
+static bool env_optimize(TCGContext *s, struct env_info *ei, TCGOp *op,
+                         int nb_oargs, int nb_iargs)
+{
+    TCGOpcode opc = op->opc;
+    const TCGOpDef *def = &tcg_op_defs[opc];
+    TCGOpcode ld_opc;
+    TCGTemp *ts;
+    intptr_t ofs;
+    int i, size;
+    bool tracked;
+
+    if (!ei->enabled) {
+        return false;
+    }
+
+    /* Whatever the outputs held is gone.  */
+    for (i = 0; i < nb_oargs; i++) {
+        TCGTemp *ts = arg_temp(op->args[i]);
+        if (ts) {
+            env_forget_temp(ei, ts);
+        }
+    }
+
+    if (def->flags & TCG_OPF_BB_END) {
+        env_forget_all(ei);
+        return false;
+    }
+
+    switch (opc) {
+    case INDEX_op_call:
+        /* Helpers can read anything in env.  Unless they have no side
+           effects, they can also write it.  */
+        ei->nb_stores = 0;
+        if (!(op->args[nb_oargs + nb_iargs + 1] & TCG_CALL_NO_SIDE_EFFECTS)) {
+            ei->nb_values = 0;
+        }
+        return false;
+    case INDEX_op_ld_vec:
+        ei->nb_stores = 0;
+        return false;
+    case INDEX_op_st_vec:
+        ei->nb_values = 0;
+        ei->nb_stores = 0;
+        return false;
+    default:
+        break;
+    }
+
+    size = env_access_size(opc, &ld_opc);
+    if (size == 0) {
+        /* qemu_ld/st can fault, and an exception reads all of env.  */
+        if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+            env_forget_all(ei);
+        }
+        return false;
+    }
+
+    if (arg_temp(op->args[1]) != ei->env) {
+        /* The pointer might point into env.  */
+        if (nb_oargs) {
+            ei->nb_stores = 0;
+        } else {
+            ei->nb_values = 0;
+        }
+        return false;
+    }
+
+    ofs = op->args[2];
+    tracked = ofs >= 0 && !env_field_is_global(s, ofs, size);
+
+    if (nb_oargs) {
+        env_forget_stores(s, ei, ofs, size, false);
+        if (!tracked) {
+            return false;
+        }
+        for (i = 0; i < ei->nb_values; i++) {
+            struct env_value *v = &ei->values[i];
+            if (v->ofs == ofs && v->ld_opc == opc) {
+                op->opc = (def->flags & TCG_OPF_64BIT
+                           ? INDEX_op_mov_i64 : INDEX_op_mov_i32);
+                op->args[1] = temp_arg(v->val);
+                return true;
+            }
+        }
+        ts = arg_temp(op->args[0]);
+    } else {
+        env_forget_values(ei, ofs, size);
+        if (!tracked) {
+            env_forget_stores(s, ei, ofs, size, false);
+            return false;
+        }
+        env_forget_stores(s, ei, ofs, size, true);
+        if (ei->nb_stores < MAX_ENV_INFOS) {
+            struct env_store *st = &ei->stores[ei->nb_stores++];
+            st->ofs = ofs;
+            st->size = size;
+            st->op = op;
+        }
+        if (ld_opc == NB_OPS) {
+            return false;
+        }
+        ts = arg_temp(op->args[0]);
+    }
+
+    if (ei->nb_values < MAX_ENV_INFOS) {
+        struct env_value *v = &ei->values[ei->nb_values++];
+        v->ofs = ofs;
+        v->size = size;
+        v->ld_opc = ld_opc;
+        v->val = ts;
+    }
+    return false;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -594,6 +864,7 @@ void tcg_optimize(TCGContext *s)
     TCGOp *op, *op_next, *prev_mb = NULL;
     struct tcg_temp_info *infos;
     TCGTempSet temps_used;
+    struct env_info env_info;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -604,6 +875,7 @@ void tcg_optimize(TCGContext *s)
     nb_globals = s->nb_globals;
     bitmap_zero(temps_used.l, nb_temps);
     infos = tcg_malloc(sizeof(struct tcg_temp_info) * nb_temps);
+    env_info_init(s, &env_info);
 
     QTAILQ_FOREACH_SAFE(op, &s->ops, link, op_next) {
         tcg_target_ulong mask, partmask, affected;
@@ -639,6 +911,12 @@ void tcg_optimize(TCGContext *s)
             }
         }
 
+        /* Forward env fields to loads and remove dead stores to them */
+        if (env_optimize(s, &env_info, op, nb_oargs, nb_iargs)) {
+            opc = op->opc;
+            def = &tcg_op_defs[opc];
+        }
+
         /* For commutative operations make constant second argument */
         switch (opc) {
         CASE_OP_32_64_VEC(add):
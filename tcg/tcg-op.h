@@ -822,6 +822,14 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
+/**
+ * tcg_gen_counter_inc() - increment a counter in host memory
+ * @counter: Host address of the counter
+ *
+ * The increment is done inline, without calling a helper, and is not atomic.
+ */
+void tcg_gen_counter_inc(uint64_t *counter);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
@@ -0,0 +1,127 @@
+/*
+ * qcow2 compressed cluster speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "qemu/units.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+
+#define IMG_SIZE     (64 * MiB)
+#define CLUSTER_SIZE (64 * KiB)
+#define READ_SIZE    (1 * MiB)
+
+static uint8_t *data;
+
+/* Text-like data, so that it compresses roughly like a filesystem image */
+static void fill_data(void)
+{
+    static const char *const words[] = {
+        "qemu", "block", "cluster", "image", "driver", "offset", "the",
+        "of", "and", "compress", "guest", "kernel", "module", "lib", "usr",
+        "share",
+    };
+    size_t i = 0;
+    char *s;
+
+    data = g_malloc(IMG_SIZE);
+    while (i < IMG_SIZE) {
+        s = g_strdup_printf("%s %d ",
+                            words[g_test_rand_int_range(0,
+                                                        ARRAY_SIZE(words))],
+                            g_test_rand_int_range(0, 10000));
+        memcpy(data + i, s, MIN(strlen(s), IMG_SIZE - i));
+        i += strlen(s);
+        g_free(s);
+    }
+}
+
+static void test_compression_type(const void *opaque)
+{
+    const char *type = opaque;
+    BlockBackend *blk;
+    QDict *options;
+    char *filename, *create_options;
+    uint8_t *buf;
+    int64_t offset, file_size;
+    double write_time, read_time;
+    clock_t write_cpu, read_cpu;
+    int fd, ret;
+
+    fd = g_file_open_tmp("benchmark-qcow2-compress.XXXXXX", &filename, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    create_options = g_strdup_printf("compression_type=%s", type);
+    bdrv_img_create(filename, "qcow2", NULL, NULL, create_options, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+    g_free(create_options);
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "qcow2");
+    blk = blk_new_open(filename, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    /* qemu-img convert -c writes one cluster at a time */
+    write_cpu = clock();
+    g_test_timer_start();
+    for (offset = 0; offset < IMG_SIZE; offset += CLUSTER_SIZE) {
+        ret = blk_pwrite_compressed(blk, offset, data + offset, CLUSTER_SIZE);
+        g_assert_cmpint(ret, >=, 0);
+    }
+    g_assert_cmpint(blk_flush(blk), ==, 0);
+    write_time = g_test_timer_elapsed();
+    write_cpu = clock() - write_cpu;
+
+    file_size = bdrv_get_allocated_file_size(blk_bs(blk));
+
+    buf = blk_blockalign(blk, READ_SIZE);
+    read_cpu = clock();
+    g_test_timer_start();
+    for (offset = 0; offset < IMG_SIZE; offset += READ_SIZE) {
+        ret = blk_pread(blk, offset, buf, READ_SIZE);
+        g_assert_cmpint(ret, ==, READ_SIZE);
+        g_assert(!memcmp(buf, data + offset, READ_SIZE));
+    }
+    read_time = g_test_timer_elapsed();
+    read_cpu = clock() - read_cpu;
+
+    g_print("%s: %.1f%% of original size\n", type,
+            file_size * 100.0 / IMG_SIZE);
+    g_print("  write %.1f MB/s, %.2f s CPU\n",
+            IMG_SIZE / write_time / MiB, (double)write_cpu / CLOCKS_PER_SEC);
+    g_print("  read  %.1f MB/s, %.2f s CPU\n",
+            IMG_SIZE / read_time / MiB, (double)read_cpu / CLOCKS_PER_SEC);
+
+    qemu_vfree(buf);
+    blk_unref(blk);
+    unlink(filename);
+    g_free(filename);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    fill_data();
+
+    g_test_add_data_func("/qcow2-compress/zlib", "zlib",
+                         test_compression_type);
+#ifdef CONFIG_ZSTD
+    g_test_add_data_func("/qcow2-compress/zstd", "zstd",
+                         test_compression_type);
+#endif
+
+    ret = g_test_run();
+    g_free(data);
+    return ret;
+}
@@ -0,0 +1,172 @@
+/*
+ * QEMU timer list speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+static const int nr_timers[] = { 16, 256, 4096, 65536 };
+
+typedef struct Bench {
+    QEMUTimerList *tl;
+    QEMUTimer *timers;
+    int n;
+    int fired;
+} Bench;
+
+/* Deadlines far enough in the future that no timer fires while re-arming */
+static int64_t random_deadline(void)
+{
+    return qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+           NANOSECONDS_PER_SECOND * 3600 +
+           g_test_rand_int_range(0, 1000000);
+}
+
+static void bench_cb(void *opaque)
+{
+    Bench *b = opaque;
+
+    b->fired++;
+}
+
+static void bench_init(Bench *b, int n)
+{
+    int i;
+
+    b->tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+    b->timers = g_new0(QEMUTimer, n);
+    b->n = n;
+    b->fired = 0;
+    for (i = 0; i < n; i++) {
+        timer_init_tl(&b->timers[i], b->tl, SCALE_NS, bench_cb, b);
+        timer_mod_ns(&b->timers[i], random_deadline());
+    }
+}
+
+static void bench_cleanup(Bench *b)
+{
+    int i;
+
+    for (i = 0; i < b->n; i++) {
+        timer_del(&b->timers[i]);
+        timer_deinit(&b->timers[i]);
+    }
+    timerlist_free(b->tl);
+    g_free(b->timers);
+}
+
+/* Re-arm random timers, as devices do in their hot paths */
+static void test_timers_mod(void)
+{
+    Bench b;
+    unsigned long ops;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(nr_timers); i++) {
+        bench_init(&b, nr_timers[i]);
+        ops = 0;
+        g_test_timer_start();
+        do {
+            timer_mod_ns(&b.timers[g_test_rand_int_range(0, b.n)],
+                         random_deadline());
+            ops++;
+        } while ((ops & 1023) || g_test_timer_elapsed() < 1.0);
+        g_print("mod %d timers: %.1f ns/op\n", b.n,
+                g_test_timer_last() * 1e9 / ops);
+        bench_cleanup(&b);
+    }
+}
+
+/* Cancel a random timer and arm it again */
+static void test_timers_del(void)
+{
+    Bench b;
+    unsigned long ops;
+    QEMUTimer *t;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(nr_timers); i++) {
+        bench_init(&b, nr_timers[i]);
+        ops = 0;
+        g_test_timer_start();
+        do {
+            t = &b.timers[g_test_rand_int_range(0, b.n)];
+            timer_del(t);
+            timer_mod_ns(t, random_deadline());
+            ops++;
+        } while ((ops & 1023) || g_test_timer_elapsed() < 1.0);
+        g_print("del+mod %d timers: %.1f ns/op\n", b.n,
+                g_test_timer_last() * 1e9 / ops);
+        bench_cleanup(&b);
+    }
+}
+
+/* Timers must fire in index order, see test_timers_run() */
+static void check_order_cb(void *opaque)
+{
+    Bench *b = opaque;
+
+    g_assert_false(timer_pending(&b->timers[b->fired]));
+    if (b->fired + 1 < b->n) {
+        g_assert_true(timer_pending(&b->timers[b->fired + 1]));
+    }
+    b->fired++;
+}
+
+/*
+ * Fire all timers.  Every group of four timers shares a deadline; the
+ * timers are armed in reverse order of deadline, but in increasing index
+ * order within a group, so they must fire exactly in index order.
+ */
+static void test_timers_run(void)
+{
+    Bench b = { 0 };
+    int64_t base = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - 1000000000;
+    size_t i;
+    int j;
+
+    for (i = 0; i < ARRAY_SIZE(nr_timers); i++) {
+        b.tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+        b.n = nr_timers[i];
+        b.timers = g_new0(QEMUTimer, b.n);
+        b.fired = 0;
+        for (j = 0; j < b.n; j++) {
+            timer_init_tl(&b.timers[j], b.tl, SCALE_NS, check_order_cb, &b);
+        }
+        for (j = b.n - 4; j >= 0; j -= 4) {
+            timer_mod_ns(&b.timers[j], base + j / 4);
+            timer_mod_ns(&b.timers[j + 1], base + j / 4);
+            timer_mod_ns(&b.timers[j + 2], base + j / 4);
+            timer_mod_ns(&b.timers[j + 3], base + j / 4);
+        }
+
+        g_test_timer_start();
+        timerlist_run_timers(b.tl);
+        g_test_timer_elapsed();
+        g_assert_cmpint(b.fired, ==, b.n);
+        g_assert_false(timerlist_has_timers(b.tl));
+        g_print("run %d timers: %.1f ns/timer\n", b.n,
+                g_test_timer_last() * 1e9 / b.n);
+
+        for (j = 0; j < b.n; j++) {
+            timer_deinit(&b.timers[j]);
+        }
+        timerlist_free(b.tl);
+        g_free(b.timers);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    g_test_add_func("/timers/mod", test_timers_mod);
+    g_test_add_func("/timers/del", test_timers_del);
+    g_test_add_func("/timers/run", test_timers_run);
+
+    return g_test_run();
+}
@@ -0,0 +1,281 @@
+/*
+ * QEMU VNC tight encoding kernels speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ *
+ * Usage: benchmark-vnc-tight [GTEST-OPTIONS] [SNAPSHOT.ppm...]
+ *
+ * The snapshots are binary PPM files as written by the "screendump"
+ * monitor command.  Without any, a synthetic desktop-like frame is used.
+ */
+#include "qemu/osdep.h"
+#include "ui/vnc-enc-tight.h"
+#include "ui/vnc-enc-tight-accel.h"
+
+typedef struct Frame {
+    char *name;
+    int w, h;
+    uint32_t *pixels;
+} Frame;
+
+static GPtrArray *frames;
+
+static bool ppm_skip_space(const char **p, const char *end)
+{
+    while (*p < end) {
+        if (**p == '#') {
+            while (*p < end && **p != '\n') {
+                (*p)++;
+            }
+        } else if (g_ascii_isspace(**p)) {
+            (*p)++;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ppm_read_int(const char **p, const char *end, int *val)
+{
+    *val = 0;
+    if (!ppm_skip_space(p, end) || !g_ascii_isdigit(**p)) {
+        return false;
+    }
+    while (*p < end && g_ascii_isdigit(**p)) {
+        *val = *val * 10 + (**p - '0');
+        (*p)++;
+    }
+    return true;
+}
+
+static Frame *frame_load_ppm(const char *filename)
+{
+    gchar *data;
+    gsize len;
+    const char *p, *end;
+    int w, h, max, i;
+    Frame *f;
+
+    if (!g_file_get_contents(filename, &data, &len, NULL)) {
+        g_printerr("%s: cannot read\n", filename);
+        return NULL;
+    }
+    p = data;
+    end = data + len;
+    if (len < 2 || p[0] != 'P' || p[1] != '6') {
+        goto fail;
+    }
+    p += 2;
+    if (!ppm_read_int(&p, end, &w) || !ppm_read_int(&p, end, &h) ||
+        !ppm_read_int(&p, end, &max) || max != 255 || p >= end) {
+        goto fail;
+    }
+    p++;
+    if (w <= 0 || h <= 0 || end - p < (ptrdiff_t)w * h * 3) {
+        goto fail;
+    }
+
+    f = g_new0(Frame, 1);
+    f->name = g_path_get_basename(filename);
+    f->w = w;
+    f->h = h;
+    f->pixels = g_new(uint32_t, w * h);
+    for (i = 0; i < w * h; i++, p += 3) {
+        f->pixels[i] = (uint8_t)p[0] << 16 | (uint8_t)p[1] << 8 |
+                       (uint8_t)p[2];
+    }
+    g_free(data);
+    return f;
+
+fail:
+    g_printerr("%s: not a binary PPM file with 8-bit samples\n", filename);
+    g_free(data);
+    return NULL;
+}
+
+/*
+ * Solid background with a few windows: flat title bars, a text-like
+ * area with short runs, and a photo-like smooth gradient.
+ */
+static Frame *frame_synthetic(void)
+{
+    Frame *f = g_new0(Frame, 1);
+    int x, y;
+    uint32_t *p;
+
+    f->name = g_strdup("synthetic");
+    f->w = 1280;
+    f->h = 1024;
+    f->pixels = p = g_new(uint32_t, f->w * f->h);
+    for (y = 0; y < f->h; y++) {
+        for (x = 0; x < f->w; x++, p++) {
+            if (y >= 100 && y < 124 && x >= 100 && x < 900) {
+                *p = 0x3465a4;
+            } else if (y >= 124 && y < 600 && x >= 100 && x < 900) {
+                *p = (g_test_rand_int() % 8) ? 0xffffff : 0x000000;
+            } else if (y >= 300 && y < 900 && x >= 700 && x < 1200) {
+                *p = (x & 0xff) << 16 | (y & 0xff) << 8 | ((x + y) & 0xff);
+            } else {
+                *p = 0x2e3436;
+            }
+        }
+    }
+    return f;
+}
+
+/* Same tiling as find_large_solid_color_rect().  */
+static size_t bench_solid_tiles(const Frame *f)
+{
+    int x, y, dy, w, h;
+    size_t solid = 0;
+    const uint32_t *row;
+
+    for (y = 0; y < f->h; y += VNC_TIGHT_MAX_SPLIT_TILE_SIZE) {
+        h = MIN(VNC_TIGHT_MAX_SPLIT_TILE_SIZE, f->h - y);
+        for (x = 0; x < f->w; x += VNC_TIGHT_MAX_SPLIT_TILE_SIZE) {
+            w = MIN(VNC_TIGHT_MAX_SPLIT_TILE_SIZE, f->w - x);
+            row = f->pixels + y * f->w + x;
+            for (dy = 0; dy < h; dy++, row += f->w) {
+                if (vnc_tight_run_length32(row, w, row[-dy * f->w]) != w) {
+                    break;
+                }
+            }
+            solid += dy == h;
+        }
+    }
+    return solid;
+}
+
+/* Count color changes in each row, as the palette scan does.  */
+static size_t bench_palette_runs(const Frame *f)
+{
+    const uint32_t *row = f->pixels;
+    size_t runs = 0;
+    int x, y;
+
+    for (y = 0; y < f->h; y++, row += f->w) {
+        for (x = 0; x < f->w; runs++) {
+            x += vnc_tight_run_length32(row + x, f->w - x, row[x]);
+        }
+    }
+    return runs;
+}
+
+static uint32_t bench_gradient(const Frame *f, uint32_t *out)
+{
+    uint32_t sum = 0;
+    int y;
+
+    vnc_tight_gradient_row32(out, f->pixels, out + f->w, f->w);
+    for (y = 1; y < f->h; y++) {
+        vnc_tight_gradient_row32(out, f->pixels + y * f->w,
+                                 f->pixels + (y - 1) * f->w, f->w);
+        sum += out[y % f->w];
+    }
+    return sum;
+}
+
+typedef enum {
+    KERNEL_SOLID,
+    KERNEL_PALETTE,
+    KERNEL_GRADIENT,
+    KERNEL__MAX
+} Kernel;
+
+static const char *const kernel_names[KERNEL__MAX] = {
+    [KERNEL_SOLID] = "solid",
+    [KERNEL_PALETTE] = "palette",
+    [KERNEL_GRADIENT] = "gradient",
+};
+
+static size_t bench_one(Kernel k, const Frame *f, uint32_t *scratch)
+{
+    switch (k) {
+    case KERNEL_SOLID:
+        return bench_solid_tiles(f);
+    case KERNEL_PALETTE:
+        return bench_palette_runs(f);
+    case KERNEL_GRADIENT:
+        return bench_gradient(f, scratch);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void test_tight_speed(void)
+{
+    size_t *expected;
+    uint32_t **scratch;
+    double mpixels;
+    unsigned iters;
+    Frame *f;
+    Kernel k;
+    guint i;
+
+    expected = g_new(size_t, frames->len * KERNEL__MAX);
+    scratch = g_new(uint32_t *, frames->len);
+    for (i = 0; i < frames->len; i++) {
+        f = g_ptr_array_index(frames, i);
+        scratch[i] = g_new0(uint32_t, f->w * 2);
+        for (k = 0; k < KERNEL__MAX; k++) {
+            expected[i * KERNEL__MAX + k] = bench_one(k, f, scratch[i]);
+        }
+    }
+
+    do {
+        for (i = 0; i < frames->len; i++) {
+            f = g_ptr_array_index(frames, i);
+            mpixels = (double)f->w * f->h / 1e6;
+            for (k = 0; k < KERNEL__MAX; k++) {
+                /* Every implementation must agree with the first one.  */
+                g_assert_cmpuint(bench_one(k, f, scratch[i]), ==,
+                                 expected[i * KERNEL__MAX + k]);
+
+                iters = 0;
+                g_test_timer_start();
+                do {
+                    bench_one(k, f, scratch[i]);
+                    iters++;
+                } while (g_test_timer_elapsed() < 1.0);
+
+                g_print("%s %dx%d %s/%s: %.3f ms/Mpixel\n",
+                        f->name, f->w, f->h, kernel_names[k],
+                        vnc_tight_accel_name(),
+                        g_test_timer_last() * 1e3 / (iters * mpixels));
+            }
+        }
+    } while (vnc_tight_accel_next());
+
+    for (i = 0; i < frames->len; i++) {
+        g_free(scratch[i]);
+    }
+    g_free(scratch);
+    g_free(expected);
+}
+
+int main(int argc, char **argv)
+{
+    Frame *f;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    frames = g_ptr_array_new();
+    for (i = 1; i < argc; i++) {
+        f = frame_load_ppm(argv[i]);
+        if (!f) {
+            return 1;
+        }
+        g_ptr_array_add(frames, f);
+    }
+    if (!frames->len) {
+        g_ptr_array_add(frames, frame_synthetic());
+    }
+
+    g_test_add_func("/vnc/tight/speed", test_tight_speed);
+
+    return g_test_run();
+}
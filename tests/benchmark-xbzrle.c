@@ -0,0 +1,123 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES  256
+
+typedef struct Pattern {
+    const char *name;
+    int runs;           /* dirty runs per page */
+    int run_len;        /* bytes per dirty run */
+    uint8_t *old_pages, *new_pages;
+} Pattern;
+
+static Pattern patterns[] = {
+    { "clean", 0, 0 },
+    { "sparse-bytes", 16, 1 },
+    { "sparse-words", 32, 8 },
+    { "cachelines", 8, 64 },
+    { "half", 1, PAGE_SIZE / 2 },
+};
+
+static void setup_pages(Pattern *p)
+{
+    int i, j, pos;
+
+    p->old_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    p->new_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+        p->old_pages[i] = g_test_rand_int();
+    }
+    memcpy(p->new_pages, p->old_pages, NR_PAGES * PAGE_SIZE);
+    for (i = 0; i < NR_PAGES; i++) {
+        for (j = 0; j < p->runs; j++) {
+            pos = g_test_rand_int_range(0, PAGE_SIZE - p->run_len + 1);
+            memset(p->new_pages + i * PAGE_SIZE + pos, 0x5a, p->run_len);
+        }
+    }
+}
+
+static void bench_pattern(const Pattern *p, int accel, uint8_t *compressed,
+                          int *dlen, uint8_t *page)
+{
+    double total, decode_total;
+    int i;
+
+    total = 0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            dlen[i] = xbzrle_encode_buffer(p->old_pages + i * PAGE_SIZE,
+                                           p->new_pages + i * PAGE_SIZE,
+                                           PAGE_SIZE,
+                                           compressed + i * PAGE_SIZE,
+                                           PAGE_SIZE);
+        }
+        total += NR_PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+    total /= MiB;
+    total /= g_test_timer_last();
+
+    decode_total = 0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            if (dlen[i] > 0) {
+                xbzrle_decode_buffer(compressed + i * PAGE_SIZE, dlen[i],
+                                     page, PAGE_SIZE);
+            }
+        }
+        decode_total += NR_PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+    decode_total /= MiB;
+    decode_total /= g_test_timer_last();
+
+    g_print("%s (encoder %d): encode %.2f MB/sec, decode %.2f MB/sec\n",
+            p->name, accel, total, decode_total);
+}
+
+/*
+ * Encoder 0 is the most preferred implementation for this host, the
+ * last one is the portable C version.
+ */
+static void test_xbzrle_speed(void)
+{
+    uint8_t *compressed = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    int *dlen = g_new(int, NR_PAGES);
+    int accel = 0;
+    size_t i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            bench_pattern(&patterns[i], accel, compressed, dlen, page);
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(dlen);
+    g_free(page);
+    g_free(compressed);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        setup_pages(&patterns[i]);
+    }
+    g_test_add_func("/xbzrle/speed", test_xbzrle_speed);
+
+    return g_test_run();
+}
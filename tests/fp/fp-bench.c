@@ -0,0 +1,189 @@
+/*
+ * softfloat speed benchmark
+ *
+ * Measures the float32 and float64 operations both on the host FPU fast path
+ * and on the softfloat path, and checks that they agree.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "fpu/softfloat.h"
+
+#define N_INPUTS 1024
+#define N_OPS    (10 * 1000 * 1000)
+
+typedef enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_FMA,
+    OP_SQRT,
+    OP_COUNT,
+} Op;
+
+static const char *const op_names[OP_COUNT] = {
+    [OP_ADD]  = "add",
+    [OP_SUB]  = "sub",
+    [OP_MUL]  = "mul",
+    [OP_DIV]  = "div",
+    [OP_FMA]  = "fma",
+    [OP_SQRT] = "sqrt",
+};
+
+typedef struct BenchCase {
+    Op op;
+    bool f64;
+} BenchCase;
+
+static float32 f32_inputs[N_INPUTS];
+static float64 f64_inputs[N_INPUTS];
+
+/* Positive normal numbers, so that no operation needs special handling */
+static void fill_inputs(void)
+{
+    int i;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        union {
+            float h;
+            float32 s;
+        } u32;
+        union {
+            double h;
+            float64 s;
+        } u64;
+
+        u32.h = g_test_rand_double_range(1.0, 1000.0);
+        u64.h = g_test_rand_double_range(1.0, 1000.0);
+        f32_inputs[i] = u32.s;
+        f64_inputs[i] = u64.s;
+    }
+}
+
+static inline float32 run_f32(Op op, float32 a, float32 b, float32 c,
+                              float_status *s)
+{
+    switch (op) {
+    case OP_ADD:
+        return float32_add(a, b, s);
+    case OP_SUB:
+        return float32_sub(a, b, s);
+    case OP_MUL:
+        return float32_mul(a, b, s);
+    case OP_DIV:
+        return float32_div(a, b, s);
+    case OP_FMA:
+        return float32_muladd(a, b, c, 0, s);
+    case OP_SQRT:
+        return float32_sqrt(a, s);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static inline float64 run_f64(Op op, float64 a, float64 b, float64 c,
+                              float_status *s)
+{
+    switch (op) {
+    case OP_ADD:
+        return float64_add(a, b, s);
+    case OP_SUB:
+        return float64_sub(a, b, s);
+    case OP_MUL:
+        return float64_mul(a, b, s);
+    case OP_DIV:
+        return float64_div(a, b, s);
+    case OP_FMA:
+        return float64_muladd(a, b, c, 0, s);
+    case OP_SQRT:
+        return float64_sqrt(a, s);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static uint64_t run_one(const BenchCase *bc, int i, float_status *s)
+{
+    int a = i % N_INPUTS;
+    int b = (i + 1) % N_INPUTS;
+    int c = (i + 2) % N_INPUTS;
+
+    if (bc->f64) {
+        return run_f64(bc->op, f64_inputs[a], f64_inputs[b], f64_inputs[c],
+                       s);
+    } else {
+        return run_f32(bc->op, f32_inputs[a], f32_inputs[b], f32_inputs[c],
+                       s);
+    }
+}
+
+/*
+ * softfloat only uses the host FPU when the inexact flag is already set;
+ * clearing the flags before every operation forces the softfloat path.
+ */
+static double bench(const BenchCase *bc, bool hard)
+{
+    float_status s = { 0 };
+    uint64_t sink = 0;
+    double elapsed;
+    int i;
+
+    set_float_rounding_mode(float_round_nearest_even, &s);
+    g_test_timer_start();
+    for (i = 0; i < N_OPS; i++) {
+        s.float_exception_flags = hard ? float_flag_inexact : 0;
+        sink ^= run_one(bc, i, &s);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    /* Keep the compiler from dropping the loop */
+    g_assert(sink != 1);
+    return N_OPS / elapsed / 1e6;
+}
+
+static void test_fp_op(const void *opaque)
+{
+    const BenchCase *bc = opaque;
+    float_status hard = { 0 }, soft = { 0 };
+    double hard_mflops, soft_mflops;
+    int i;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        hard.float_exception_flags = float_flag_inexact;
+        soft.float_exception_flags = 0;
+        g_assert_cmphex(run_one(bc, i, &hard), ==, run_one(bc, i, &soft));
+        g_assert_cmphex(hard.float_exception_flags, ==,
+                        soft.float_exception_flags | float_flag_inexact);
+    }
+
+    hard_mflops = bench(bc, true);
+    soft_mflops = bench(bc, false);
+
+    g_print("%s %-4s: hardfloat %8.2f MFlops, softfloat %8.2f MFlops\n",
+            bc->f64 ? "float64" : "float32", op_names[bc->op],
+            hard_mflops, soft_mflops);
+}
+
+int main(int argc, char **argv)
+{
+    BenchCase cases[2 * OP_COUNT];
+    char *path;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    fill_inputs();
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        cases[i].op = i % OP_COUNT;
+        cases[i].f64 = i >= OP_COUNT;
+        path = g_strdup_printf("/fp-bench/%s/%s",
+                               cases[i].f64 ? "f64" : "f32",
+                               op_names[cases[i].op]);
+        g_test_add_data_func(path, &cases[i], test_fp_op);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
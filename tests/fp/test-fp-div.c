@@ -0,0 +1,97 @@
+/*
+ * softfloat division tests
+ *
+ * Checks float32_div and float64_div on the softfloat path against known
+ * correctly rounded results, and against the host FPU for random inputs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <float.h>
+#include "fpu/softfloat.h"
+
+#define N_RANDOM (1000 * 1000)
+
+/* div128To64 gave a quotient one too large for these with a divisor whose
+ * msb was clear, and the result was rounded up by one ulp */
+static const struct {
+    uint64_t a, b, q;
+} f64_cases[] = {
+    { 0x3ff8cd54af717121ULL, 0x3ff17195d8f36cf0ULL, 0x3ff6bfd74b3d56e0ULL },
+    { 0x3ff4874530344498ULL, 0x3ff096a838f79865ULL, 0x3ff3ccd4b8b7a816ULL },
+    { 0x3ffa18c2ae08e1abULL, 0x3ff473a77e798b18ULL, 0x3ff46a8c1dfa3c6dULL },
+};
+
+/*
+ * softfloat only uses the host FPU when the inexact flag is already set;
+ * clearing the flags before every operation tests the softfloat code.
+ */
+static void test_f64_cases(void)
+{
+    float_status s = { 0 };
+    int i;
+
+    set_float_rounding_mode(float_round_nearest_even, &s);
+    for (i = 0; i < ARRAY_SIZE(f64_cases); i++) {
+        s.float_exception_flags = 0;
+        g_assert_cmphex(float64_div(make_float64(f64_cases[i].a),
+                                    make_float64(f64_cases[i].b), &s),
+                        ==, f64_cases[i].q);
+        g_assert_cmphex(s.float_exception_flags, ==, float_flag_inexact);
+    }
+}
+
+/* Quotients of numbers in [1, 2) are normal, so the host result is exact */
+static void test_f64_random(void)
+{
+    float_status s = { 0 };
+    int i;
+
+    set_float_rounding_mode(float_round_nearest_even, &s);
+    for (i = 0; i < N_RANDOM; i++) {
+        union {
+            double h;
+            float64 s;
+        } a, b, q;
+
+        a.h = g_test_rand_double_range(1.0, 2.0);
+        b.h = g_test_rand_double_range(1.0, 2.0);
+        q.h = a.h / b.h;
+        s.float_exception_flags = 0;
+        g_assert_cmphex(float64_div(a.s, b.s, &s), ==, q.s);
+    }
+}
+
+static void test_f32_random(void)
+{
+    float_status s = { 0 };
+    int i;
+
+    set_float_rounding_mode(float_round_nearest_even, &s);
+    for (i = 0; i < N_RANDOM; i++) {
+        union {
+            float h;
+            float32 s;
+        } a, b, q;
+
+        a.h = g_test_rand_double_range(1.0, 2.0);
+        b.h = g_test_rand_double_range(1.0, 2.0);
+        q.h = a.h / b.h;
+        s.float_exception_flags = 0;
+        g_assert_cmphex(float32_div(a.s, b.s, &s), ==, q.s);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/fp-div/f64/cases", test_f64_cases);
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    g_test_add_func("/fp-div/f64/random", test_f64_random);
+    g_test_add_func("/fp-div/f32/random", test_f32_random);
+#endif
+
+    return g_test_run();
+}
@@ -45,36 +45,40 @@ void timer_init_tl(QEMUTimer *ts,
     ts->expire_time = -1;
 }
 
-void timer_mod(QEMUTimer *ts, int64_t expire_time)
+static int timer_index(QEMUTimer *ts)
 {
-    QEMUTimerList *timer_list = ts->timer_list;
-    QEMUTimer *t = &timer_list->active_timers;
+    GPtrArray *timers = ts->timer_list->active_timers;
+    guint i;
 
-    while (t->next != NULL) {
-        if (t->next == ts) {
-            break;
+    for (i = 0; i < timers->len; i++) {
+        if (g_ptr_array_index(timers, i) == ts) {
+            return i;
         }
+    }
+
+    return -1;
+}
+
+bool ptimer_test_timer_is_active(QEMUTimer *ts)
+{
+    return timer_index(ts) >= 0;
+}
 
-        t = t->next;
+void timer_mod(QEMUTimer *ts, int64_t expire_time)
+{
+    if (timer_index(ts) < 0) {
+        g_ptr_array_add(ts->timer_list->active_timers, ts);
     }
 
     ts->expire_time = MAX(expire_time * ts->scale, 0);
-    ts->next = NULL;
-    t->next = ts;
 }
 
 void timer_del(QEMUTimer *ts)
 {
-    QEMUTimerList *timer_list = ts->timer_list;
-    QEMUTimer *t = &timer_list->active_timers;
+    int i = timer_index(ts);
 
-    while (t->next != NULL) {
-        if (t->next == ts) {
-            t->next = ts->next;
-            return;
-        }
-
-        t = t->next;
+    if (i >= 0) {
+        g_ptr_array_remove_index(ts->timer_list->active_timers, i);
     }
 }
 
@@ -85,18 +89,18 @@ int64_t qemu_clock_get_ns(QEMUClockType type)
 
 int64_t qemu_clock_deadline_ns_all(QEMUClockType type)
 {
-    QEMUTimerList *timer_list = main_loop_tlg.tl[type];
-    QEMUTimer *t = timer_list->active_timers.next;
+    GPtrArray *timers = main_loop_tlg.tl[type]->active_timers;
     int64_t deadline = -1;
+    QEMUTimer *t;
+    guint i;
 
-    while (t != NULL) {
+    for (i = 0; i < timers->len; i++) {
+        t = g_ptr_array_index(timers, i);
         if (deadline == -1) {
             deadline = t->expire_time;
         } else {
             deadline = MIN(deadline, t->expire_time);
         }
-
-        t = t->next;
     }
 
     return deadline;
@@ -27,20 +27,32 @@ static void ptimer_trigger(void *opaque)
 static void ptimer_test_expire_qemu_timers(int64_t expire_time,
                                            QEMUClockType type)
 {
-    QEMUTimerList *timer_list = main_loop_tlg.tl[type];
-    QEMUTimer *t = timer_list->active_timers.next;
-
-    while (t != NULL) {
+    GPtrArray *timers = main_loop_tlg.tl[type]->active_timers;
+    GPtrArray *expired = g_ptr_array_new();
+    QEMUTimer *t;
+    guint i;
+
+    /* The callbacks can re-arm or delete timers, so look at a copy */
+    for (i = 0; i < timers->len; i++) {
+        t = g_ptr_array_index(timers, i);
         if (t->expire_time == expire_time) {
-            timer_del(t);
+            g_ptr_array_add(expired, t);
+        }
+    }
 
-            if (t->cb != NULL) {
-                t->cb(t->opaque);
-            }
+    for (i = 0; i < expired->len; i++) {
+        t = g_ptr_array_index(expired, i);
+        if (!ptimer_test_timer_is_active(t)) {
+            continue;
         }
+        timer_del(t);
 
-        t = t->next;
+        if (t->cb != NULL) {
+            t->cb(t->opaque);
+        }
     }
+
+    g_ptr_array_free(expired, true);
 }
 
 static void ptimer_test_set_qemu_time_ns(int64_t ns)
@@ -819,6 +831,7 @@ int main(int argc, char **argv)
 
     for (i = 0; i < QEMU_CLOCK_MAX; i++) {
         main_loop_tlg.tl[i] = g_new0(QEMUTimerList, 1);
+        main_loop_tlg.tl[i]->active_timers = g_ptr_array_new();
     }
 
     add_all_ptimer_policies_comb_tests();
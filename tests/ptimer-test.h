@@ -16,7 +16,9 @@ extern bool qtest_allowed;
 extern int64_t ptimer_test_time_ns;
 
 struct QEMUTimerList {
-    QEMUTimer active_timers;
+    GPtrArray *active_timers;
 };
 
+bool ptimer_test_timer_is_active(QEMUTimer *ts);
+
 #endif
@@ -0,0 +1,128 @@
+/*
+ * x86 flags benchmark - integer loops whose condition codes are consumed
+ * by the next translation block.
+ *
+ * The results are printed on stdout and must not depend on how QEMU
+ * translates the loops; the time taken by each loop is printed on
+ * stderr.  The 'run-bench-i386-flags-tb-cc-op' make target compares the
+ * results with the x-tb-cc-op CPU property enabled and disabled.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define WORDS   64
+#define ROUNDS  100000
+
+static uint32_t a[WORDS], b[WORDS];
+
+/* a += b as a WORDS * 32 bit number: ADC consumes the carry across DEC/JNZ */
+static uint32_t bench_adc(void)
+{
+    uint32_t sum = 0;
+    int i, j;
+
+    for (i = 0; i < ROUNDS; i++) {
+        uint32_t *pa = a, *pb = b;
+        uint32_t n = WORDS, tmp;
+
+        asm volatile("clc\n"
+                     "1:\n\t"
+                     "mov (%1), %3\n\t"
+                     "adc %3, (%0)\n\t"
+                     "lea 4(%0), %0\n\t"
+                     "lea 4(%1), %1\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b\n"
+                     : "+r" (pa), "+r" (pb), "+r" (n), "=&r" (tmp)
+                     : : "memory", "cc");
+    }
+    for (j = 0; j < WORDS; j++) {
+        sum ^= a[j] + j;
+    }
+    return sum;
+}
+
+/* SETcc and CMOVcc at the branch targets consume the CMP of the branch */
+static uint32_t bench_setcc(void)
+{
+    uint32_t x = 1, below = 0, above = 0;
+    int i;
+
+    for (i = 0; i < ROUNDS * WORDS; i++) {
+        uint32_t t;
+
+        x = x * 1103515245 + 12345;
+        asm("xor %1, %1\n\t"
+            "cmp $0x80000000, %3\n\t"
+            "jae 1f\n\t"
+            "setb %b1\n\t"
+            "add %1, %0\n\t"
+            "jmp 2f\n"
+            "1:\n\t"
+            "setae %b1\n\t"
+            "add %1, %2\n"
+            "2:\n\t"
+            "cmovz %3, %1\n"
+            : "+r" (below), "=&q" (t), "+r" (above)
+            : "r" (x)
+            : "cc");
+        below ^= t;
+    }
+    return below * 31 + above;
+}
+
+/* Plain counted loop, the flags of DEC are only used by JNZ */
+static uint32_t bench_loop(void)
+{
+    uint32_t x = 0, n = ROUNDS * WORDS;
+
+    asm("1:\n\t"
+        "add %1, %0\n\t"
+        "rol $3, %0\n\t"
+        "xor $0x5a5a5a5a, %0\n\t"
+        "dec %1\n\t"
+        "jnz 1b\n"
+        : "+r" (x), "+r" (n) : : "cc");
+    return x;
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*fn)(void);
+} benchmarks[] = {
+    { "adc", bench_adc },
+    { "setcc", bench_setcc },
+    { "loop", bench_loop },
+};
+
+int main(void)
+{
+    struct timespec start, end;
+    int i;
+
+    for (i = 0; i < WORDS; i++) {
+        a[i] = i * 0x9e3779b9;
+        b[i] = ~a[i] + (i & 1);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+        uint32_t result;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = benchmarks[i].fn();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("%s: %08x\n", benchmarks[i].name, result);
+        fprintf(stderr, "%s: %.3f s\n", benchmarks[i].name,
+                (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    return 0;
+}
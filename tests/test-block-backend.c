@@ -26,6 +26,8 @@
 #include "block/block.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/cutils.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
 {
@@ -67,6 +69,167 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+static void test_merge_cb(void *opaque, int ret)
+{
+    int *completed = opaque;
+
+    g_assert(ret == 0);
+    (*completed)++;
+}
+
+static void test_merge_requests(bool drain)
+{
+    BlockBackend *blk;
+    QDict *options;
+    QEMUIOVector qiov[6];
+    uint8_t buf[512];
+    int completed = 0;
+    int i;
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "null-co");
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk_set_request_merging(blk, true);
+
+    for (i = 0; i < ARRAY_SIZE(qiov); i++) {
+        qemu_iovec_init(&qiov[i], 1);
+        qemu_iovec_add(&qiov[i], buf, sizeof(buf));
+    }
+
+    /* Two runs of three contiguous writes, submitted out of order */
+    blk_aio_pwritev(blk, 1024, &qiov[0], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 0, &qiov[1], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 8192, &qiov[2], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 512, &qiov[3], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 8704, &qiov[4], 0, test_merge_cb, &completed);
+    blk_aio_pwritev(blk, 9216, &qiov[5], 0, test_merge_cb, &completed);
+    g_assert_cmpint(completed, ==, 0);
+
+    if (drain) {
+        blk_drain(blk);
+    } else {
+        while (completed < ARRAY_SIZE(qiov)) {
+            aio_poll(blk_get_aio_context(blk), true);
+        }
+    }
+    g_assert_cmpint(completed, ==, ARRAY_SIZE(qiov));
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_WRITE], ==, 4);
+
+    for (i = 0; i < ARRAY_SIZE(qiov); i++) {
+        qemu_iovec_destroy(&qiov[i]);
+    }
+    blk_unref(blk);
+}
+
+static void test_merge_cancel_cb(void *opaque, int ret)
+{
+    int *result = opaque;
+
+    *result = ret;
+}
+
+static void test_merge_cancel(void)
+{
+    BlockBackend *blk;
+    BlockAIOCB *acb;
+    QDict *options;
+    QEMUIOVector qiov[2];
+    uint8_t buf[512];
+    int ret[2] = { 1, 1 };
+    int i;
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "null-co");
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk_set_request_merging(blk, true);
+
+    for (i = 0; i < ARRAY_SIZE(qiov); i++) {
+        qemu_iovec_init(&qiov[i], 1);
+        qemu_iovec_add(&qiov[i], buf, sizeof(buf));
+    }
+
+    /* The first request is cancelled while it is still queued */
+    acb = blk_aio_pwritev(blk, 0, &qiov[0], 0, test_merge_cancel_cb, &ret[0]);
+    blk_aio_pwritev(blk, 512, &qiov[1], 0, test_merge_cancel_cb, &ret[1]);
+    blk_aio_cancel_async(acb);
+    g_assert_cmpint(ret[0], ==, 1);
+
+    blk_drain(blk);
+    g_assert_cmpint(ret[0], ==, -ECANCELED);
+    g_assert_cmpint(ret[1], ==, 0);
+    g_assert_cmpint(blk_get_stats(blk)->merged[BLOCK_ACCT_WRITE], ==, 0);
+
+    for (i = 0; i < ARRAY_SIZE(qiov); i++) {
+        qemu_iovec_destroy(&qiov[i]);
+    }
+    blk_unref(blk);
+}
+
+static void test_merge_requests_bh(void)
+{
+    test_merge_requests(false);
+}
+
+static void test_merge_requests_drain(void)
+{
+    test_merge_requests(true);
+}
+
+static void test_yield_cb(void *opaque, int ret)
+{
+    int *completed = opaque;
+
+    g_assert(ret == 0);
+    (*completed)++;
+}
+
+/*
+ * Requests whose coroutines yield in the driver, while they sleep for the
+ * latency, complete through both the AIO and the synchronous interfaces.
+ */
+static void test_yield_in_entry(void)
+{
+    BlockBackend *blk;
+    QDict *options;
+    QEMUIOVector qiov;
+    uint8_t buf[512];
+    int completed = 0;
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "null-co");
+    qdict_put_int(options, "latency-ns", 1000000);
+    qdict_put_bool(options, "read-zeroes", true);
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    qemu_iovec_init(&qiov, 1);
+    qemu_iovec_add(&qiov, buf, sizeof(buf));
+
+    /* blk_aio_read_entry() and blk_aio_write_entry() */
+    memset(buf, 0xa5, sizeof(buf));
+    blk_aio_preadv(blk, 0, &qiov, 0, test_yield_cb, &completed);
+    g_assert_cmpint(completed, ==, 0);
+    while (completed < 1) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    g_assert(buffer_is_zero(buf, sizeof(buf)));
+
+    blk_aio_pwritev(blk, 0, &qiov, 0, test_yield_cb, &completed);
+    g_assert_cmpint(completed, ==, 1);
+    while (completed < 2) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+
+    /* blk_read_entry() and blk_write_entry() */
+    memset(buf, 0xa5, sizeof(buf));
+    g_assert_cmpint(blk_pread(blk, 0, buf, sizeof(buf)), ==, sizeof(buf));
+    g_assert(buffer_is_zero(buf, sizeof(buf)));
+    g_assert_cmpint(blk_pwrite(blk, 0, buf, sizeof(buf), 0), ==,
+                    sizeof(buf));
+
+    qemu_iovec_destroy(&qiov);
+    blk_unref(blk);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -77,6 +240,11 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/merge_requests", test_merge_requests_bh);
+    g_test_add_func("/block-backend/merge_requests_drain",
+                    test_merge_requests_drain);
+    g_test_add_func("/block-backend/merge_cancel", test_merge_cancel);
+    g_test_add_func("/block-backend/yield_in_entry", test_yield_in_entry);
 
     return g_test_run();
 }
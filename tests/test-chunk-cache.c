@@ -0,0 +1,168 @@
+/*
+ * Chunk cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "qemu/option.h"
+#include "block/block.h"
+#include "block/chunk-cache.h"
+
+#define CHUNK_SIZE   4096
+#define SCRATCH_SIZE 1024
+#define NR_CHUNKS    16
+
+static QemuOptsList test_opts = {
+    .name = "test-chunk-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(test_opts.head),
+    .desc = {
+        CHUNK_CACHE_OPTS,
+        { /* end of list */ }
+    },
+};
+
+typedef struct TestData {
+    BlockDriverState *bs;
+    ChunkCache *cache;
+    const uint32_t *chunks;
+    int nr_chunks;
+    bool done;
+} TestData;
+
+static int loads;
+
+static int coroutine_fn test_load(BlockDriverState *bs, uint32_t chunk,
+                                  uint8_t *buf, uint8_t *scratch)
+{
+    g_assert(scratch != NULL);
+    memset(scratch, 0, SCRATCH_SIZE);
+    loads++;
+
+    /* Yield like a real load, so that readahead runs concurrently */
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 100000);
+
+    memset(buf, chunk, CHUNK_SIZE);
+    return 0;
+}
+
+static void coroutine_fn test_read_chunks_entry(void *opaque)
+{
+    TestData *d = opaque;
+    uint8_t *buf;
+    int i;
+
+    for (i = 0; i < d->nr_chunks; i++) {
+        g_assert_cmpint(chunk_cache_get(d->cache, d->chunks[i], &buf), ==, 0);
+        g_assert_cmpint(buf[0], ==, d->chunks[i]);
+        g_assert_cmpint(buf[CHUNK_SIZE - 1], ==, d->chunks[i]);
+        chunk_cache_put(d->cache, buf);
+
+        /* Let readahead finish, so that the statistics are predictable */
+        while (d->bs->in_flight) {
+            qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 100000);
+        }
+    }
+    d->done = true;
+}
+
+/*
+ * Reads @chunks in order from a cache of @cache_size bytes and checks the
+ * number of loads and the statistics.
+ */
+static void test_read_chunks(int cache_size, int readahead,
+                             const uint32_t *chunks, int nr_chunks,
+                             int expected_loads, uint64_t hits,
+                             uint64_t misses, uint64_t readahead_hits)
+{
+    BlockStatsSpecificChunkCache *stats;
+    TestData d = {
+        .chunks = chunks,
+        .nr_chunks = nr_chunks,
+    };
+    Coroutine *co;
+    QemuOpts *opts;
+    QDict *options;
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "raw");
+    qdict_put_str(options, "file.driver", "null-co");
+    d.bs = bdrv_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    opts = qemu_opts_create(&test_opts, NULL, 0, &error_abort);
+    qemu_opt_set_number(opts, CHUNK_CACHE_OPT_SIZE, cache_size,
+                        &error_abort);
+    qemu_opt_set_number(opts, CHUNK_CACHE_OPT_READAHEAD, readahead,
+                        &error_abort);
+    g_assert_cmpint(chunk_cache_create(d.bs, opts, test_load, NR_CHUNKS,
+                                       CHUNK_SIZE, SCRATCH_SIZE, &d.cache,
+                                       &error_abort), ==, 0);
+    qemu_opts_del(opts);
+
+    loads = 0;
+    co = qemu_coroutine_create(test_read_chunks_entry, &d);
+    qemu_coroutine_enter(co);
+    while (!d.done) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(loads, ==, expected_loads);
+
+    stats = chunk_cache_get_stats(d.cache);
+    g_assert_cmpint(stats->hits, ==, hits);
+    g_assert_cmpint(stats->misses, ==, misses);
+    g_assert_cmpint(stats->readahead_hits, ==, readahead_hits);
+    qapi_free_BlockStatsSpecificChunkCache(stats);
+
+    chunk_cache_destroy(d.cache);
+    bdrv_unref(d.bs);
+}
+
+static void test_eviction(void)
+{
+    /* Chunk 1 is the least recently used one when chunk 2 is loaded */
+    static const uint32_t chunks[] = { 0, 1, 0, 2, 0, 1 };
+
+    test_read_chunks(2 * CHUNK_SIZE, 0, chunks, ARRAY_SIZE(chunks),
+                     4, 2, 4, 0);
+}
+
+static void test_readahead(void)
+{
+    /*
+     * Reading chunk 0 loads chunks 1 and 2 ahead, and every following
+     * read one more.  The cache is full after chunk 3, so chunks 4 and 5
+     * take the place of chunks 0 and 1, which were already read.
+     */
+    static const uint32_t chunks[] = { 0, 1, 2, 3 };
+
+    test_read_chunks(4 * CHUNK_SIZE, 2, chunks, ARRAY_SIZE(chunks),
+                     6, 3, 1, 3);
+}
+
+static void test_readahead_no_room(void)
+{
+    /* A cache smaller than a chunk holds only the chunk being read */
+    static const uint32_t chunks[] = { 0, 1, 2 };
+
+    test_read_chunks(CHUNK_SIZE / 2, 2, chunks, ARRAY_SIZE(chunks),
+                     3, 0, 3, 0);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/chunk-cache/eviction", test_eviction);
+    g_test_add_func("/chunk-cache/readahead", test_readahead);
+    g_test_add_func("/chunk-cache/readahead_no_room",
+                    test_readahead_no_room);
+
+    return g_test_run();
+}
@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,188 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_cache_collisions(void)
+{
+    PageCache *cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t age = 10;
+    int i;
+
+    /* Pages 16 apart collide in a direct-mapped cache of 16 pages.  */
+    for (i = 0; i < 4; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * 16 * PAGE_SIZE, page, age),
+                        ==, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * 16 * PAGE_SIZE, age));
+        g_assert_cmpint(get_cached_data(cache, i * 16 * PAGE_SIZE)[0],
+                        ==, i);
+    }
+    g_assert(!cache_is_cached(cache, PAGE_SIZE, age));
+    g_assert(get_cached_data(cache, PAGE_SIZE) == NULL);
+
+    g_free(page);
+    cache_fini(cache);
+}
+
+static void test_cache_eviction(void)
+{
+    PageCache *cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t addr, age = 10;
+    int i;
+
+    /* Fill every way of one set.  */
+    for (i = 0; i < 16; i++) {
+        addr = (uint64_t)i * 16 * PAGE_SIZE;
+        if (cache_insert(cache, addr, page, age) < 0) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, >, 1);
+    g_assert_cmpint(i, <, 16);
+
+    /* While all of them are fresh, nothing is replaced...  */
+    addr = (uint64_t)i * 16 * PAGE_SIZE;
+    g_assert_cmpint(cache_insert(cache, addr, page, age + 1), ==, -1);
+
+    /* ...later the least recently used one goes.  */
+    g_assert(cache_is_cached(cache, 0, age));
+    age += 2;
+    g_assert_cmpint(cache_insert(cache, addr, page, age), ==, 1);
+    g_assert(cache_is_cached(cache, 0, age));
+    g_assert(cache_is_cached(cache, addr, age));
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, age));
+
+    g_free(page);
+    cache_fini(cache);
+}
+
+static void test_cache_resize(void)
+{
+    PageCache *cache = cache_init(64 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * PAGE_SIZE, page, 0), ==, 0);
+    }
+
+    /* Growing keeps everything.  */
+    g_assert_cmpint(cache_resize(cache, 256 * PAGE_SIZE, &error_abort),
+                    ==, 0);
+    for (i = 0; i < 64; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* Shrinking keeps the most recently used pages.  */
+    for (i = 48; i < 64; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 1));
+    }
+    g_assert_cmpint(cache_resize(cache, 16 * PAGE_SIZE, &error_abort),
+                    ==, 0);
+    for (i = 0; i < 64; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 1) == (i >= 48));
+    }
+    g_assert_cmpint(get_cached_data(cache, 50 * PAGE_SIZE)[0], ==, 50);
+
+    /* Invalid sizes leave the cache alone.  */
+    g_assert_cmpint(cache_resize(cache, 3 * PAGE_SIZE, &err), ==, -1);
+    error_free_or_abort(&err);
+    g_assert(cache_is_cached(cache, 50 * PAGE_SIZE, 1));
+
+    g_free(page);
+    cache_fini(cache);
+}
+
+#define FUZZ_PAGES 512
+
+/*
+ * Dirty a page with runs whose length depends on @kind: single bytes,
+ * short runs, longer runs, or most of the page.
+ */
+static void fuzz_dirty_page(uint8_t *page, int kind)
+{
+    int runs = g_test_rand_int_range(0, kind == 3 ? 8 : 256);
+    int max_len = kind == 0 ? 1 : kind == 1 ? 16 : kind == 2 ? 256 : PAGE_SIZE;
+    int i, pos, len;
+
+    for (i = 0; i < runs; i++) {
+        pos = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        len = MIN(len, PAGE_SIZE - pos);
+        while (len--) {
+            page[pos++] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/*
+ * Encode random pages with every available implementation of
+ * xbzrle_encode_buffer, including with a too small output buffer.
+ * Each implementation must produce the same result as the previous
+ * one, and the last one is the portable C version.
+ */
+static void test_encode_fuzz(void)
+{
+    uint8_t *old = g_malloc(FUZZ_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(FUZZ_PAGES * PAGE_SIZE);
+    uint8_t *expected = g_malloc(FUZZ_PAGES * PAGE_SIZE);
+    int *expected_len = g_new(int, FUZZ_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    bool first = true;
+    int i, j, dlen, rc;
+
+    for (i = 0; i < FUZZ_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, FUZZ_PAGES * PAGE_SIZE);
+    for (i = 0; i < FUZZ_PAGES; i++) {
+        fuzz_dirty_page(new + i * PAGE_SIZE, i % 4);
+    }
+
+    do {
+        for (i = 0; i < FUZZ_PAGES; i++) {
+            uint8_t *o = old + i * PAGE_SIZE;
+            uint8_t *n = new + i * PAGE_SIZE;
+
+            /* Must be the same for every implementation.  */
+            dlen = (i & 1) ? PAGE_SIZE : 2 + (i * 131) % 510;
+            j = i * PAGE_SIZE;
+            rc = xbzrle_encode_buffer(o, n, PAGE_SIZE, compressed, dlen);
+            if (first) {
+                expected_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(expected + j, compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, expected_len[i]);
+                g_assert(rc <= 0 || !memcmp(expected + j, compressed, rc));
+            }
+
+            if (rc > 0) {
+                memcpy(decoded, o, PAGE_SIZE);
+                rc = xbzrle_decode_buffer(compressed, rc, decoded, PAGE_SIZE);
+                g_assert(rc > 0);
+                g_assert(memcmp(decoded, n, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(expected_len);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +370,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/cache_collisions", test_cache_collisions);
+    g_test_add_func("/xbzrle/cache_eviction", test_cache_eviction);
+    g_test_add_func("/xbzrle/cache_resize", test_cache_resize);
+    g_test_add_func("/xbzrle/encode_fuzz", test_encode_fuzz);
 
     return g_test_run();
 }
@@ -0,0 +1,334 @@
+/*
+ * QEMU VNC display driver: vectorized helpers for tight encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "vnc-enc-tight-accel.h"
+
+static size_t
+run_length32_int(const uint32_t *p, size_t count, uint32_t c)
+{
+    size_t i;
+
+    for (i = 0; i < count && p[i] == c; i++) {
+        continue;
+    }
+    return i;
+}
+
+static inline uint32_t gradient_pixel(uint32_t here, uint32_t left,
+                                      uint32_t upper, uint32_t upperleft)
+{
+    uint32_t diff = 0;
+    int shift, prediction;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        prediction = (int)(left >> shift & 0xFF) +
+                     (int)(upper >> shift & 0xFF) -
+                     (int)(upperleft >> shift & 0xFF);
+        prediction = MIN(MAX(prediction, 0), 0xFF);
+        diff |= (((here >> shift) - prediction) & 0xFF) << shift;
+    }
+    return diff;
+}
+
+static void
+gradient_row32_int(uint32_t *out, const uint32_t *cur,
+                   const uint32_t *up, size_t w)
+{
+    size_t x;
+
+    if (w == 0) {
+        return;
+    }
+    out[0] = gradient_pixel(cur[0], 0, up[0], 0);
+    for (x = 1; x < w; x++) {
+        out[x] = gradient_pixel(cur[x], cur[x - 1], up[x], up[x - 1]);
+    }
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static size_t
+run_length32_sse2(const uint32_t *p, size_t count, uint32_t c)
+{
+    __m128i v = _mm_set1_epi32(c);
+    size_t i;
+    int m;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi32(
+                _mm_loadu_si128((const __m128i *)(p + i)), v));
+        if (unlikely(m != 0xFFFF)) {
+            return i + cto32(m) / 4;
+        }
+    }
+    return i + run_length32_int(p + i, count - i, c);
+}
+
+/*
+ * Four pixels at a time: widen the bytes to 16 bits, compute the
+ * prediction there and let the unsigned saturating pack clamp it
+ * to 0..255.
+ */
+static void
+gradient_row32_sse2(uint32_t *out, const uint32_t *cur,
+                    const uint32_t *up, size_t w)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i h, l, u, ul, lo, hi;
+    size_t x;
+
+    if (w == 0) {
+        return;
+    }
+    out[0] = gradient_pixel(cur[0], 0, up[0], 0);
+    for (x = 1; x + 4 <= w; x += 4) {
+        h = _mm_loadu_si128((const __m128i *)(cur + x));
+        l = _mm_loadu_si128((const __m128i *)(cur + x - 1));
+        u = _mm_loadu_si128((const __m128i *)(up + x));
+        ul = _mm_loadu_si128((const __m128i *)(up + x - 1));
+
+        lo = _mm_sub_epi16(_mm_add_epi16(_mm_unpacklo_epi8(l, zero),
+                                         _mm_unpacklo_epi8(u, zero)),
+                           _mm_unpacklo_epi8(ul, zero));
+        hi = _mm_sub_epi16(_mm_add_epi16(_mm_unpackhi_epi8(l, zero),
+                                         _mm_unpackhi_epi8(u, zero)),
+                           _mm_unpackhi_epi8(ul, zero));
+        _mm_storeu_si128((__m128i *)(out + x),
+                         _mm_sub_epi8(h, _mm_packus_epi16(lo, hi)));
+    }
+    for (; x < w; x++) {
+        out[x] = gradient_pixel(cur[x], cur[x - 1], up[x], up[x - 1]);
+    }
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t
+run_length32_avx2(const uint32_t *p, size_t count, uint32_t c)
+{
+    __m256i v = _mm256_set1_epi32(c);
+    __m256i t0, t1;
+    size_t i;
+    uint32_t m;
+
+    /* Two vectors per iteration, solid areas are usually long.  */
+    for (i = 0; i + 16 <= count; i += 16) {
+        t0 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p + i)),
+                                v);
+        t1 = _mm256_cmpeq_epi32(
+                _mm256_loadu_si256((const __m256i *)(p + i + 8)), v);
+        if (unlikely(!_mm256_testc_si256(_mm256_and_si256(t0, t1),
+                                         _mm256_set1_epi32(-1)))) {
+            m = _mm256_movemask_epi8(t0);
+            if (m != 0xFFFFFFFFu) {
+                return i + cto32(m) / 4;
+            }
+            m = _mm256_movemask_epi8(t1);
+            return i + 8 + cto32(m) / 4;
+        }
+    }
+    for (; i + 8 <= count; i += 8) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+                _mm256_loadu_si256((const __m256i *)(p + i)), v));
+        if (m != 0xFFFFFFFFu) {
+            return i + cto32(m) / 4;
+        }
+    }
+    return i + run_length32_int(p + i, count - i, c);
+}
+
+/*
+ * Same as the SSE2 version, eight pixels at a time.  Unpack and pack
+ * both operate within 128-bit lanes, so the pixel order is preserved.
+ */
+static void
+gradient_row32_avx2(uint32_t *out, const uint32_t *cur,
+                    const uint32_t *up, size_t w)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i h, l, u, ul, lo, hi;
+    size_t x;
+
+    if (w == 0) {
+        return;
+    }
+    out[0] = gradient_pixel(cur[0], 0, up[0], 0);
+    for (x = 1; x + 8 <= w; x += 8) {
+        h = _mm256_loadu_si256((const __m256i *)(cur + x));
+        l = _mm256_loadu_si256((const __m256i *)(cur + x - 1));
+        u = _mm256_loadu_si256((const __m256i *)(up + x));
+        ul = _mm256_loadu_si256((const __m256i *)(up + x - 1));
+
+        lo = _mm256_sub_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(l, zero),
+                                               _mm256_unpacklo_epi8(u, zero)),
+                              _mm256_unpacklo_epi8(ul, zero));
+        hi = _mm256_sub_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(l, zero),
+                                               _mm256_unpackhi_epi8(u, zero)),
+                              _mm256_unpackhi_epi8(ul, zero));
+        _mm256_storeu_si256((__m256i *)(out + x),
+                            _mm256_sub_epi8(h, _mm256_packus_epi16(lo, hi)));
+    }
+    for (; x < w; x++) {
+        out[x] = gradient_pixel(cur[x], cur[x - 1], up[x], up[x - 1]);
+    }
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for vnc_tight_accel_next, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE          0
+# define INIT_RUN_LENGTH     run_length32_int
+# define INIT_GRADIENT_ROW   gradient_row32_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE          CACHE_SSE2
+# define INIT_RUN_LENGTH     run_length32_sse2
+# define INIT_GRADIENT_ROW   gradient_row32_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static size_t (*run_length32_accel)(const uint32_t *, size_t, uint32_t) =
+    INIT_RUN_LENGTH;
+static void (*gradient_row32_accel)(uint32_t *, const uint32_t *,
+                                    const uint32_t *, size_t) =
+    INIT_GRADIENT_ROW;
+static const char *accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    run_length32_accel = run_length32_int;
+    gradient_row32_accel = gradient_row32_int;
+    accel_name = "int";
+    if (cache & CACHE_SSE2) {
+        run_length32_accel = run_length32_sse2;
+        gradient_row32_accel = gradient_row32_sse2;
+        accel_name = "sse2";
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        run_length32_accel = run_length32_avx2;
+        gradient_row32_accel = gradient_row32_avx2;
+        accel_name = "avx2";
+    }
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#else
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    init_accel(cpuid_cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool vnc_tight_accel_next(void)
+{
+    /* If no bits set, we just tested the C version, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define run_length32_accel    run_length32_int
+#define gradient_row32_accel  gradient_row32_int
+static const char *accel_name = "int";
+
+bool vnc_tight_accel_next(void)
+{
+    return false;
+}
+#endif
+
+const char *vnc_tight_accel_name(void)
+{
+    return accel_name;
+}
+
+size_t vnc_tight_run_length32(const uint32_t *p, size_t count, uint32_t c)
+{
+    size_t i;
+
+    /* Most runs in a palette scan are short; do not bother with
+       vectors until a few pixels have matched.  */
+    for (i = 0; i < count && i < 4; i++) {
+        if (p[i] != c) {
+            return i;
+        }
+    }
+    if (i == count) {
+        return i;
+    }
+    return i + run_length32_accel(p + i, count - i, c);
+}
+
+void vnc_tight_gradient_row32(uint32_t *out, const uint32_t *cur,
+                              const uint32_t *up, size_t w)
+{
+    gradient_row32_accel(out, cur, up, w);
+}
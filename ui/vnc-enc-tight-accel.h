@@ -0,0 +1,41 @@
+/*
+ * QEMU VNC display driver: vectorized helpers for tight encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef VNC_ENC_TIGHT_ACCEL_H
+#define VNC_ENC_TIGHT_ACCEL_H
+
+/*
+ * Return the number of leading pixels of @p[0..count) that are equal
+ * to @c.  Used to find solid tiles and to skip runs of a single color
+ * while building palettes.
+ */
+size_t vnc_tight_run_length32(const uint32_t *p, size_t count, uint32_t c);
+
+/*
+ * Compute the "gradient" filter residual of a row of 32-bit pixels,
+ * independently for each of the four bytes of a pixel: every byte of
+ * @out[x] is @cur[x] minus the prediction cur[x-1] + up[x] - up[x-1],
+ * clamped to 0..255.  Pixels left of the row are treated as zero.
+ *
+ * This matches tight_filter_gradient24() whenever the color components
+ * are byte-aligned.
+ */
+void vnc_tight_gradient_row32(uint32_t *out, const uint32_t *cur,
+                              const uint32_t *up, size_t w);
+
+/*
+ * Switch to the next less preferred implementation of the functions
+ * above.  Returns false when the portable C version is already in use.
+ * Only meant for tests and benchmarks.
+ */
+bool vnc_tight_accel_next(void);
+
+/* Name of the implementation currently in use.  */
+const char *vnc_tight_accel_name(void);
+
+#endif /* VNC_ENC_TIGHT_ACCEL_H */
@@ -46,6 +46,7 @@
 #include "qemu/bswap.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
+#include "vnc-enc-tight-accel.h"
 #include "vnc-palette.h"
 
 /* Compression level stuff. The following array contains various
@@ -342,6 +343,23 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
 /*
  * Code to determine how many different colors used in rectangle.
  */
+#define DEFINE_RUN_LENGTH_FUNCTION(bpp)                                 \
+                                                                        \
+    static inline size_t                                                \
+    tight_run_length##bpp(const uint##bpp##_t *p, size_t count,         \
+                          uint##bpp##_t c) {                            \
+        size_t i;                                                       \
+                                                                        \
+        for (i = 0; i < count && p[i] == c; i++) {                      \
+            continue;                                                   \
+        }                                                               \
+        return i;                                                       \
+    }
+
+DEFINE_RUN_LENGTH_FUNCTION(8)
+DEFINE_RUN_LENGTH_FUNCTION(16)
+#define tight_run_length32 vnc_tight_run_length32
+
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
     static int                                                          \
@@ -356,9 +374,7 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         data = (uint##bpp##_t *)vs->tight.tight.buffer;                 \
                                                                         \
         c0 = data[0];                                                   \
-        i = 1;                                                          \
-        while (i < count && data[i] == c0)                              \
-            i++;                                                        \
+        i = 1 + tight_run_length##bpp(data + 1, count - 1, c0);         \
         if (i >= count) {                                               \
             *bg = *fg = c0;                                             \
             return 1;                                                   \
@@ -401,13 +417,13 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         palette_put(palette, ci);                                       \
                                                                         \
         for (i++; i < count; i++) {                                     \
-            if (data[i] == ci) {                                        \
-                continue;                                               \
-            } else {                                                    \
-                ci = data[i];                                           \
-                if (!palette_put(palette, (uint32_t)ci)) {              \
-                    return 0;                                           \
-                }                                                       \
+            i += tight_run_length##bpp(data + i, count - i, ci);        \
+            if (i >= count) {                                           \
+                break;                                                  \
+            }                                                           \
+            ci = data[i];                                               \
+            if (!palette_put(palette, (uint32_t)ci)) {                  \
+                return 0;                                               \
             }                                                           \
         }                                                               \
                                                                         \
@@ -542,17 +558,16 @@ DEFINE_MONO_ENCODE_FUNCTION(16)
 DEFINE_MONO_ENCODE_FUNCTION(32)
 
 /*
- * ``Gradient'' filter for 24-bit color samples.
- * Should be called only when redMax, greenMax and blueMax are 255.
- * Color components assumed to be byte-aligned.
+ * ``Gradient'' filter for 24-bit color samples that are not byte-aligned
+ * within the 32-bit pixel.
  */
 
 static void
-tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
+tight_filter_gradient24_unaligned(VncState *vs, uint8_t *buf, int w, int h,
+                                  const int *shift)
 {
     uint32_t *buf32;
     uint32_t pix32;
-    int shift[3];
     int *prev;
     int here[3], upper[3], left[3], upperleft[3];
     int prediction;
@@ -561,16 +576,6 @@ tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
     buf32 = (uint32_t *)buf;
     memset(vs->tight.gradient.buffer, 0, w * 3 * sizeof(int));
 
-    if (1 /* FIXME */) {
-        shift[0] = vs->client_pf.rshift;
-        shift[1] = vs->client_pf.gshift;
-        shift[2] = vs->client_pf.bshift;
-    } else {
-        shift[0] = 24 - vs->client_pf.rshift;
-        shift[1] = 24 - vs->client_pf.gshift;
-        shift[2] = 24 - vs->client_pf.bshift;
-    }
-
     for (y = 0; y < h; y++) {
         for (c = 0; c < 3; c++) {
             upper[c] = 0;
@@ -598,6 +603,57 @@ tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
     }
 }
 
+/*
+ * ``Gradient'' filter for 24-bit color samples.
+ * Should be called only when redMax, greenMax and blueMax are 255.
+ * Color components assumed to be byte-aligned.
+ */
+
+static void
+tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
+{
+    uint32_t *buf32;
+    uint32_t *upper, *diff;
+    int shift[3];
+    int x, y, c;
+
+    if (1 /* FIXME */) {
+        shift[0] = vs->client_pf.rshift;
+        shift[1] = vs->client_pf.gshift;
+        shift[2] = vs->client_pf.bshift;
+    } else {
+        shift[0] = 24 - vs->client_pf.rshift;
+        shift[1] = 24 - vs->client_pf.gshift;
+        shift[2] = 24 - vs->client_pf.bshift;
+    }
+
+    if ((shift[0] | shift[1] | shift[2]) & 7) {
+        tight_filter_gradient24_unaligned(vs, buf, w, h, shift);
+        return;
+    }
+
+    /*
+     * The residuals are computed a row at a time on whole pixels.  The
+     * packed output of a row overwrites the beginning of the same row,
+     * so keep an unfiltered copy of it for the prediction of the next
+     * one.
+     */
+    buf32 = (uint32_t *)buf;
+    upper = (uint32_t *)vs->tight.gradient.buffer;
+    diff = upper + w;
+    memset(upper, 0, w * sizeof(uint32_t));
+
+    for (y = 0; y < h; y++) {
+        vnc_tight_gradient_row32(diff, buf32, upper, w);
+        memcpy(upper, buf32, w * sizeof(uint32_t));
+        buf32 += w;
+        for (x = 0; x < w; x++) {
+            for (c = 0; c < 3; c++) {
+                *buf++ = diff[x] >> shift[c];
+            }
+        }
+    }
+}
 
 /*
  * ``Gradient'' filter for other color depths.
@@ -680,7 +736,7 @@ check_solid_tile32(VncState *vs, int x, int y, int w, int h,
     VncDisplay *vd = vs->vd;
     uint32_t *fbptr;
     uint32_t c;
-    int dx, dy;
+    int dy;
 
     fbptr = vnc_server_fb_ptr(vd, x, y);
 
@@ -690,10 +746,8 @@ check_solid_tile32(VncState *vs, int x, int y, int w, int h,
     }
 
     for (dy = 0; dy < h; dy++) {
-        for (dx = 0; dx < w; dx++) {
-            if (c != fbptr[dx]) {
-                return false;
-            }
+        if (vnc_tight_run_length32(fbptr, w, c) != w) {
+            return false;
         }
         fbptr = (uint32_t *)
             ((uint8_t *)fbptr + vnc_server_fb_stride(vd));
@@ -0,0 +1,190 @@
+/*
+ * Asyncify coroutine initialization code for Emscripten
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+/*
+ * WebAssembly has no way to switch stacks, so coroutines are implemented
+ * with Binaryen's Asyncify transform instead.  A coroutine is not run on a
+ * stack of its own; entering it simply calls its entry function from
+ * qemu_coroutine_switch().  Yielding unwinds the wasm frames of the
+ * coroutine, saving their locals into a per-coroutine buffer, until control
+ * reaches coroutine_asyncify_enter() again.  The next entry rewinds the
+ * saved frames and continues after the yield.
+ *
+ * Only the frames between the entry function and the yield are ever
+ * unwound, so only functions that can be on that path are instrumented.
+ * emscripten/gen_asyncify_list.py finds them from the coroutine entry
+ * points and passes them to the linker as ASYNCIFY_ADD; indirect calls are
+ * ignored, so function pointers that can yield must be declared
+ * coroutine_fn.  The enter side below is passed as ASYNCIFY_REMOVE, so that
+ * the code entering coroutines runs without instrumentation.
+ *
+ * Locals that live in linear memory are not saved by Asyncify, so each
+ * coroutine still gets its own C stack.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+#include "qemu/units.h"
+
+#define ASYNCIFY_DATA_SIZE (64 * KiB)
+
+/* Resolved by the Asyncify pass to its own runtime functions */
+#define ASYNCIFY_IMPORT(name) \
+    __attribute__((import_module("asyncify"), import_name(#name)))
+
+ASYNCIFY_IMPORT(start_unwind) void asyncify_start_unwind(void *data);
+ASYNCIFY_IMPORT(stop_unwind) void asyncify_stop_unwind(void);
+ASYNCIFY_IMPORT(start_rewind) void asyncify_start_rewind(void *data);
+ASYNCIFY_IMPORT(stop_rewind) void asyncify_stop_rewind(void);
+
+/* Provided by compiler-rt, they access the C stack pointer */
+uintptr_t stackSave(void);
+void stackRestore(uintptr_t sp);
+
+typedef struct {
+    Coroutine base;
+    void *stack;
+    size_t stack_size;
+
+    /* Stack pointer of the innermost frame when the coroutine yielded */
+    uintptr_t sp;
+
+    /* True between yielding and being entered again */
+    bool suspended;
+
+    /* Layout expected by asyncify_start_unwind()/asyncify_start_rewind() */
+    struct {
+        void *pos;
+        void *end;
+    } data;
+    void *data_buf;
+} CoroutineAsyncify;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsyncify leader;
+static __thread Coroutine *current;
+
+/*
+ * Called twice for every yield: once to start unwinding, and once more
+ * when the coroutine is rewound to the same point by the next entry.
+ */
+static void __attribute__((noinline))
+coroutine_asyncify_suspend(CoroutineAsyncify *co)
+{
+    if (!co->suspended) {
+        co->sp = stackSave();
+        co->data.pos = co->data_buf;
+        co->data.end = co->data_buf + ASYNCIFY_DATA_SIZE;
+        co->suspended = true;
+        asyncify_start_unwind(&co->data);
+    } else {
+        asyncify_stop_rewind();
+        co->suspended = false;
+    }
+}
+
+/*
+ * The outermost instrumented frame.  Unwinding stops when it returns,
+ * and rewinding starts by calling it again.
+ */
+static void __attribute__((noinline))
+coroutine_asyncify_trampoline(CoroutineAsyncify *co)
+{
+    co->base.entry(co->base.entry_arg);
+}
+
+/*
+ * Runs the coroutine until it yields or terminates.  This function must
+ * not be instrumented, so that unwinding ends here instead of continuing
+ * into the caller's frames; it is in the ASYNCIFY_REMOVE list.
+ */
+static CoroutineAction __attribute__((noinline))
+coroutine_asyncify_enter(CoroutineAsyncify *co)
+{
+    Coroutine *caller = current;
+    uintptr_t caller_sp = stackSave();
+
+    current = &co->base;
+    if (co->suspended) {
+        stackRestore(co->sp);
+        asyncify_start_rewind(&co->data);
+    } else {
+        stackRestore((uintptr_t)co->stack + co->stack_size);
+    }
+
+    coroutine_asyncify_trampoline(co);
+
+    if (co->suspended) {
+        asyncify_stop_unwind();
+    }
+    stackRestore(caller_sp);
+    current = caller;
+
+    return co->suspended ? COROUTINE_YIELD : COROUTINE_TERMINATE;
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsyncify *co;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack_size = COROUTINE_STACK_SIZE;
+    co->stack = qemu_alloc_stack(&co->stack_size);
+    co->data_buf = g_malloc(ASYNCIFY_DATA_SIZE);
+
+    return &co->base;
+}
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsyncify *co = DO_UPCAST(CoroutineAsyncify, base, co_);
+
+    assert(!co->suspended);
+    g_free(co->data_buf);
+    qemu_free_stack(co->stack, co->stack_size);
+    g_free(co);
+}
+
+/*
+ * Marked noinline so that the yield path is not inlined into
+ * qemu_aio_coroutine_enter(), which is not instrumented.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsyncify *from = DO_UPCAST(CoroutineAsyncify, base, from_);
+    CoroutineAsyncify *to = DO_UPCAST(CoroutineAsyncify, base, to_);
+
+    switch (action) {
+    case COROUTINE_ENTER:
+        return coroutine_asyncify_enter(to);
+    case COROUTINE_YIELD:
+        /* to_ is our caller, waiting in coroutine_asyncify_enter() */
+        coroutine_asyncify_suspend(from);
+        return COROUTINE_ENTER;
+    default:
+        /* Coroutines terminate by returning from their entry function */
+        abort();
+    }
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
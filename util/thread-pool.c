@@ -28,6 +28,7 @@ static void do_spawn_thread(ThreadPool *pool);
 typedef struct ThreadPoolElement ThreadPoolElement;
 
 enum ThreadState {
+    THREAD_BATCHED,
     THREAD_QUEUED,
     THREAD_ACTIVE,
     THREAD_DONE,
@@ -40,15 +41,22 @@ struct ThreadPoolElement {
     void *arg;
 
     /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+     * that, only the worker thread can write to it.  The worker publishes
+     * state and ret by adding the element to done_list.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Links the element into submit_list while THREAD_BATCHED, into
+     * request_list while THREAD_QUEUED and into completion_list once it
+     * has been taken off done_list.  Only request_list is protected by
+     * lock, the other two are only accessed from the pool's AioContext.
+     */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Lock-free list of finished requests, see thread_pool_complete().  */
+    QSLIST_ENTRY(ThreadPoolElement) done_next;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -56,14 +64,19 @@ struct ThreadPoolElement {
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
+    QEMUBH *submit_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
+    QemuSemaphore sem;   /* wakes up idle workers, one post per batch */
     int max_threads;
-    QEMUBH *new_thread_bh;
+
+    /* Requests finished by the workers, pushed with atomic operations */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QTAILQ_HEAD(, ThreadPoolElement) submit_list;
+    QTAILQ_HEAD(, ThreadPoolElement) completion_list;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
@@ -74,6 +87,19 @@ struct ThreadPool {
     bool stopping;
 };
 
+/* Can be called from any thread, without holding lock.  */
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    req->state = THREAD_DONE;
+
+    /* The atomic insertion orders the writes to ret and state before
+     * the completion BH can see the element.  req may be freed as soon
+     * as it is on the list.
+     */
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, req, done_next);
+    qemu_bh_schedule(pool->completion_bh);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -86,32 +112,37 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        do {
+        req = QTAILQ_FIRST(&pool->request_list);
+        if (!req) {
+            /* The semaphore is only a hint, so recheck the list after
+             * waking up; give up after 10 seconds without work.
+             */
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (ret == -1 && QTAILQ_EMPTY(&pool->request_list)) {
+                break;
+            }
+            continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
 
-        ret = req->func(req->arg);
+        /* A batch is submitted with a single wakeup, so pass it on if
+         * there is more work for the other idle threads.
+         */
+        if (!QTAILQ_EMPTY(&pool->request_list) && pool->idle_threads) {
+            qemu_sem_post(&pool->sem);
+        }
+        qemu_mutex_unlock(&pool->lock);
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+        req->ret = req->func(req->arg);
+        thread_pool_complete(pool, req);
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
     }
 
     pool->cur_threads--;
@@ -135,75 +166,98 @@ static void do_spawn_thread(ThreadPool *pool)
     qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
 }
 
-static void spawn_thread_bh_fn(void *opaque)
-{
-    ThreadPool *pool = opaque;
-
-    qemu_mutex_lock(&pool->lock);
-    do_spawn_thread(pool);
-    qemu_mutex_unlock(&pool->lock);
-}
-
 static void spawn_thread(ThreadPool *pool)
 {
     pool->cur_threads++;
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
-     * we don't spend time creating many threads in a loop holding a mutex or
-     * starving the current vcpu.
+     * we don't spend time creating many threads in a loop holding a mutex.
      *
-     * If there are no idle threads, ask the main thread to create one, so we
-     * inherit the correct affinity instead of the vcpu affinity.
+     * This runs in the pool's home thread (see thread_pool_submit_bh()),
+     * so the new thread inherits its affinity instead of the vcpu affinity.
      */
     if (!pool->pending_threads) {
-        qemu_bh_schedule(pool->new_thread_bh);
+        do_spawn_thread(pool);
     }
 }
 
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    QSLIST_HEAD(, ThreadPoolElement) reversed;
+    ThreadPoolElement *elem, *next, *newer = NULL;
 
-    aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    /* Append everything that finished since the last run to
+     * completion_list, in the order the requests completed.
+     */
+    QSLIST_MOVE_ATOMIC(&reversed, &pool->done_list);
+    QSLIST_FOREACH_SAFE(elem, &reversed, done_next, next) {
+        if (newer) {
+            QTAILQ_INSERT_BEFORE(newer, elem, reqs);
+        } else {
+            QTAILQ_INSERT_TAIL(&pool->completion_list, elem, reqs);
         }
+        newer = elem;
+    }
+
+    aio_context_acquire(pool->ctx);
+    while ((elem = QTAILQ_FIRST(&pool->completion_list))) {
+        QTAILQ_REMOVE(&pool->completion_list, elem, reqs);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QTAILQ_EMPTY(&pool->completion_list)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             aio_context_release(pool->ctx);
             elem->common.cb(elem->common.opaque, elem->ret);
             aio_context_acquire(pool->ctx);
-
-            /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
-             */
-            qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
 
+/* Move the current batch to request_list, taking the lock only once.  */
+static void thread_pool_submit_bh(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *req, *next;
+    int n = 0;
+
+    if (QTAILQ_EMPTY(&pool->submit_list)) {
+        /* Everything was cancelled */
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    QTAILQ_FOREACH_SAFE(req, &pool->submit_list, reqs, next) {
+        QTAILQ_REMOVE(&pool->submit_list, req, reqs);
+        req->state = THREAD_QUEUED;
+        QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+        n++;
+    }
+    trace_thread_pool_submit_batch(pool, n, pool->idle_threads);
+
+    /* Idle threads pass the wakeup on to each other, see worker_thread() */
+    if (pool->idle_threads) {
+        qemu_sem_post(&pool->sem);
+    }
+    while (pool->cur_threads < pool->max_threads &&
+           pool->idle_threads + pool->new_threads +
+           pool->pending_threads < n) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
 static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
@@ -211,19 +265,22 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
+    if (elem->state == THREAD_BATCHED) {
+        /* Not visible to the workers yet */
+        QTAILQ_REMOVE(&pool->submit_list, elem, reqs);
+        elem->ret = -ECANCELED;
+        thread_pool_complete(pool, elem);
+        return;
+    }
+
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, and none can
+         * while we hold the lock, so we can "steal" it from the workers.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
-
-        elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_complete(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -251,20 +308,20 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
-    req->state = THREAD_QUEUED;
+    req->state = THREAD_BATCHED;
     req->pool = pool;
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Requests submitted in the same event loop iteration are handed to
+     * the workers together by thread_pool_submit_bh().
+     */
+    if (QTAILQ_EMPTY(&pool->submit_list)) {
+        qemu_bh_schedule(pool->submit_bh);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
+    QTAILQ_INSERT_TAIL(&pool->submit_list, req, reqs);
     return &req->common;
 }
 
@@ -305,13 +362,16 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     memset(pool, 0, sizeof(*pool));
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
+    pool->submit_bh = aio_bh_new(ctx, thread_pool_submit_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
     pool->max_threads = 64;
-    pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    QSLIST_INIT(&pool->done_list);
     QLIST_INIT(&pool->head);
+    QTAILQ_INIT(&pool->submit_list);
+    QTAILQ_INIT(&pool->completion_list);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -333,7 +393,6 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_lock(&pool->lock);
 
     /* Stop new threads from spawning */
-    qemu_bh_delete(pool->new_thread_bh);
     pool->cur_threads -= pool->new_threads;
     pool->new_threads = 0;
 
@@ -346,6 +405,7 @@ void thread_pool_free(ThreadPool *pool)
 
     qemu_mutex_unlock(&pool->lock);
 
+    qemu_bh_delete(pool->submit_bh);
     qemu_bh_delete(pool->completion_bh);
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
@@ -308,6 +308,21 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "speculate",
+            .type = QEMU_OPT_BOOL,
+            .help = "Translate jump targets while the vCPU is halted",
+        },
+        {
+            .name = "profile",
+            .type = QEMU_OPT_STRING,
+            .help = "Count executions of translated code (off, tb, insn, mem)",
+        },
+        {
+            .name = "profile-file",
+            .type = QEMU_OPT_STRING,
+            .help = "Write the hottest translated code to a file at exit",
+        },
         { /* end of list */ }
     },
 };
@@ -497,6 +512,9 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrsnapshot",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrcompress",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },